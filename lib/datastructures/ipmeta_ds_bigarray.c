@@ -212,20 +212,24 @@ int ipmeta_ds_bigarray_lookup_pfx(ipmeta_ds_t *ds, int family, void *addrp,
   uint32_t addr = *(uint32_t *)addrp;
   assert(ds != NULL && ds->state != NULL);
 
-  uint64_t total_ips = 1 << (32 - pfxlen);
+  uint64_t total_ips = 1ULL << (32 - pfxlen);
+  uint32_t mask = (pfxlen == 0) ? 0 : UINT32_MAX << (32 - pfxlen);
   uint64_t i;
   int j;
   ipmeta_record_t **recarray;
   uint64_t lookupind, arrayind;
+  uint32_t match_addr;
 
   /* This has HORRIBLE performance. Never use bigarray for prefixes! */
   for (i = 0; i < total_ips; i++) {
-    arrayind = ntohl(addr) + i;
+    arrayind = (ntohl(addr) & mask) + i;
     for (j = 0; j < IPMETA_PROVIDER_MAX; j++) {
       if ((1 << (j)) & providermask) {
         lookupind = LOOKUPINDEX(arrayind, j + 1);
         recarray = (ipmeta_record_t **)(STATE(ds)->lookup_table[lookupind]);
-        if (ipmeta_record_set_add_record(records, recarray[j], 1) != 0) {
+        match_addr = htonl((uint32_t)arrayind);
+        if (ipmeta_record_set_add_match(records, recarray[j], 1, AF_INET,
+                                        &match_addr, 32) != 0) {
           return -1;
         }
       }
@@ -265,3 +269,76 @@ int ipmeta_ds_bigarray_lookup_addr(ipmeta_ds_t *ds, int family, void *addrp,
   }
   return (int)found->n_recs;
 }
+
+/* Visit the prefixes that make up the range of addresses [first, last] */
+static int iterate_range(uint64_t first, uint64_t last, ipmeta_record_t *record,
+                         ipmeta_ds_iterate_cb_t *cb, void *user)
+{
+  uint32_t addr;
+  uint8_t pfxlen;
+
+  while (first <= last) {
+    /* the largest aligned block that starts at first and ends before last */
+    pfxlen = 0;
+    while (pfxlen < 32 && ((first & ((1ULL << (32 - pfxlen)) - 1)) != 0 ||
+                           first + (1ULL << (32 - pfxlen)) - 1 > last)) {
+      pfxlen++;
+    }
+    addr = htonl((uint32_t)first);
+    if (cb(AF_INET, &addr, pfxlen, record, user) != 0) {
+      return -1;
+    }
+    first += 1ULL << (32 - pfxlen);
+  }
+  return 0;
+}
+
+int ipmeta_ds_bigarray_iterate(ipmeta_ds_t *ds, int family,
+                               uint32_t providermask,
+                               ipmeta_ds_iterate_cb_t *cb, void *user)
+{
+  uint32_t lookupind, run_id;
+  uint64_t i, run_start;
+  int j;
+
+  if (family != AF_INET) {
+    /* nothing is stored for other families */
+    return 0;
+  }
+
+  /* the array does not keep the original prefixes, so each run of addresses
+     with the same record is split into the fewest prefixes */
+  for (j = 1; j <= IPMETA_PROVIDER_MAX; j++) {
+    if (((1 << (j - 1)) & providermask) == 0) {
+      continue;
+    }
+    run_id = 0;
+    run_start = 0;
+    for (i = 0; i <= UINT32_MAX; i++) {
+      lookupind = LOOKUPINDEX(i, j);
+      if (lookupind == run_id) {
+        continue;
+      }
+      if (run_id != 0 &&
+          iterate_range(run_start, i - 1, STATE(ds)->lookup_table[run_id][j - 1],
+                        cb, user) != 0) {
+        return -1;
+      }
+      run_id = lookupind;
+      run_start = i;
+    }
+    if (run_id != 0 &&
+        iterate_range(run_start, UINT32_MAX,
+                      STATE(ds)->lookup_table[run_id][j - 1], cb, user) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_bigarray_finalize(ipmeta_ds_t *ds)
+{
+  /* each address already maps directly to the records of every provider */
+  return 0;
+}
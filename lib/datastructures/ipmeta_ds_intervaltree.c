@@ -36,6 +36,8 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "interval_tree.h"
 
@@ -53,6 +55,11 @@ typedef struct ipmeta_ds_intervaltree_state {
   interval_tree_t *tree;
   uint8_t providerid;
 
+  /** The intervals of the tree in address order (built by finalize, and
+      discarded when a prefix is added) */
+  interval_t **sorted;
+  int sorted_cnt;
+
 } ipmeta_ds_intervaltree_state_t;
 
 ipmeta_ds_t *ipmeta_ds_intervaltree_alloc()
@@ -76,6 +83,8 @@ int ipmeta_ds_intervaltree_init(ipmeta_ds_t *ds)
     return -1;
   }
   STATE(ds)->providerid = 0;
+  STATE(ds)->sorted = NULL;
+  STATE(ds)->sorted_cnt = 0;
 
   return 0;
 }
@@ -91,6 +100,8 @@ void ipmeta_ds_intervaltree_free(ipmeta_ds_t *ds)
       interval_tree_free(STATE(ds)->tree);
       STATE(ds)->tree = NULL;
     }
+    free(STATE(ds)->sorted);
+    STATE(ds)->sorted = NULL;
 
     free(STATE(ds));
     ds->state = NULL;
@@ -131,6 +142,10 @@ int ipmeta_ds_intervaltree_add_prefix(ipmeta_ds_t *ds, int family, void *addrp,
     return -1;
   }
 
+  free(STATE(ds)->sorted);
+  STATE(ds)->sorted = NULL;
+  STATE(ds)->sorted_cnt = 0;
+
   if (interval_tree_add_interval(tree, &interval) == -1) {
     ipmeta_log(__func__, "could not malloc to insert prefix in interval tree");
     return -1;
@@ -153,10 +168,15 @@ int ipmeta_ds_intervaltree_lookup_pfx(ipmeta_ds_t *ds, int family, void *addrp,
   interval_t **matches = NULL;
   uint32_t ov_start;
   uint32_t ov_end;
+  uint32_t mask;
+  uint32_t match_addr;
+  uint8_t match_len;
   int i;
 
-  interval.start = ntohl(addr);
-  interval.end = interval.start + (1 << (32 - pfxlen)) - 1;
+  /* the address may have bits set beyond the prefix length */
+  mask = (pfxlen == 0) ? 0 : UINT32_MAX << (32 - pfxlen);
+  interval.start = ntohl(addr) & mask;
+  interval.end = interval.start | ~mask;
   interval.data = NULL;
 
   matches = getOverlapping(tree, &interval, &num_matches);
@@ -168,9 +188,14 @@ int ipmeta_ds_intervaltree_lookup_pfx(ipmeta_ds_t *ds, int family, void *addrp,
 
     ov_end = (interval.end < matches[i]->end) ? interval.end : matches[i]->end;
 
-    if (ipmeta_record_set_add_record(records,
-                                     (ipmeta_record_t *)matches[i]->data,
-                                     ov_end - ov_start + 1) != 0) {
+    /* both intervals are prefixes, so the overlap is one too */
+    match_len = (uint8_t)(32 - __builtin_popcount(ov_end - ov_start));
+    match_addr = htonl(ov_start);
+
+    if (ipmeta_record_set_add_match(records,
+                                    (ipmeta_record_t *)matches[i]->data,
+                                    (uint64_t)ov_end - ov_start + 1, AF_INET,
+                                    &match_addr, match_len) != 0) {
       return -1;
     }
   }
@@ -210,3 +235,96 @@ int ipmeta_ds_intervaltree_lookup_addr(ipmeta_ds_t *ds, int family, void *addrp,
 
   return (int)found->n_recs;
 }
+
+/* Order intervals by start address, longer intervals first */
+static int interval_cmp(const void *a, const void *b)
+{
+  const interval_t *ia = *(const interval_t *const *)a;
+  const interval_t *ib = *(const interval_t *const *)b;
+
+  if (ia->start != ib->start) {
+    return (ia->start < ib->start) ? -1 : 1;
+  }
+  if (ia->end != ib->end) {
+    return (ia->end > ib->end) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Build the array of intervals in address order */
+static int build_sorted(ipmeta_ds_t *ds)
+{
+  interval_t interval;
+  interval_t **matches;
+  int num_matches = 0;
+
+  free(STATE(ds)->sorted);
+  STATE(ds)->sorted = NULL;
+  STATE(ds)->sorted_cnt = 0;
+
+  interval.start = 0;
+  interval.end = UINT32_MAX;
+  interval.data = NULL;
+  matches = getOverlapping(STATE(ds)->tree, &interval, &num_matches);
+  if (num_matches == 0) {
+    return 0;
+  }
+
+  /* the matches belong to the tree, so sort a copy */
+  if ((STATE(ds)->sorted = malloc(sizeof(interval_t *) * num_matches)) ==
+      NULL) {
+    ipmeta_log(__func__, "could not malloc interval array");
+    return -1;
+  }
+  memcpy(STATE(ds)->sorted, matches, sizeof(interval_t *) * num_matches);
+  qsort(STATE(ds)->sorted, num_matches, sizeof(interval_t *), interval_cmp);
+  STATE(ds)->sorted_cnt = num_matches;
+
+  return 0;
+}
+
+int ipmeta_ds_intervaltree_iterate(ipmeta_ds_t *ds, int family,
+                                   uint32_t providermask,
+                                   ipmeta_ds_iterate_cb_t *cb, void *user)
+{
+  interval_t **sorted;
+  ipmeta_record_t *record;
+  uint64_t size;
+  uint32_t addr;
+  uint8_t pfxlen;
+  int i;
+
+  if (family != AF_INET) {
+    /* nothing is stored for other families */
+    return 0;
+  }
+
+  if (STATE(ds)->sorted == NULL && build_sorted(ds) != 0) {
+    return -1;
+  }
+  sorted = STATE(ds)->sorted;
+
+  for (i = 0; i < STATE(ds)->sorted_cnt; i++) {
+    record = (ipmeta_record_t *)sorted[i]->data;
+    if (((1 << (record->source - 1)) & providermask) == 0) {
+      continue;
+    }
+    /* intervals are only ever added for prefixes */
+    size = (uint64_t)sorted[i]->end - sorted[i]->start + 1;
+    for (pfxlen = 32; pfxlen > 0 && (1ULL << (32 - pfxlen)) < size; pfxlen--)
+      ;
+    addr = htonl(sorted[i]->start);
+    if (cb(AF_INET, &addr, pfxlen, record, user) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_intervaltree_finalize(ipmeta_ds_t *ds)
+{
+  /* the tree only ever holds the records of a single provider, so all that
+     is left to do is to put its intervals in order for iterate */
+  return build_sorted(ds);
+}
@@ -35,12 +35,15 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
 #include "patricia.h"
 
 #include "libipmeta_int.h"
 #include "ipmeta_ds_patricia.h"
+#include "ipmeta_ranges.h"
 
 #define DS_NAME "patricia"
 
@@ -55,11 +58,366 @@ enum { IPV4_IDX, IPV6_IDX, NUM_IPV };
 #define family_size(fam) \
   ((fam) == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr))
 
+/** Number of entries (one per /16) in the index of the IPv4 overlay */
+#define OVERLAY_V4_INDEX_LEN 65536
+
+/** The records that each provider has for a range of addresses */
+typedef struct overlay_tuple {
+  ipmeta_record_t *recs[IPMETA_PROVIDER_MAX];
+} overlay_tuple_t;
+
+static inline khint_t overlay_tuple_hash(overlay_tuple_t tuple)
+{
+  khint_t h = 0;
+  int i;
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    h = (h << 5) - h + kh_int64_hash_func((uint64_t)(uintptr_t)tuple.recs[i]);
+  }
+  return h;
+}
+
+#define overlay_tuple_equal(a, b)                                              \
+  (memcmp((a).recs, (b).recs, sizeof((a).recs)) == 0)
+
+/** Map from a tuple to its index in the overlay */
+KHASH_INIT(ovtuples, overlay_tuple_t, uint32_t, 1, overlay_tuple_hash,
+           overlay_tuple_equal)
+
+/** The address space split into the ranges over which the records of all
+ * providers are constant
+ *
+ * Looking an address up in the trie means climbing from the most specific
+ * prefix until every provider has been found, which gets slower as more
+ * providers are enabled. The overlay is built from the trie once all
+ * prefixes have been added, and finds the records of all providers with a
+ * single search.
+ */
+typedef struct overlay {
+  /** Distinct tuples of records (the first one has no records) */
+  overlay_tuple_t *tuples;
+  uint32_t tuples_cnt;
+  uint32_t tuples_alloc;
+
+  /** First address of each IPv4 range (the first one is always 0) */
+  uint32_t *v4_starts;
+
+  /** Tuple of each IPv4 range */
+  uint32_t *v4_tuples;
+
+  /** Number of IPv4 ranges */
+  uint32_t v4_cnt;
+
+  /** Index of the IPv4 range containing the first address of each /16 (the
+      last entry is the index of the last range) */
+  uint32_t v4_index[OVERLAY_V4_INDEX_LEN + 1];
+
+  /** First address of each IPv6 range (the first one is always ::) */
+  ipmeta_addr128_t *v6_starts;
+
+  /** Tuple of each IPv6 range */
+  uint32_t *v6_tuples;
+
+  /** Number of IPv6 ranges */
+  uint32_t v6_cnt;
+
+} overlay_t;
+
 typedef struct ipmeta_ds_patricia_state {
   patricia_tree_t *trie[NUM_IPV];
 
+  /** Overlay of all providers (NULL until finalize has been called, and
+      again as soon as another prefix is added) */
+  overlay_t *overlay;
+
 } ipmeta_ds_patricia_state_t;
 
+/** State used while the ranges of one address family are built */
+typedef struct overlay_builder {
+  int family;
+  overlay_t *overlay;
+
+  /** Tuples of the overlay */
+  khash_t(ovtuples) *tuple_ids;
+
+  /** Ranges built so far (each range ends where the next one starts) */
+  ipmeta_addr128_t *starts;
+  uint32_t *tuples;
+  uint32_t cnt;
+  uint32_t alloc;
+
+} overlay_builder_t;
+
+static void overlay_free(overlay_t *overlay)
+{
+  if (overlay == NULL) {
+    return;
+  }
+  free(overlay->tuples);
+  free(overlay->v4_starts);
+  free(overlay->v4_tuples);
+  free(overlay->v6_starts);
+  free(overlay->v6_tuples);
+  free(overlay);
+}
+
+/* Get the index of a tuple, adding it to the overlay if it is new */
+static int overlay_tuple_id(overlay_builder_t *b, const overlay_tuple_t *tuple,
+                            uint32_t *id)
+{
+  overlay_t *ov = b->overlay;
+  overlay_tuple_t *tmp;
+  khiter_t k;
+  int khret;
+
+  k = kh_put(ovtuples, b->tuple_ids, *tuple, &khret);
+  if (khret < 0) {
+    return -1;
+  }
+  if (khret == 0) {
+    *id = kh_val(b->tuple_ids, k);
+    return 0;
+  }
+
+  if (ov->tuples_cnt == ov->tuples_alloc) {
+    ov->tuples_alloc = ov->tuples_alloc ? ov->tuples_alloc * 2 : 1024;
+    if ((tmp = realloc(ov->tuples, sizeof(overlay_tuple_t) *
+                                     ov->tuples_alloc)) == NULL) {
+      kh_del(ovtuples, b->tuple_ids, k);
+      return -1;
+    }
+    ov->tuples = tmp;
+  }
+  ov->tuples[ov->tuples_cnt] = *tuple;
+  *id = kh_val(b->tuple_ids, k) = ov->tuples_cnt++;
+  return 0;
+}
+
+/* Start a new range at start (which is always after the start of the last
+   range), merging it with the previous range if the tuple is the same */
+static int overlay_add_range(overlay_builder_t *b, ipmeta_addr128_t start,
+                             uint32_t tuple)
+{
+  ipmeta_addr128_t *tmp_starts;
+  uint32_t *tmp_tuples;
+  uint32_t new_alloc;
+
+  if (b->cnt > 0 && b->tuples[b->cnt - 1] == tuple) {
+    return 0;
+  }
+
+  if (b->cnt == b->alloc) {
+    new_alloc = b->alloc ? b->alloc * 2 : 1024;
+    if ((tmp_starts = realloc(b->starts, sizeof(ipmeta_addr128_t) *
+                                           new_alloc)) == NULL) {
+      return -1;
+    }
+    b->starts = tmp_starts;
+    if ((tmp_tuples = realloc(b->tuples, sizeof(uint32_t) * new_alloc)) ==
+        NULL) {
+      return -1;
+    }
+    b->tuples = tmp_tuples;
+    b->alloc = new_alloc;
+  }
+  b->starts[b->cnt] = start;
+  b->tuples[b->cnt] = tuple;
+  b->cnt++;
+  return 0;
+}
+
+/* Build the ranges of one address family by merging the flattened prefixes
+   of every provider */
+static int overlay_build_family(ipmeta_ds_t *ds, overlay_builder_t *b)
+{
+  ipmeta_ranges_t ranges[IPMETA_PROVIDER_MAX];
+  uint64_t pos[IPMETA_PROVIDER_MAX];
+  ipmeta_addr128_t start = {0, 0};
+  ipmeta_addr128_t next = {0, 0};
+  overlay_tuple_t tuple;
+  int have_next;
+  uint32_t id;
+  int rc = -1;
+  int i;
+
+  memset(ranges, 0, sizeof(ranges));
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (ipmeta_ranges_build(ds, b->family, i + 1, &ranges[i]) != 0) {
+      goto done;
+    }
+    pos[i] = 0;
+  }
+
+  while (1) {
+    /* the records that each provider has from start until the next range of
+       any provider begins */
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      tuple.recs[i] = ranges[i].records[pos[i]];
+    }
+    if (overlay_tuple_id(b, &tuple, &id) != 0 ||
+        overlay_add_range(b, start, id) != 0) {
+      goto done;
+    }
+
+    have_next = 0;
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      if (pos[i] + 1 < ranges[i].cnt &&
+          (have_next == 0 ||
+           ipmeta_addr128_cmp(&ranges[i].starts[pos[i] + 1], &next) < 0)) {
+        next = ranges[i].starts[pos[i] + 1];
+        have_next = 1;
+      }
+    }
+    if (have_next == 0) {
+      break;
+    }
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      if (pos[i] + 1 < ranges[i].cnt &&
+          ipmeta_addr128_cmp(&ranges[i].starts[pos[i] + 1], &next) == 0) {
+        pos[i]++;
+      }
+    }
+    start = next;
+  }
+  rc = 0;
+
+done:
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    ipmeta_ranges_clear(&ranges[i]);
+  }
+  return rc;
+}
+
+static overlay_t *overlay_build(ipmeta_ds_t *ds)
+{
+  overlay_t *ov = NULL;
+  overlay_builder_t *b = NULL;
+  overlay_tuple_t empty;
+  uint32_t id, i, k, addr;
+
+  if ((ov = malloc_zero(sizeof(overlay_t))) == NULL ||
+      (b = malloc_zero(sizeof(overlay_builder_t))) == NULL ||
+      (b->tuple_ids = kh_init(ovtuples)) == NULL) {
+    goto err;
+  }
+  b->overlay = ov;
+
+  /* the tuple of addresses that no provider has records for */
+  memset(&empty, 0, sizeof(empty));
+  if (overlay_tuple_id(b, &empty, &id) != 0) {
+    goto err;
+  }
+  assert(id == 0);
+
+  b->family = AF_INET;
+  if (overlay_build_family(ds, b) != 0) {
+    goto err;
+  }
+  ov->v4_cnt = b->cnt;
+  if ((ov->v4_starts = malloc(sizeof(uint32_t) * ov->v4_cnt)) == NULL) {
+    goto err;
+  }
+  for (i = 0; i < ov->v4_cnt; i++) {
+    ov->v4_starts[i] = (uint32_t)b->starts[i].lo;
+  }
+  ov->v4_tuples = b->tuples;
+  free(b->starts);
+  b->starts = NULL;
+  b->tuples = NULL;
+  b->cnt = b->alloc = 0;
+
+  /* narrow lookups down to the ranges that overlap a /16 */
+  for (i = 0, k = 0; k < OVERLAY_V4_INDEX_LEN; k++) {
+    addr = k << 16;
+    while (i + 1 < ov->v4_cnt && ov->v4_starts[i + 1] <= addr) {
+      i++;
+    }
+    ov->v4_index[k] = i;
+  }
+  ov->v4_index[OVERLAY_V4_INDEX_LEN] = ov->v4_cnt - 1;
+
+  b->family = AF_INET6;
+  if (overlay_build_family(ds, b) != 0) {
+    goto err;
+  }
+  ov->v6_cnt = b->cnt;
+  ov->v6_starts = b->starts;
+  ov->v6_tuples = b->tuples;
+  b->starts = NULL;
+  b->tuples = NULL;
+
+  kh_destroy(ovtuples, b->tuple_ids);
+  free(b);
+  return ov;
+
+err:
+  if (b != NULL) {
+    if (b->tuple_ids != NULL) {
+      kh_destroy(ovtuples, b->tuple_ids);
+    }
+    free(b->starts);
+    free(b->tuples);
+    free(b);
+  }
+  overlay_free(ov);
+  return NULL;
+}
+
+static int overlay_lookup_addr(overlay_t *ov, int family, void *addrp,
+                               uint32_t provmask, ipmeta_record_set_t *found)
+{
+  overlay_tuple_t *tuple;
+  ipmeta_addr128_t addr;
+  uint32_t lo, hi, mid;
+  uint32_t v4;
+  uint64_t num_ips;
+  int i;
+
+  if (family == AF_INET) {
+    memcpy(&v4, addrp, sizeof(v4));
+    v4 = ntohl(v4);
+    lo = ov->v4_index[v4 >> 16];
+    hi = ov->v4_index[(v4 >> 16) + 1];
+    /* find the last range that starts at or before the address */
+    while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      if (ov->v4_starts[mid] <= v4) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    tuple = &ov->tuples[ov->v4_tuples[lo]];
+    num_ips = 1;
+  } else {
+    ipmeta_addr128_from_bytes(family, addrp, &addr);
+    lo = 0;
+    hi = ov->v6_cnt - 1;
+    while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      if (ipmeta_addr128_cmp(&ov->v6_starts[mid], &addr) <= 0) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    tuple = &ov->tuples[ov->v6_tuples[lo]];
+    /* the same count that the trie lookup reports */
+    num_ips = 1UL << (64 - 32);
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (((1 << i) & provmask) == 0 || tuple->recs[i] == NULL) {
+      continue;
+    }
+    if (ipmeta_record_set_add_record(found, tuple->recs[i], num_ips) != 0) {
+      return -1;
+    }
+  }
+
+  return (int)found->n_recs;
+}
+
 ipmeta_ds_t *ipmeta_ds_patricia_alloc()
 {
   return &ipmeta_ds_patricia;
@@ -71,7 +429,7 @@ int ipmeta_ds_patricia_init(ipmeta_ds_t *ds)
 
   assert(STATE(ds) == NULL);
 
-  if ((ds->state = malloc(sizeof(ipmeta_ds_patricia_state_t))) == NULL) {
+  if ((ds->state = malloc_zero(sizeof(ipmeta_ds_patricia_state_t))) == NULL) {
     ipmeta_log(__func__, "could not malloc patricia state");
     return -1;
   }
@@ -103,6 +461,9 @@ void ipmeta_ds_patricia_free(ipmeta_ds_t *ds)
       }
     }
 
+    overlay_free(STATE(ds)->overlay);
+    STATE(ds)->overlay = NULL;
+
     free(STATE(ds));
     ds->state = NULL;
   }
@@ -139,6 +500,12 @@ int ipmeta_ds_patricia_add_prefix(ipmeta_ds_t *ds, int family, void *addrp, uint
   recarray = (ipmeta_record_t **)(trie_node->data);
   recarray[record->source - 1] = record;
 
+  /* the overlay no longer matches the trie */
+  if (STATE(ds)->overlay != NULL) {
+    overlay_free(STATE(ds)->overlay);
+    STATE(ds)->overlay = NULL;
+  }
+
   return 0;
 }
 
@@ -147,7 +514,8 @@ static inline int extract_records_from_pnode(patricia_node_t *node,
                                              uint32_t *foundsofar,
                                              ipmeta_record_set_t *found,
                                              uint8_t ascendallowed,
-                                             uint8_t masklen)
+                                             uint8_t masklen,
+                                             prefix_t *match)
 {
   ipmeta_record_t **recfound;
 
@@ -176,7 +544,9 @@ static inline int extract_records_from_pnode(patricia_node_t *node,
         family_size(node->prefix->family) * 8;
       uint64_t num_ips = (masklen <= maxlen) ? (1UL << (maxlen - masklen)) : 0;
 
-      if (ipmeta_record_set_add_record(found, recfound[i], num_ips) != 0) {
+      if (ipmeta_record_set_add_match(found, recfound[i], num_ips,
+                                      match->family, &match->add,
+                                      match->bitlen) != 0) {
         return -1;
       }
       *foundsofar |= (1 << (i));
@@ -227,8 +597,7 @@ static int descend_ptree(ipmeta_ds_t *ds, prefix_t pfx, uint32_t provmask,
 
     if (node) {
       if (extract_records_from_pnode(node, provmask, &sub_foundsofar, records,
-            0, subpfx.bitlen) < 0) {
-        ipmeta_log(__func__, "error while extracting records for prefix");
+            0, subpfx.bitlen, &subpfx) < 0) {
         return -1;
       }
     }
@@ -265,8 +634,7 @@ static int _patricia_prefix_lookup(ipmeta_ds_t *ds, prefix_t pfx,
 
   if (node) {
     if (extract_records_from_pnode(node, provmask, &foundsofar, records, 1,
-          pfx.bitlen) < 0) {
-      ipmeta_log(__func__, "error while extracting records for prefix");
+          pfx.bitlen, &pfx) < 0) {
       return -1;
     }
   }
@@ -292,7 +660,9 @@ int ipmeta_ds_patricia_lookup_pfx(ipmeta_ds_t *ds, int family, void *addrp,
   memcpy(&pfx.add, addrp, family_size(family));
   pfx.bitlen = pfxlen;
 
-  _patricia_prefix_lookup(ds, pfx, providermask, records);
+  if (_patricia_prefix_lookup(ds, pfx, providermask, records) < 0) {
+    return -1;
+  }
 
   return (int)records->n_recs;
 }
@@ -305,6 +675,11 @@ int ipmeta_ds_patricia_lookup_addr(ipmeta_ds_t *ds, int family, void *addrp,
   prefix_t pfx;
   uint32_t foundsofar = 0;
 
+  if (STATE(ds)->overlay != NULL) {
+    return overlay_lookup_addr(STATE(ds)->overlay, family, addrp, provmask,
+                               found);
+  }
+
   pfx.family = family;
   pfx.ref_count = 0;
   memcpy(&pfx.add, addrp, family_size(family));
@@ -314,9 +689,52 @@ int ipmeta_ds_patricia_lookup_addr(ipmeta_ds_t *ds, int family, void *addrp,
     return 0;
   }
 
-  if (extract_records_from_pnode(node, provmask, &foundsofar, found, 1, 32) < 0) {
+  if (extract_records_from_pnode(node, provmask, &foundsofar, found, 1, 32,
+                                 &pfx) < 0) {
     return -1;
   }
 
   return (int)found->n_recs;
 }
+
+int ipmeta_ds_patricia_iterate(ipmeta_ds_t *ds, int family,
+    uint32_t providermask, ipmeta_ds_iterate_cb_t *cb, void *user)
+{
+  patricia_tree_t *trie = STATE(ds)->trie[family_to_idx(family)];
+  patricia_node_t *node;
+  ipmeta_record_t **recarray;
+  int i;
+
+  /* a pre-order walk visits covering prefixes first, and the 0 branch before
+     the 1 branch, i.e. prefixes are visited in address order */
+  PATRICIA_WALK(trie->head, node) {
+    if ((recarray = (ipmeta_record_t **)node->data) != NULL) {
+      for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+        if (((1 << i) & providermask) == 0 || recarray[i] == NULL) {
+          continue;
+        }
+        if (cb(family, &node->prefix->add, node->prefix->bitlen, recarray[i],
+               user) != 0) {
+          return -1;
+        }
+      }
+    }
+  } PATRICIA_WALK_END;
+
+  return 0;
+}
+
+int ipmeta_ds_patricia_finalize(ipmeta_ds_t *ds)
+{
+  overlay_free(STATE(ds)->overlay);
+
+  if ((STATE(ds)->overlay = overlay_build(ds)) == NULL) {
+    ipmeta_log(__func__, "could not build provider overlay");
+    return -1;
+  }
+  ipmeta_log(__func__, "built overlay of %" PRIu32 " IPv4 and %" PRIu32
+             " IPv6 ranges (%" PRIu32 " record tuples)",
+             STATE(ds)->overlay->v4_cnt, STATE(ds)->overlay->v6_cnt,
+             STATE(ds)->overlay->tuples_cnt);
+  return 0;
+}
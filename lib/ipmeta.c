@@ -36,6 +36,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +50,7 @@
 #include "ipmeta_ds.h"
 #include "ipmeta_provider.h"
 #include "ipvx_utils.h"
+#include "ipmeta_pton.h"
 
 #define MAXOPTS 1024
 
@@ -81,6 +83,19 @@ ipmeta_t *ipmeta_init(enum ipmeta_ds_id dstype)
   }
   ipmeta_log(__func__, "using datastore %s", ipmeta->datastore->name);
 
+  if ((ipmeta->strings = ipmeta_strpool_init()) == NULL) {
+    ipmeta_log(__func__, "could not create string pool");
+    ipmeta_free(ipmeta);
+    return NULL;
+  }
+
+  if ((ipmeta->regions = ipmeta_strdict_init(ipmeta->strings)) == NULL ||
+      (ipmeta->timezones = ipmeta_strdict_init(ipmeta->strings)) == NULL) {
+    ipmeta_log(__func__, "could not create attribute dictionaries");
+    ipmeta_free(ipmeta);
+    return NULL;
+  }
+
   return ipmeta;
 }
 
@@ -95,7 +110,12 @@ void ipmeta_free(ipmeta_t *ipmeta)
   for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
     ipmeta_provider_free(ipmeta, ipmeta->providers[i]);
   }
+  ipmeta_revidx_free(ipmeta->revidx);
   ipmeta->datastore->free(ipmeta->datastore);
+  /* only now that no records reference them */
+  ipmeta_strdict_free(ipmeta->regions);
+  ipmeta_strdict_free(ipmeta->timezones);
+  ipmeta_strpool_free(ipmeta->strings);
   free(ipmeta);
   return;
 }
@@ -117,6 +137,10 @@ int ipmeta_enable_provider(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
     parse_cmd(local_args, &process_argc, process_argv, MAXOPTS, provider->name);
   }
 
+  /* the reverse indexes would not include the new provider */
+  ipmeta_revidx_free(ipmeta->revidx);
+  ipmeta->revidx = NULL;
+
   /* we just need to pass this along to the provider framework */
   rc = ipmeta_provider_init(ipmeta, provider, process_argc, process_argv);
 
@@ -169,6 +193,32 @@ inline int ipmeta_lookup_pfx(ipmeta_t *ipmeta, int family, void *addrp,
                                        providermask, records);
 }
 
+int ipmeta_lookup_pfx_iter(ipmeta_t *ipmeta, int family, void *addrp,
+                           uint8_t pfxlen, uint32_t providermask,
+                           ipmeta_lookup_pfx_cb_t *cb, void *user)
+{
+  ipmeta_record_set_t sink;
+  int rc;
+
+  assert(ipmeta != NULL && cb != NULL);
+
+  /* a set that never stores anything, so needs no memory */
+  memset(&sink, 0, sizeof(sink));
+  sink.sink = cb;
+  sink.sink_user = user;
+
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+  rc = ipmeta->datastore->lookup_pfx(ipmeta->datastore, family, addrp, pfxlen,
+                                     providermask, &sink);
+  if (rc < 0 || sink.sink_stopped) {
+    return -1;
+  }
+  return (int)sink.n_recs;
+}
+
 inline int ipmeta_lookup_addr(ipmeta_t *ipmeta, int family, void *addrp,
                               uint32_t providermask, ipmeta_record_set_t *found)
 {
@@ -180,13 +230,13 @@ inline int ipmeta_lookup_addr(ipmeta_t *ipmeta, int family, void *addrp,
                                         providermask, found);
 }
 
-inline int ipmeta_lookup(ipmeta_t *ipmeta, const char *addr_str,
-                         uint32_t providermask, ipmeta_record_set_t *found)
+static int lookup_str(ipmeta_t *ipmeta, const char *addr_str, size_t len,
+                      uint32_t providermask, ipmeta_record_set_t *found)
 {
   ipvx_prefix_t pfx;
   int rc;
 
-  if ((rc = ipvx_pton_pfx(addr_str, &pfx)) < 0) {
+  if (ipmeta_pton_pfx(addr_str, len, &pfx) != 0) {
     return IPMETA_ERR_INPUT;
   }
 
@@ -198,6 +248,75 @@ inline int ipmeta_lookup(ipmeta_t *ipmeta, const char *addr_str,
   return (rc < 0) ? IPMETA_ERR_INTERNAL : rc;
 }
 
+inline int ipmeta_lookup(ipmeta_t *ipmeta, const char *addr_str,
+                         uint32_t providermask, ipmeta_record_set_t *found)
+{
+  return lookup_str(ipmeta, addr_str, strlen(addr_str), providermask, found);
+}
+
+int ipmeta_lookup_lines(ipmeta_t *ipmeta, const char *buf, size_t len,
+                        uint32_t providermask, ipmeta_record_set_t *found,
+                        ipmeta_lookup_lines_cb_t *cb, void *user)
+{
+  const char *end = buf + len;
+  const char *line = buf;
+  const char *eol;
+  const char *addr_end;
+  int cnt = 0;
+  int rc;
+
+  while (line < end) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL) {
+      eol = end;
+    }
+
+    /* anything after a '|' is ignored */
+    if ((addr_end = memchr(line, '|', eol - line)) == NULL) {
+      addr_end = eol;
+      if (addr_end > line && addr_end[-1] == '\r') {
+        addr_end--;
+      }
+    }
+
+    if (addr_end > line && *line != '#') {
+      rc = lookup_str(ipmeta, line, addr_end - line, providermask, found);
+      if (rc == IPMETA_ERR_INTERNAL) {
+        ipmeta_log(__func__, "ERROR: lookup failed for '%.*s'",
+                   (int)(addr_end - line), line);
+        return -1;
+      }
+      cnt++;
+      if (cb(line, addr_end - line, rc, found, user) != 0) {
+        return -1;
+      }
+    }
+
+    if (eol == end) {
+      break;
+    }
+    line = eol + 1;
+  }
+
+  return cnt;
+}
+
+int ipmeta_foreach_prefix(ipmeta_t *ipmeta, int family, uint32_t providermask,
+                          ipmeta_foreach_prefix_cb_t *cb, void *user)
+{
+  assert(ipmeta != NULL && cb != NULL);
+
+  if (family != AF_INET && family != AF_INET6) {
+    ipmeta_log(__func__, "unsupported address family %d", family);
+    return -1;
+  }
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+  return ipmeta->datastore->iterate(ipmeta->datastore, family, providermask,
+                                    cb, user);
+}
+
 inline int ipmeta_is_provider_enabled(ipmeta_provider_t *provider)
 {
   assert(provider != NULL);
@@ -223,6 +342,99 @@ ipmeta_provider_t **ipmeta_get_all_providers(ipmeta_t *ipmeta)
   return ipmeta->providers;
 }
 
+/* Value of a country code character in [0,36), -1 if it is not
+   alphanumeric */
+static int country_char_val(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+static const char country_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+uint16_t ipmeta_country_id(const char *country_code)
+{
+  int hi, lo;
+
+  if (country_code == NULL ||
+      (hi = country_char_val(country_code[0])) < 0 ||
+      (lo = country_char_val(country_code[1])) < 0) {
+    return 0;
+  }
+  return (uint16_t)(1 + hi * 36 + lo);
+}
+
+char *ipmeta_country_from_id(uint16_t country_id, char *buf)
+{
+  if (country_id == 0 || country_id >= IPMETA_COUNTRY_ID_CNT) {
+    buf[0] = buf[1] = '?';
+  } else {
+    buf[0] = country_chars[(country_id - 1) / 36];
+    buf[1] = country_chars[(country_id - 1) % 36];
+  }
+  buf[2] = '\0';
+  return buf;
+}
+
+static const char *continent_strings[] = {
+  "??", "AF", "AN", "AS", "EU", "NA", "OC", "SA",
+};
+
+ipmeta_continent_t ipmeta_continent_id(const char *continent_code)
+{
+  int i;
+
+  if (continent_code == NULL) {
+    return IPMETA_CONTINENT_UNKNOWN;
+  }
+  for (i = 1; i < IPMETA_CONTINENT_CNT; i++) {
+    if ((continent_code[0] & ~0x20) == continent_strings[i][0] &&
+        (continent_code[1] & ~0x20) == continent_strings[i][1]) {
+      return (ipmeta_continent_t)i;
+    }
+  }
+  return IPMETA_CONTINENT_UNKNOWN;
+}
+
+const char *ipmeta_continent_from_id(ipmeta_continent_t continent_id)
+{
+  if ((unsigned)continent_id >= IPMETA_CONTINENT_CNT) {
+    return continent_strings[IPMETA_CONTINENT_UNKNOWN];
+  }
+  return continent_strings[continent_id];
+}
+
+const char *ipmeta_region_from_id(ipmeta_t *ipmeta, uint32_t region_id)
+{
+  const char *key = ipmeta_strdict_str(ipmeta->regions, region_id);
+
+  /* skip the country code that the region is qualified with */
+  return (key != NULL) ? key + IPMETA_REGION_KEY_PREFIX_LEN : NULL;
+}
+
+uint32_t ipmeta_region_id_cnt(ipmeta_t *ipmeta)
+{
+  return ipmeta_strdict_cnt(ipmeta->regions);
+}
+
+const char *ipmeta_timezone_from_id(ipmeta_t *ipmeta, uint32_t timezone_id)
+{
+  return ipmeta_strdict_str(ipmeta->timezones, timezone_id);
+}
+
+uint32_t ipmeta_timezone_id_cnt(ipmeta_t *ipmeta)
+{
+  return ipmeta_strdict_cnt(ipmeta->timezones);
+}
+
 ipmeta_record_set_t *ipmeta_record_set_init()
 {
   ipmeta_record_set_t *record_set;
@@ -250,6 +462,32 @@ void ipmeta_record_set_clear(ipmeta_record_set_t *record_set)
 
   record_set->n_recs = 0;
   record_set->_cursor = 0;
+
+  if (record_set->aggr_index != NULL) {
+    kh_clear(ipmeta_aggrhash, record_set->aggr_index);
+  }
+}
+
+int ipmeta_record_set_set_aggregation(ipmeta_record_set_t *record_set,
+                                      ipmeta_aggr_t aggr, ipmeta_attr_t attr)
+{
+  assert(record_set != NULL);
+
+  if (aggr == IPMETA_AGGR_ATTR && attr == IPMETA_ATTR_NONE) {
+    ipmeta_log(__func__, "no attribute to aggregate by");
+    return -1;
+  }
+
+  if (aggr != IPMETA_AGGR_NONE && record_set->aggr_index == NULL &&
+      (record_set->aggr_index = kh_init(ipmeta_aggrhash)) == NULL) {
+    ipmeta_log(__func__, "could not create aggregation index");
+    return -1;
+  }
+
+  record_set->aggr = aggr;
+  record_set->aggr_attr = attr;
+  ipmeta_record_set_clear(record_set);
+  return 0;
 }
 
 void ipmeta_record_set_free(ipmeta_record_set_t **record_set_p)
@@ -265,6 +503,11 @@ void ipmeta_record_set_free(ipmeta_record_set_t **record_set_p)
   free(record_set->ip_cnts);
   record_set->ip_cnts = NULL;
 
+  if (record_set->aggr_index != NULL) {
+    kh_destroy(ipmeta_aggrhash, record_set->aggr_index);
+    record_set->aggr_index = NULL;
+  }
+
   record_set->n_recs = 0;
   record_set->_cursor = 0;
   record_set->_alloc_size = 0;
@@ -293,34 +536,148 @@ ipmeta_record_t *ipmeta_record_set_next(ipmeta_record_set_t *record_set,
   return record_set->records[record_set->_cursor++]; /* Advance head */
 }
 
+const ipmeta_record_hot_t *
+ipmeta_record_set_next_hot(ipmeta_record_set_t *record_set, uint64_t *num_ips)
+{
+  ipmeta_record_t *rec;
+
+  if ((rec = ipmeta_record_set_next(record_set, num_ips)) == NULL) {
+    return NULL;
+  }
+  return ipmeta_record_get_hot(rec);
+}
+
+/* Add a match to the entry of its aggregation key, creating the entry if
+ * needed. Returns 1 if an existing entry was updated, 0 if the record must be
+ * appended as a new entry (setting *new_k to its slot in the index, or to
+ * kh_end if it is not indexed), or -1 on error. */
+static int aggregate_record(ipmeta_record_set_t *record_set,
+                            ipmeta_record_t *rec, uint64_t num_ips,
+                            khiter_t *new_k)
+{
+  khint64_t key;
+  uint32_t code;
+  khiter_t k;
+  uint64_t *cnt;
+  int khret;
+
+  *new_k = kh_end(record_set->aggr_index);
+
+  /* records are at least 8-byte aligned, so keys with the low bit set can
+     never be record pointers (and NULL, for the unmapped addresses, is key
+     0) */
+  if (rec == NULL || record_set->aggr == IPMETA_AGGR_RECORD ||
+      (code = ipmeta_record_get_attr(rec, record_set->aggr_attr)) == 0) {
+    /* records without the attribute have nothing in common, so merging them
+       would attribute their counts to an unrelated record */
+    key = (khint64_t)(uintptr_t)rec;
+  } else {
+    key = (((khint64_t)rec->source << 32 | code) << 1) | 1;
+  }
+
+  k = kh_put(ipmeta_aggrhash, record_set->aggr_index, key, &khret);
+  if (khret < 0) {
+    ipmeta_log(__func__, "could not add record to aggregation index");
+    return -1;
+  }
+  if (khret == 0) {
+    cnt = &record_set->ip_cnts[kh_val(record_set->aggr_index, k)];
+    *cnt = (*cnt > UINT64_MAX - num_ips) ? UINT64_MAX : *cnt + num_ips;
+    return 1;
+  }
+  /* the new entry will be appended */
+  kh_val(record_set->aggr_index, k) = record_set->n_recs;
+  *new_k = k;
+  return 0;
+}
+
 int ipmeta_record_set_add_record(ipmeta_record_set_t *record_set,
                                  ipmeta_record_t *rec, uint64_t num_ips)
 {
-  record_set->n_recs++;
+  ipmeta_record_t **tmp_records;
+  uint64_t *tmp_ip_cnts;
+  size_t new_alloc;
+  khiter_t new_k;
+  int indexed = 0;
+  int rc;
+
+  if (record_set->aggr != IPMETA_AGGR_NONE) {
+    if ((rc = aggregate_record(record_set, rec, num_ips, &new_k)) != 0) {
+      return (rc < 0) ? -1 : 0;
+    }
+    indexed = (new_k != kh_end(record_set->aggr_index));
+  }
 
   /* Realloc if necessary */
-  if (record_set->_alloc_size < record_set->n_recs) {
+  if (record_set->_alloc_size < record_set->n_recs + 1) {
     /* round n_recs up to next pow 2 */
-    record_set->_alloc_size = record_set->n_recs;
-    kroundup32(record_set->_alloc_size);
+    new_alloc = record_set->n_recs + 1;
+    kroundup32(new_alloc);
 
-    if ((record_set->records = realloc(record_set->records,
-        sizeof(*record_set->records) * record_set->_alloc_size)) == NULL) {
+    if ((tmp_records = realloc(record_set->records,
+        sizeof(*record_set->records) * new_alloc)) == NULL) {
       ipmeta_log(__func__, "could not realloc records in record set");
-      return -1;
+      goto err;
     }
+    record_set->records = tmp_records;
 
-    if ((record_set->ip_cnts = realloc(record_set->ip_cnts,
-       sizeof(*record_set->ip_cnts) * record_set->_alloc_size)) == NULL) {
+    if ((tmp_ip_cnts = realloc(record_set->ip_cnts,
+       sizeof(*record_set->ip_cnts) * new_alloc)) == NULL) {
       ipmeta_log(__func__, "could not realloc ip_cnts in record set");
-      return -1;
+      goto err;
     }
+    record_set->ip_cnts = tmp_ip_cnts;
+    record_set->_alloc_size = new_alloc;
   }
 
-  record_set->records[record_set->n_recs - 1] = rec;
-  record_set->ip_cnts[record_set->n_recs - 1] = num_ips;
+  record_set->records[record_set->n_recs] = rec;
+  record_set->ip_cnts[record_set->n_recs] = num_ips;
+  record_set->n_recs++;
 
   return 0;
+
+err:
+  /* the index must not refer to an entry that was never added */
+  if (indexed) {
+    kh_del(ipmeta_aggrhash, record_set->aggr_index, new_k);
+  }
+  return -1;
+}
+
+int ipmeta_record_set_add_match(ipmeta_record_set_t *record_set,
+                                ipmeta_record_t *rec, uint64_t num_ips,
+                                int family, const void *addrp, uint8_t pfxlen)
+{
+  uint8_t addr[16];
+  int i, bits;
+
+  if (record_set->sink == NULL) {
+    return ipmeta_record_set_add_record(record_set, rec, num_ips);
+  }
+  if (rec == NULL) {
+    /* nothing matched (bigarray) */
+    return 0;
+  }
+
+  /* hand out the network address of the prefix */
+  memset(addr, 0, sizeof(addr));
+  memcpy(addr, addrp, (family == AF_INET) ? 4 : 16);
+  for (i = 0; i < 16; i++) {
+    bits = pfxlen - i * 8;
+    if (bits <= 0) {
+      addr[i] = 0;
+    } else if (bits < 8) {
+      addr[i] &= (uint8_t)(0xff << (8 - bits));
+    }
+  }
+
+  record_set->n_recs++;
+  if (record_set->sink(family, addr, pfxlen, rec, num_ips,
+                       record_set->sink_user) != 0) {
+    record_set->sink_stopped = 1;
+    return -1;
+  }
+  return 0;
 }
 
 void ipmeta_dump_record_set(ipmeta_record_set_t *record_set, char *ip_str)
@@ -383,10 +740,124 @@ void ipmeta_dump_record_header()
   ipmeta_write_record_header(NULL);
 }
 
+/** Growable string used to format output rows */
+typedef struct row_buf {
+  char *str;
+  size_t len;
+  size_t alloc;
+} row_buf_t;
+
+static int row_printf(row_buf_t *buf, const char *fmt, ...)
+  ATTR_FORMAT_PRINTF(2, 3);
+
+static int row_printf(row_buf_t *buf, const char *fmt, ...)
+{
+  va_list ap;
+  char *tmp;
+  int ret;
+
+  while (1) {
+    va_start(ap, fmt);
+    ret = vsnprintf(buf->str + buf->len, buf->alloc - buf->len, fmt, ap);
+    va_end(ap);
+    if (ret < 0) {
+      return -1;
+    }
+    if ((size_t)ret < buf->alloc - buf->len) {
+      buf->len += ret;
+      return 0;
+    }
+    if ((tmp = realloc(buf->str, buf->alloc * 2 + ret)) == NULL) {
+      return -1;
+    }
+    buf->str = tmp;
+    buf->alloc = buf->alloc * 2 + ret;
+  }
+}
+
+/* Format the part of an output row that only depends on the record (i.e.
+   everything after the ip and num_ips fields) */
+static char *format_record(ipmeta_record_t *record)
+{
+  row_buf_t buf;
+  int i;
+
+  buf.len = 0;
+  buf.alloc = 256;
+  if ((buf.str = malloc(buf.alloc)) == NULL) {
+    return NULL;
+  }
+
+  if (row_printf(&buf,
+        "%" PRIu32 SEPARATOR "%s" SEPARATOR "%s" SEPARATOR "%s" SEPARATOR
+        "%s" SEPARATOR "%s" SEPARATOR "%f" SEPARATOR "%f" SEPARATOR
+        "%" PRIu32 SEPARATOR "%" PRIu32 SEPARATOR "%" PRIu16 SEPARATOR
+        "%s" SEPARATOR,
+        record->id, record->country_code, record->continent_code,
+        (record->region == NULL ? "" : record->region),
+        (record->city == NULL ? "" : record->city),
+        (record->post_code == NULL ? "" : record->post_code),
+        record->latitude, record->longitude, record->metro_code,
+        record->area_code, record->region_code,
+        (record->conn_speed == NULL ? "" : record->conn_speed)) != 0) {
+    goto err;
+  }
+  for (i = 0; i < record->polygon_ids_cnt; i++) {
+    if (row_printf(&buf, (i == 0) ? "%" PRIu32 : ",%" PRIu32,
+                   record->polygon_ids[i]) != 0) {
+      goto err;
+    }
+  }
+  if (row_printf(&buf, SEPARATOR) != 0) {
+    goto err;
+  }
+  if (record->asn_cnt > 0) {
+    for (i = 0; i < record->asn_cnt; i++) {
+      if (row_printf(&buf, (i == 0) ? "%" PRIu32 : "_%" PRIu32,
+                     record->asn[i]) != 0) {
+        goto err;
+      }
+    }
+    if (row_printf(&buf, SEPARATOR "%" PRIu64, record->asn_ip_cnt) != 0) {
+      goto err;
+    }
+  } else if (row_printf(&buf, SEPARATOR) != 0) {
+    goto err;
+  }
+  if (row_printf(&buf, "%s" SEPARATOR "%d" "\n",
+                 record->timezone == NULL ? "" : record->timezone,
+                 record->accuracy) != 0) {
+    goto err;
+  }
+  return buf.str;
+
+err:
+  free(buf.str);
+  return NULL;
+}
+
+/* Store a formatted row in a record's cache slot, unless another row was
+   stored first. Returns 1 if the slot now owns the row. */
+static int cache_row(char **slot, char *row)
+{
+#ifdef __GNUC__
+  return __sync_bool_compare_and_swap(slot, NULL, row);
+#else
+  if (*slot != NULL) {
+    return 0;
+  }
+  *slot = row;
+  return 1;
+#endif
+}
+
 void ipmeta_write_record(iow_t *file, ipmeta_record_t *record, char *ip_str,
                          uint64_t num_ips)
 {
-  int i;
+  char **slot;
+  char *row;
+  char *tmp_row = NULL;
+  size_t len;
 
   if (record == NULL) {
     ipmeta_printf(file,
@@ -394,41 +865,31 @@ void ipmeta_write_record(iow_t *file, ipmeta_record_t *record, char *ip_str,
                SEPARATOR SEPARATOR SEPARATOR SEPARATOR SEPARATOR SEPARATOR
                  SEPARATOR SEPARATOR SEPARATOR SEPARATOR SEPARATOR "\n",
              ip_str, num_ips);
-  } else {
-    ipmeta_printf(file,
-             "%s" SEPARATOR "%" PRIu64 SEPARATOR "%" PRIu32 SEPARATOR
-             "%s" SEPARATOR "%s" SEPARATOR "%s" SEPARATOR "%s" SEPARATOR
-             "%s" SEPARATOR "%f" SEPARATOR "%f" SEPARATOR "%" PRIu32 SEPARATOR
-             "%" PRIu32 SEPARATOR "%" PRIu16 SEPARATOR "%s" SEPARATOR,
-             ip_str, num_ips, record->id, record->country_code,
-             record->continent_code,
-             (record->region == NULL ? "" : record->region),
-             (record->city == NULL ? "" : record->city),
-             (record->post_code == NULL ? "" : record->post_code),
-             record->latitude, record->longitude, record->metro_code,
-             record->area_code, record->region_code,
-             (record->conn_speed == NULL ? "" : record->conn_speed));
-    for (i = 0; i < record->polygon_ids_cnt; i++) {
-      ipmeta_printf(file, "%" PRIu32, record->polygon_ids[i]);
-      if (i < record->polygon_ids_cnt - 1)
-        ipmeta_printf(file, ",");
+    return;
+  }
+
+  /* the fields of a record never change once it is loaded, so they are only
+     formatted the first time the record is written */
+  slot = ipmeta_provider_record_output(record);
+  if (slot == NULL || (row = *slot) == NULL) {
+    if ((row = format_record(record)) == NULL) {
+      ipmeta_log(__func__, "could not format record %" PRIu32, record->id);
+      return;
     }
-    ipmeta_printf(file, "|");
-    if (record->asn_cnt > 0) {
-      for (i = 0; i < record->asn_cnt; i++) {
-        ipmeta_printf(file, "%" PRIu32, record->asn[i]);
-        if (i < record->asn_cnt - 1)
-          ipmeta_printf(file, "_");
-      }
-      ipmeta_printf(file, "|%" PRIu64, record->asn_ip_cnt);
-    } else {
-      ipmeta_printf(file, "|");
+    if (slot == NULL || !cache_row(slot, row)) {
+      tmp_row = row;
     }
-    ipmeta_printf(file,
-             "%s" SEPARATOR "%d" "\n",
-             record->timezone == NULL ? "" : record->timezone,
-             record->accuracy);
   }
+
+  ipmeta_printf(file, "%s" SEPARATOR "%" PRIu64 SEPARATOR, ip_str, num_ips);
+  len = strlen(row);
+  if (file) {
+    wandio_wwrite(file, row, len);
+  } else {
+    fwrite(row, 1, len, stdout);
+  }
+
+  free(tmp_row);
   return;
 }
 
@@ -0,0 +1,161 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipmeta_arena.h"
+
+/** Size of the blocks that small allocations are made from */
+#define ARENA_BLOCK_LEN (1024 * 1024)
+
+/** Allocations larger than this get a block of their own */
+#define ARENA_LARGE_LEN (ARENA_BLOCK_LEN / 8)
+
+/** Alignment of the memory returned by ipmeta_arena_alloc */
+#define ARENA_ALIGN 16
+
+/** Largest alignment that may be requested from ipmeta_arena_alloc_aligned */
+#define ARENA_MAX_ALIGN 64
+
+struct ipmeta_arena_block {
+
+  /** The block that was filled before this one */
+  struct ipmeta_arena_block *next;
+
+  /** Number of bytes in data */
+  size_t len;
+
+  /** Number of bytes of data that have been handed out */
+  size_t used;
+
+  /** The memory handed out by the arena */
+  char data[];
+};
+
+static ipmeta_arena_block_t *new_block(ipmeta_arena_t *arena, size_t len)
+{
+  ipmeta_arena_block_t *block;
+
+  /* calloc so that every allocation is already zeroed */
+  if ((block = calloc(1, sizeof(ipmeta_arena_block_t) + len)) == NULL) {
+    return NULL;
+  }
+  block->len = len;
+  arena->mem_size += sizeof(ipmeta_arena_block_t) + len;
+  return block;
+}
+
+/* Offset of the next free byte of the block with the given alignment */
+static size_t align_offset(ipmeta_arena_block_t *block, size_t align)
+{
+  uintptr_t addr = (uintptr_t)(block->data + block->used);
+
+  return block->used + (((addr + align - 1) & ~(uintptr_t)(align - 1)) - addr);
+}
+
+static void *arena_alloc(ipmeta_arena_t *arena, size_t size, size_t align)
+{
+  ipmeta_arena_block_t *block = arena->head;
+  size_t offset;
+
+  if (size > ARENA_LARGE_LEN) {
+    /* link a dedicated block in behind the current one, so that the rest of
+       the current block can still be used */
+    if ((block = new_block(arena, size + ARENA_MAX_ALIGN)) == NULL) {
+      return NULL;
+    }
+    offset = align_offset(block, align);
+    block->used = offset + size;
+    if (arena->head != NULL) {
+      block->next = arena->head->next;
+      arena->head->next = block;
+    } else {
+      arena->head = block;
+    }
+    return block->data + offset;
+  }
+
+  if (block == NULL || (offset = align_offset(block, align)) + size >
+                         block->len) {
+    if ((block = new_block(arena, ARENA_BLOCK_LEN)) == NULL) {
+      return NULL;
+    }
+    block->next = arena->head;
+    arena->head = block;
+    offset = align_offset(block, align);
+  }
+
+  block->used = offset + size;
+  return block->data + offset;
+}
+
+void *ipmeta_arena_alloc(ipmeta_arena_t *arena, size_t size)
+{
+  return arena_alloc(arena, size, ARENA_ALIGN);
+}
+
+void *ipmeta_arena_alloc_aligned(ipmeta_arena_t *arena, size_t size,
+                                 size_t align)
+{
+  assert(align != 0 && (align & (align - 1)) == 0 && align <= ARENA_MAX_ALIGN);
+  return arena_alloc(arena, size, align);
+}
+
+char *ipmeta_arena_strndup(ipmeta_arena_t *arena, const char *str, size_t len)
+{
+  char *dst;
+
+  if ((dst = arena_alloc(arena, len + 1, 1)) == NULL) {
+    return NULL;
+  }
+  memcpy(dst, str, len);
+  dst[len] = '\0';
+  return dst;
+}
+
+void ipmeta_arena_free(ipmeta_arena_t *arena)
+{
+  ipmeta_arena_block_t *block;
+
+  while ((block = arena->head) != NULL) {
+    arena->head = block->next;
+    free(block);
+  }
+  arena->mem_size = 0;
+}
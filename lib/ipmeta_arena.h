@@ -0,0 +1,108 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_ARENA_H
+#define __IPMETA_ARENA_H
+
+#include <stddef.h>
+
+/** @file
+ *
+ * @brief Header file that exposes the internal arena allocator used for
+ * provider records
+ *
+ * An arena hands out memory from large blocks and can only be freed as a
+ * whole. Providers allocate their records and the strings and arrays those
+ * records reference from an arena, so loading a database makes a few large
+ * allocations instead of millions of small ones, and freeing a provider
+ * releases everything in one go.
+ *
+ * @author Alistair King
+ *
+ */
+
+/** A block of memory owned by an arena */
+typedef struct ipmeta_arena_block ipmeta_arena_block_t;
+
+/** Structure holding the state of an arena (zero-initialize before use) */
+typedef struct ipmeta_arena {
+
+  /** Block that allocations are currently being made from */
+  ipmeta_arena_block_t *head;
+
+  /** Total number of bytes allocated from the system for this arena */
+  size_t mem_size;
+
+} ipmeta_arena_t;
+
+/** Allocate zeroed memory from an arena
+ *
+ * @param arena         pointer to the arena to allocate from
+ * @param size          number of bytes to allocate
+ * @return a pointer to the memory (suitably aligned for any type), NULL if an
+ * error occurred
+ *
+ * The memory remains valid until ipmeta_arena_free is called.
+ */
+void *ipmeta_arena_alloc(ipmeta_arena_t *arena, size_t size);
+
+/** Allocate zeroed memory with a given alignment from an arena
+ *
+ * @param arena         pointer to the arena to allocate from
+ * @param size          number of bytes to allocate
+ * @param align         required alignment (a power of two, at most 64)
+ * @return a pointer to the memory, NULL if an error occurred
+ */
+void *ipmeta_arena_alloc_aligned(ipmeta_arena_t *arena, size_t size,
+                                 size_t align);
+
+/** Copy a string into an arena
+ *
+ * @param arena         pointer to the arena to allocate from
+ * @param str           pointer to the string to copy
+ * @param len           number of characters to copy
+ * @return a nul-terminated copy of the first len characters of str, NULL if
+ * an error occurred
+ */
+char *ipmeta_arena_strndup(ipmeta_arena_t *arena, const char *str, size_t len);
+
+/** Free all memory allocated from an arena
+ *
+ * @param arena         pointer to the arena to free
+ *
+ * The arena is left empty and may be used again.
+ */
+void ipmeta_arena_free(ipmeta_arena_t *arena);
+
+#endif /* __IPMETA_ARENA_H */
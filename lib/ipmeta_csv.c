@@ -0,0 +1,525 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "libipmeta_int.h"
+#include "utils.h"
+
+#include "ipmeta_csv.h"
+
+/** Initial size of the read buffer (grown if a single row does not fit) */
+#define READ_BUFFER_LEN (1024 * 1024)
+
+/** Number of bytes classified at once when looking for special characters */
+#define SCAN_BLOCK_LEN 64
+
+/** Slack at the end of the read buffer so that a block scan may run past the
+    end of the data, plus room for a nul after the last field of the file */
+#define BUFFER_PAD_LEN (SCAN_BLOCK_LEN + 1)
+
+/** Initial number of fields allocated for a row */
+#define FIELDS_INIT_CNT 16
+
+/** Boundaries of a field in the row currently being tokenized */
+typedef struct csv_field {
+  /** First byte of the field (after any opening quote) */
+  char *start;
+
+  /** One past the last byte of the field (the closing quote, if quoted) */
+  char *end;
+
+  /** Set if the field was quoted */
+  int quoted;
+
+} csv_field_t;
+
+/** Cursor over the special characters in a range of the read buffer */
+typedef struct csv_scan {
+  /** Start of the block that mask describes */
+  const char *base;
+
+  /** End of the data */
+  const char *end;
+
+  /** Special characters of the current block not yet returned */
+  uint64_t mask;
+
+} csv_scan_t;
+
+struct ipmeta_csv {
+  /** The file we are reading from */
+  io_t *file;
+
+  /** Read buffer (buf_size bytes plus BUFFER_PAD_LEN) */
+  char *buf;
+  size_t buf_size;
+
+  /** Offset of the first byte that has not been returned as part of a row */
+  size_t start;
+
+  /** Offset one past the last valid byte in the buffer */
+  size_t end;
+
+  /** Set once the file has been read to the end */
+  int eof;
+
+  /** Line number of the byte at offset start */
+  uint64_t line;
+
+  /** Field boundaries of the row being tokenized */
+  csv_field_t *tmp_fields;
+
+  /** The row handed back to the caller */
+  ipmeta_csv_row_t row;
+  int fields_alloc;
+};
+
+#if !defined(__SSE2__)
+/** Bytes that the tokenizer needs to stop at */
+static const uint8_t special_chars[256] = {
+  [','] = 1, ['"'] = 1, ['\n'] = 1, ['\r'] = 1,
+};
+#endif
+
+/** Return a bitmask with bit i set if p[i] is a delimiter, quote or line end
+ *
+ * Always reads SCAN_BLOCK_LEN bytes starting at p.
+ */
+static inline uint64_t special_mask(const char *p)
+{
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  uint64_t mask = 0;
+  __m256i v, m;
+  int i;
+
+  for (i = 0; i < SCAN_BLOCK_LEN; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(p + i));
+    m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, quote)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+    mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << i;
+  }
+  return mask;
+#elif defined(__SSE2__)
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  uint64_t mask = 0;
+  __m128i v, m;
+  int i;
+
+  for (i = 0; i < SCAN_BLOCK_LEN; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(p + i));
+    m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, quote)),
+      _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << i;
+  }
+  return mask;
+#else
+  uint64_t mask = 0;
+  int i;
+
+  for (i = 0; i < SCAN_BLOCK_LEN; i++) {
+    mask |= (uint64_t)special_chars[(uint8_t)p[i]] << i;
+  }
+  return mask;
+#endif
+}
+
+static inline uint64_t block_mask(const char *base, const char *end)
+{
+  uint64_t mask = special_mask(base);
+
+  if (end - base < SCAN_BLOCK_LEN) {
+    mask &= (UINT64_C(1) << (end - base)) - 1;
+  }
+  return mask;
+}
+
+static inline void scan_init(csv_scan_t *scan, const char *p, const char *end)
+{
+  scan->base = p;
+  scan->end = end;
+  scan->mask = (p < end) ? block_mask(p, end) : 0;
+}
+
+/** Return the next special character, or scan->end if there are no more */
+static inline const char *scan_next(csv_scan_t *scan)
+{
+  const char *p;
+
+  while (scan->mask == 0) {
+    if (scan->end - scan->base <= SCAN_BLOCK_LEN) {
+      return scan->end;
+    }
+    scan->base += SCAN_BLOCK_LEN;
+    scan->mask = block_mask(scan->base, scan->end);
+  }
+
+  p = scan->base + __builtin_ctzll(scan->mask);
+  scan->mask &= scan->mask - 1;
+  return p;
+}
+
+static inline int is_blank(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+static int grow_fields(ipmeta_csv_t *csv)
+{
+  int cnt = csv->fields_alloc * 2;
+
+  if ((csv->tmp_fields = realloc(csv->tmp_fields,
+                                 sizeof(csv_field_t) * cnt)) == NULL ||
+      (csv->row.fields = realloc(csv->row.fields, sizeof(char *) * cnt)) ==
+        NULL ||
+      (csv->row.lens = realloc(csv->row.lens, sizeof(size_t) * cnt)) == NULL) {
+    ipmeta_log(__func__, "could not grow CSV field arrays");
+    return -1;
+  }
+  csv->fields_alloc = cnt;
+  return 0;
+}
+
+/** Record the boundaries of a field that ends at delim */
+static int add_field(ipmeta_csv_t *csv, int idx, char *start, char *delim,
+                     char *quote_end, uint64_t line)
+{
+  csv_field_t *field;
+  char *p;
+
+  if (idx == csv->fields_alloc && grow_fields(csv) != 0) {
+    return -1;
+  }
+  field = &csv->tmp_fields[idx];
+
+  if (quote_end != NULL) {
+    /* only blanks may follow the closing quote */
+    for (p = quote_end + 1; p < delim; p++) {
+      if (!is_blank(*p)) {
+        ipmeta_log(__func__, "Unexpected character after closing quote "
+                             "at line %" PRIu64, line);
+        return -1;
+      }
+    }
+    field->start = start;
+    field->end = quote_end;
+    field->quoted = 1;
+    return 0;
+  }
+
+  while (start < delim && is_blank(*start)) {
+    start++;
+  }
+  while (delim > start && is_blank(delim[-1])) {
+    delim--;
+  }
+  field->start = start;
+  field->end = delim;
+  field->quoted = 0;
+  return 0;
+}
+
+/** Convert the recorded field boundaries into nul-terminated strings */
+static void finish_row(ipmeta_csv_t *csv, int fields_cnt)
+{
+  csv_field_t *field;
+  char *src, *dst;
+  int i;
+
+  for (i = 0; i < fields_cnt; i++) {
+    field = &csv->tmp_fields[i];
+
+    if (!field->quoted) {
+      if (field->start == field->end) {
+        csv->row.fields[i] = NULL;
+        csv->row.lens[i] = 0;
+        continue;
+      }
+      *field->end = '\0';
+      csv->row.fields[i] = field->start;
+      csv->row.lens[i] = field->end - field->start;
+      continue;
+    }
+
+    /* collapse escaped quotes */
+    dst = field->start;
+    for (src = field->start; src < field->end; src++) {
+      *dst++ = *src;
+      if (*src == '"') {
+        src++;
+      }
+    }
+    *dst = '\0';
+    csv->row.fields[i] = field->start;
+    csv->row.lens[i] = dst - field->start;
+  }
+  csv->row.fields_cnt = fields_cnt;
+}
+
+/** Tokenize the row at the start of the unread data
+ *
+ * @return 1 if a complete row was found, 0 if more data is needed (or there
+ * is nothing left at EOF), -1 if the row is malformed
+ *
+ * Nothing in the buffer is modified until the whole row has been found, so
+ * an incomplete row can simply be tokenized again once more data is read.
+ */
+static int tokenize_row(ipmeta_csv_t *csv)
+{
+  char *p = csv->buf + csv->start;
+  char *end = csv->buf + csv->end;
+  char *field_start;
+  char *quote_end = NULL;
+  char *q;
+  csv_scan_t scan;
+  int in_quotes = 0;
+  int fields_cnt = 0;
+  int nl_cnt = 0;
+
+  /* skip blank lines (and the \n of a \r\n) */
+  while (p < end && (*p == '\n' || *p == '\r')) {
+    if (*p == '\n') {
+      csv->line++;
+    }
+    p++;
+  }
+  csv->start = p - csv->buf;
+  if (p == end) {
+    return 0;
+  }
+
+  field_start = p;
+  scan_init(&scan, p, end);
+
+  for (;;) {
+    q = (char *)scan_next(&scan);
+
+    if (q == end) {
+      if (!csv->eof) {
+        return 0;
+      }
+      if (in_quotes) {
+        ipmeta_log(__func__, "Unterminated quoted field at line %" PRIu64,
+                   csv->line + nl_cnt);
+        return -1;
+      }
+      /* the last row of the file has no line end */
+      if (add_field(csv, fields_cnt++, field_start, q, quote_end,
+                    csv->line + nl_cnt) != 0) {
+        return -1;
+      }
+      break;
+    }
+
+    if (in_quotes) {
+      if (*q == '"') {
+        if (q + 1 == end && !csv->eof) {
+          return 0;
+        }
+        if (q + 1 < end && q[1] == '"') {
+          /* escaped quote, skip over the second one */
+          scan_next(&scan);
+        } else {
+          in_quotes = 0;
+          quote_end = q;
+        }
+      } else if (*q == '\n') {
+        nl_cnt++;
+      }
+      continue;
+    }
+
+    if (*q == '"') {
+      /* a quote may only open a field */
+      if (quote_end != NULL) {
+        goto stray_quote;
+      }
+      for (; field_start < q; field_start++) {
+        if (!is_blank(*field_start)) {
+          goto stray_quote;
+        }
+      }
+      in_quotes = 1;
+      field_start = q + 1;
+      continue;
+    }
+
+    if (add_field(csv, fields_cnt++, field_start, q, quote_end,
+                  csv->line + nl_cnt) != 0) {
+      return -1;
+    }
+    field_start = q + 1;
+    quote_end = NULL;
+
+    if (*q != ',') {
+      /* end of the row */
+      if (*q == '\n') {
+        nl_cnt++;
+      }
+      q++;
+      break;
+    }
+  }
+
+  finish_row(csv, fields_cnt);
+  csv->row.line = csv->line;
+  csv->line += nl_cnt;
+  csv->start = q - csv->buf;
+  return 1;
+
+stray_quote:
+  ipmeta_log(__func__, "Unexpected quote at line %" PRIu64,
+             csv->line + nl_cnt);
+  return -1;
+}
+
+/** Move unread data to the front of the buffer and read more */
+static int fill_buffer(ipmeta_csv_t *csv)
+{
+  size_t pending = csv->end - csv->start;
+  int64_t read;
+  char *tmp;
+
+  if (csv->start > 0) {
+    memmove(csv->buf, csv->buf + csv->start, pending);
+    csv->start = 0;
+    csv->end = pending;
+  } else if (pending == csv->buf_size) {
+    /* a single row is larger than the buffer */
+    if ((tmp = realloc(csv->buf, csv->buf_size * 2 + BUFFER_PAD_LEN)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not grow CSV read buffer");
+      return -1;
+    }
+    csv->buf = tmp;
+    csv->buf_size *= 2;
+  }
+
+  read = wandio_read(csv->file, csv->buf + csv->end,
+                     csv->buf_size - csv->end);
+  if (read < 0) {
+    ipmeta_log(__func__, "Error reading CSV file");
+    return -1;
+  }
+  if (read == 0) {
+    csv->eof = 1;
+  }
+  csv->end += read;
+  return 0;
+}
+
+ipmeta_csv_t *ipmeta_csv_init(io_t *file)
+{
+  ipmeta_csv_t *csv;
+
+  if ((csv = malloc_zero(sizeof(ipmeta_csv_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc ipmeta_csv_t");
+    return NULL;
+  }
+  csv->file = file;
+  csv->line = 1;
+
+  csv->buf_size = READ_BUFFER_LEN;
+  if ((csv->buf = malloc_zero(csv->buf_size + BUFFER_PAD_LEN)) == NULL) {
+    ipmeta_log(__func__, "could not malloc CSV read buffer");
+    goto err;
+  }
+
+  csv->fields_alloc = FIELDS_INIT_CNT;
+  if ((csv->tmp_fields = malloc(sizeof(csv_field_t) * FIELDS_INIT_CNT)) ==
+        NULL ||
+      (csv->row.fields = malloc(sizeof(char *) * FIELDS_INIT_CNT)) == NULL ||
+      (csv->row.lens = malloc(sizeof(size_t) * FIELDS_INIT_CNT)) == NULL) {
+    ipmeta_log(__func__, "could not malloc CSV field arrays");
+    goto err;
+  }
+
+  return csv;
+
+err:
+  ipmeta_csv_free(csv);
+  return NULL;
+}
+
+void ipmeta_csv_free(ipmeta_csv_t *csv)
+{
+  if (csv == NULL) {
+    return;
+  }
+  free(csv->buf);
+  free(csv->tmp_fields);
+  free(csv->row.fields);
+  free(csv->row.lens);
+  free(csv);
+}
+
+int ipmeta_csv_read_row(ipmeta_csv_t *csv, ipmeta_csv_row_t **row)
+{
+  int rc;
+
+  for (;;) {
+    if ((rc = tokenize_row(csv)) != 0) {
+      *row = (rc > 0) ? &csv->row : NULL;
+      return rc;
+    }
+    if (csv->eof) {
+      *row = NULL;
+      return 0;
+    }
+    if (fill_buffer(csv) != 0) {
+      return -1;
+    }
+  }
+}
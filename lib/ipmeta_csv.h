@@ -0,0 +1,214 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_CSV_H
+#define __IPMETA_CSV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "wandio.h"
+
+/** @file
+ *
+ * @brief Header file that exposes the internal CSV tokenizer used by the
+ * providers
+ *
+ * The tokenizer reads large blocks from a wandio file, locates delimiters,
+ * quotes and line ends 64 bytes at a time, and hands back one complete row at
+ * a time. Each field is nul-terminated in place inside the read buffer, so
+ * providers can index the columns of a row directly instead of being called
+ * back once per cell.
+ *
+ * Semantics follow those the providers previously requested from libcsv
+ * (CSV_STRICT | CSV_STRICT_FINI | CSV_APPEND_NULL | CSV_EMPTY_IS_NULL):
+ *  - an empty unquoted field is returned as NULL, an empty quoted field as ""
+ *  - leading and trailing spaces/tabs around a field are dropped
+ *  - "" inside a quoted field is an escaped quote
+ *  - a stray quote, or a quoted field that is not terminated, is an error
+ *
+ * Blank lines are skipped, and both "\n" and "\r\n" line ends are accepted.
+ *
+ * @author Alistair King
+ *
+ */
+
+/** A single row returned by the tokenizer */
+typedef struct ipmeta_csv_row {
+  /** Array of nul-terminated fields (NULL for an empty unquoted field) */
+  char **fields;
+
+  /** Length of each field (0 for NULL fields) */
+  size_t *lens;
+
+  /** Number of fields in this row */
+  int fields_cnt;
+
+  /** Line number (1-based) of the first line of this row in the file */
+  uint64_t line;
+
+} ipmeta_csv_row_t;
+
+/** Opaque structure holding the state of a CSV reader */
+typedef struct ipmeta_csv ipmeta_csv_t;
+
+/** Create a CSV reader that reads from the current position of a file
+ *
+ * @param file          wandio file to read rows from (not owned)
+ * @return a CSV reader, or NULL if an error occurred
+ */
+ipmeta_csv_t *ipmeta_csv_init(io_t *file);
+
+/** Free a CSV reader
+ *
+ * @param csv           pointer to the reader to free
+ */
+void ipmeta_csv_free(ipmeta_csv_t *csv);
+
+/** Read the next row from the file
+ *
+ * @param csv           pointer to the reader
+ * @param[out] row      set to point to the row that was read
+ * @return 1 if a row was read, 0 at end of file, -1 if an error occurred
+ *
+ * The returned row (and the strings it references) belong to the reader and
+ * are only valid until the next call to ipmeta_csv_read_row. Fields may be
+ * modified in place by the caller.
+ */
+int ipmeta_csv_read_row(ipmeta_csv_t *csv, ipmeta_csv_row_t **row);
+
+/** Parse a field that holds an unsigned decimal integer
+ *
+ * @param tok           the field to parse
+ * @param len           length of the field
+ * @param[out] val      set to the parsed value
+ * @return 0 if the whole field is a valid 32 bit unsigned integer, -1
+ * otherwise (including if tok is NULL)
+ *
+ * Unlike strtoul, no sign, whitespace or trailing characters are accepted.
+ */
+static inline int ipmeta_csv_parse_u32(const char *tok, size_t len,
+                                       uint32_t *val)
+{
+  uint64_t v = 0;
+  unsigned bad = 0;
+  unsigned d;
+  size_t i;
+
+  if (tok == NULL || len == 0 || len > 10) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    d = (unsigned)(tok[i] - '0');
+    bad |= (d > 9);
+    v = v * 10 + d;
+  }
+  if (bad || v > UINT32_MAX) {
+    return -1;
+  }
+  *val = (uint32_t)v;
+  return 0;
+}
+
+/** Parse a field that holds a decimal number such as a coordinate
+ *
+ * @param tok           the (nul-terminated) field to parse
+ * @param len           length of the field
+ * @param[out] val      set to the parsed value
+ * @return 0 if the whole field is a valid number, -1 otherwise (including if
+ * tok is NULL)
+ *
+ * Plain fixed-point values ([-+]digits[.digits]) whose digits fit in 53 bits
+ * are converted with a single integer-to-double division, which gives the
+ * same correctly rounded result as strtod. Anything else (exponents, very
+ * long values) falls back to strtod.
+ */
+static inline int ipmeta_csv_parse_double(const char *tok, size_t len,
+                                          double *val)
+{
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+  };
+  const char *p = tok;
+  const char *end = tok + len;
+  char *endp;
+  uint64_t mant = 0;
+  int neg = 0;
+  int digits = 0;
+  int frac_digits = 0;
+  int seen_dot = 0;
+  unsigned d;
+
+  if (tok == NULL || len == 0) {
+    return -1;
+  }
+
+  if (*p == '-' || *p == '+') {
+    neg = (*p == '-');
+    p++;
+  }
+  for (; p < end; p++) {
+    if (*p == '.' && !seen_dot) {
+      seen_dot = 1;
+      continue;
+    }
+    d = (unsigned)(*p - '0');
+    if (d > 9 || digits == 19) {
+      goto slow;
+    }
+    mant = mant * 10 + d;
+    digits++;
+    frac_digits += seen_dot;
+  }
+  if (digits == 0 || mant > (UINT64_C(1) << 53)) {
+    goto slow;
+  }
+
+  *val = (double)mant / pow10[frac_digits];
+  if (neg) {
+    *val = -*val;
+  }
+  return 0;
+
+slow:
+  *val = strtod(tok, &endp);
+  if (endp == tok || *endp != '\0') {
+    return -1;
+  }
+  return 0;
+}
+
+#endif /* __IPMETA_CSV_H */
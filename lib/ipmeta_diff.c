@@ -0,0 +1,202 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+#include "libipmeta_int.h"
+#include "ipmeta_ranges.h"
+
+/* Compare two strings, treating NULL like an empty string */
+static int str_equal(const char *a, const char *b)
+{
+  return strcmp((a != NULL) ? a : "", (b != NULL) ? b : "") == 0;
+}
+
+int ipmeta_record_equal(const ipmeta_record_t *a, const ipmeta_record_t *b)
+{
+  if (a == b) {
+    return 1;
+  }
+  if (a == NULL || b == NULL) {
+    return 0;
+  }
+
+  /* ids (and the counters and dictionary ids derived from the loaded data)
+     only have a meaning within one instance, so they are not compared */
+  return a->source == b->source &&
+         str_equal(a->country_code, b->country_code) &&
+         str_equal(a->continent_code, b->continent_code) &&
+         str_equal(a->region, b->region) && str_equal(a->city, b->city) &&
+         str_equal(a->post_code, b->post_code) &&
+         a->latitude == b->latitude && a->longitude == b->longitude &&
+         a->metro_code == b->metro_code && a->area_code == b->area_code &&
+         a->region_code == b->region_code &&
+         str_equal(a->conn_speed, b->conn_speed) &&
+         a->asn_cnt == b->asn_cnt &&
+         (a->asn_cnt == 0 ||
+          memcmp(a->asn, b->asn, sizeof(uint32_t) * a->asn_cnt) == 0) &&
+         a->polygon_ids_cnt == b->polygon_ids_cnt &&
+         (a->polygon_ids_cnt == 0 ||
+          memcmp(a->polygon_ids, b->polygon_ids,
+                 sizeof(uint32_t) * a->polygon_ids_cnt) == 0) &&
+         str_equal(a->timezone, b->timezone) && a->accuracy == b->accuracy;
+}
+
+/** A changed range that has not been passed to the callback yet */
+typedef struct pending_change {
+  ipmeta_addr128_t first;
+  ipmeta_addr128_t last;
+  ipmeta_record_t *old_record;
+  ipmeta_record_t *new_record;
+  int valid;
+} pending_change_t;
+
+static int flush_change(int family, pending_change_t *pending,
+                        ipmeta_diff_cb_t *cb, void *user)
+{
+  uint8_t first_bytes[sizeof(struct in6_addr)];
+  uint8_t last_bytes[sizeof(struct in6_addr)];
+
+  if (pending->valid == 0) {
+    return 0;
+  }
+  pending->valid = 0;
+
+  ipmeta_addr128_to_bytes(family, &pending->first, first_bytes);
+  ipmeta_addr128_to_bytes(family, &pending->last, last_bytes);
+  return cb(family, first_bytes, last_bytes,
+            ipmeta_addr128_range_size(family, &pending->first, &pending->last),
+            pending->old_record, pending->new_record, user);
+}
+
+int ipmeta_diff(ipmeta_t *old_ipmeta, ipmeta_t *new_ipmeta, int family,
+                ipmeta_provider_id_t provider_id, ipmeta_diff_cb_t *cb,
+                void *user)
+{
+  ipmeta_ranges_t old_ranges, new_ranges;
+  uint64_t old_idx = 0, new_idx = 0;
+  ipmeta_record_t *old_record, *new_record;
+  ipmeta_addr128_t first = {0, 0};
+  ipmeta_addr128_t last, next, next_new;
+  pending_change_t pending;
+  int have_next, have_next_new;
+  int rc = -1;
+
+  assert(old_ipmeta != NULL && new_ipmeta != NULL && cb != NULL);
+
+  if (provider_id < 1 || provider_id > IPMETA_PROVIDER_MAX) {
+    ipmeta_log(__func__, "invalid provider id %d", provider_id);
+    return -1;
+  }
+
+  memset(&old_ranges, 0, sizeof(old_ranges));
+  memset(&new_ranges, 0, sizeof(new_ranges));
+  memset(&pending, 0, sizeof(pending));
+
+  if (ipmeta_ranges_build(old_ipmeta->datastore, family, provider_id,
+                          &old_ranges) != 0 ||
+      ipmeta_ranges_build(new_ipmeta->datastore, family, provider_id,
+                          &new_ranges) != 0) {
+    goto done;
+  }
+
+  /* both lists of ranges cover the whole address space, so step through
+     them together, ending each range wherever either one changes record */
+  for (;;) {
+    old_record = old_ranges.records[old_idx];
+    new_record = new_ranges.records[new_idx];
+
+    have_next = (old_idx + 1 < old_ranges.cnt);
+    if (have_next) {
+      next = old_ranges.starts[old_idx + 1];
+    }
+    have_next_new = (new_idx + 1 < new_ranges.cnt);
+    if (have_next_new) {
+      next_new = new_ranges.starts[new_idx + 1];
+      if (have_next == 0 || ipmeta_addr128_cmp(&next_new, &next) < 0) {
+        next = next_new;
+        have_next = 1;
+      }
+    }
+    last = have_next ? ipmeta_addr128_dec(next) : ipmeta_addr128_max(family);
+
+    if (ipmeta_record_equal(old_record, new_record) == 0) {
+      if (pending.valid &&
+          ipmeta_record_equal(pending.old_record, old_record) &&
+          ipmeta_record_equal(pending.new_record, new_record)) {
+        /* the same change continues (with records that differ only in
+           their ids) */
+        pending.last = last;
+      } else {
+        if (flush_change(family, &pending, cb, user) != 0) {
+          goto done;
+        }
+        pending.first = first;
+        pending.last = last;
+        pending.old_record = old_record;
+        pending.new_record = new_record;
+        pending.valid = 1;
+      }
+    } else if (flush_change(family, &pending, cb, user) != 0) {
+      goto done;
+    }
+
+    if (have_next == 0) {
+      break;
+    }
+    first = next;
+    if (old_idx + 1 < old_ranges.cnt &&
+        ipmeta_addr128_cmp(&old_ranges.starts[old_idx + 1], &next) == 0) {
+      old_idx++;
+    }
+    if (new_idx + 1 < new_ranges.cnt &&
+        ipmeta_addr128_cmp(&new_ranges.starts[new_idx + 1], &next) == 0) {
+      new_idx++;
+    }
+  }
+
+  if (flush_change(family, &pending, cb, user) != 0) {
+    goto done;
+  }
+  rc = 0;
+
+done:
+  ipmeta_ranges_clear(&old_ranges);
+  ipmeta_ranges_clear(&new_ranges);
+  return rc;
+}
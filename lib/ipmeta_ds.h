@@ -51,6 +51,19 @@
  */
 #define IPMETA_DS_STATE(type, ds) ((ipmeta_ds_##type##_state_t *)(ds)->state)
 
+/** Callback used to visit the prefixes stored in a datastructure
+ *
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to a struct in_addr or in6_addr containing the
+ *                      (network byte order) prefix address
+ * @param pfxlen        The prefix length
+ * @param record        The record associated with the prefix
+ * @param user          The user pointer passed to iterate
+ * @return 0 to continue iterating, any other value to stop
+ */
+typedef int(ipmeta_ds_iterate_cb_t)(int family, void *addrp, uint8_t pfxlen,
+                                    ipmeta_record_t *record, void *user);
+
 /** Convenience macro that defines all the function prototypes for the ipmeta
  * datastructure API
  */
@@ -64,7 +77,10 @@
     void *addrp, uint8_t pfxlen, uint32_t providermask,                        \
     ipmeta_record_set_t *records);                                             \
   int ipmeta_ds_##datastructure##_lookup_addr(ipmeta_ds_t *ds, int family,     \
-    void *addrp, uint32_t providermask, ipmeta_record_set_t *found);
+    void *addrp, uint32_t providermask, ipmeta_record_set_t *found);           \
+  int ipmeta_ds_##datastructure##_iterate(ipmeta_ds_t *ds, int family,         \
+    uint32_t providermask, ipmeta_ds_iterate_cb_t *cb, void *user);            \
+  int ipmeta_ds_##datastructure##_finalize(ipmeta_ds_t *ds);
 
 /** Convenience macro that defines all the function pointers for the ipmeta
  * datastructure API
@@ -73,7 +89,9 @@
   ipmeta_ds_##datastructure##_init, ipmeta_ds_##datastructure##_free,          \
     ipmeta_ds_##datastructure##_add_prefix,                                    \
     ipmeta_ds_##datastructure##_lookup_pfx,                                    \
-    ipmeta_ds_##datastructure##_lookup_addr,
+    ipmeta_ds_##datastructure##_lookup_addr,                                   \
+    ipmeta_ds_##datastructure##_iterate,                                       \
+    ipmeta_ds_##datastructure##_finalize,
 
 /** Structure which represents a metadata datastructure */
 struct ipmeta_ds {
@@ -102,6 +120,27 @@ struct ipmeta_ds {
   int (*lookup_addr)(struct ipmeta_ds *ds, int family, void *addrp,
                      uint32_t providermask, ipmeta_record_set_t *found);
 
+  /** Pointer to the function that visits all stored prefixes
+   *
+   * The prefixes of each provider in providermask are visited in address
+   * order, and a prefix is always visited before the (more specific) prefixes
+   * it contains. Prefixes of different providers may be interleaved.
+   * Returns 0 if all prefixes were visited, -1 if an error occurred or the
+   * callback returned non-zero.
+   */
+  int (*iterate)(struct ipmeta_ds *ds, int family, uint32_t providermask,
+                 ipmeta_ds_iterate_cb_t *cb, void *user);
+
+  /** Pointer to the function called once a provider has added all of its
+   *  prefixes
+   *
+   * Datastructures may use this to build lookup structures that are too
+   * costly to maintain while prefixes are being added. Prefixes may still be
+   * added afterwards (when another provider is enabled), in which case
+   * finalize will be called again. Returns 0 if successful, -1 otherwise.
+   */
+  int (*finalize)(struct ipmeta_ds *ds);
+
   /** Pointer to a instance-specific state object */
   void *state;
 };
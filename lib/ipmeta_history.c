@@ -0,0 +1,559 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "khash.h"
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_arena.h"
+#include "ipmeta_provider.h"
+#include "ipmeta_ranges.h"
+
+/** Value of history_span_t.to for spans that are still valid */
+#define SPAN_OPEN UINT32_MAX
+
+/** A range of addresses that mapped to the same record over a period */
+typedef struct history_span {
+  ipmeta_addr128_t first;
+  ipmeta_addr128_t last;
+
+  /** Time of the first snapshot the span was seen in */
+  uint32_t from;
+
+  /** Time of the first snapshot the span was no longer seen in (SPAN_OPEN if
+      it is part of the latest snapshot) */
+  uint32_t to;
+
+  ipmeta_record_t *record;
+} history_span_t;
+
+/** The spans of one provider and address family */
+typedef struct history_track {
+  history_span_t *spans;
+  uint64_t spans_cnt;
+  uint64_t spans_alloc;
+
+  /** Indexes of the spans of the latest snapshot, in address order */
+  uint64_t *open;
+  uint64_t open_cnt;
+
+  /** Indexes of all spans, ordered by first address (only valid if
+      index_valid is set) */
+  uint64_t *order;
+
+  /** Largest last address in each subtree of the implicit search tree over
+      order (the subtree of [lo, hi) is rooted at the middle element) */
+  ipmeta_addr128_t *max_last;
+
+  /** Set once order and max_last cover every span */
+  int index_valid;
+} history_track_t;
+
+/* Hash the fields of a record that ipmeta_record_equal compares */
+static inline khint_t history_record_hash(const ipmeta_record_t *rec)
+{
+  return ipmeta_record_attrs_hash(rec, 0);
+}
+
+/** Set of the distinct records of a history (compared by content) */
+KHASH_INIT(ipmeta_histrec, ipmeta_record_t *, char, 0, history_record_hash,
+           ipmeta_record_equal)
+
+struct ipmeta_history {
+
+  /** The spans of each provider (indexed by id - 1) and family (IPv4 first,
+      then IPv6) */
+  history_track_t tracks[IPMETA_PROVIDER_MAX][2];
+
+  /** Time of the latest snapshot of each provider */
+  uint32_t last_time[IPMETA_PROVIDER_MAX];
+
+  /** Mask of the providers that at least one snapshot was added for */
+  uint32_t provmask;
+
+  /** The distinct records of all snapshots (allocated from arena) */
+  khash_t(ipmeta_histrec) * records;
+
+  /** Arena that the records and their arrays are allocated from */
+  ipmeta_arena_t arena;
+
+  /** Pool of the strings of the records */
+  ipmeta_strpool_t *strings;
+};
+
+static int family_to_idx(int family)
+{
+  return (family == AF_INET) ? 0 : 1;
+}
+
+static inline int span_valid_at(const history_span_t *span, uint32_t time)
+{
+  return span->from <= time && (span->to == SPAN_OPEN || time < span->to);
+}
+
+/* Get the history's copy of a record, copying it if it is the first record
+   with this content */
+static ipmeta_record_t *intern_record(ipmeta_history_t *history,
+                                      ipmeta_record_t *record)
+{
+  ipmeta_record_t *copy;
+  khiter_t k;
+  int khret;
+
+  if ((k = kh_get(ipmeta_histrec, history->records, record)) !=
+      kh_end(history->records)) {
+    return kh_key(history->records, k);
+  }
+
+  if ((copy = ipmeta_record_copy(&history->arena, history->strings, record,
+                                 kh_size(history->records))) == NULL) {
+    return NULL;
+  }
+  kh_put(ipmeta_histrec, history->records, copy, &khret);
+  if (khret < 0) {
+    ipmeta_record_copy_clear(copy);
+    ipmeta_log(__func__, "could not add record to history");
+    return NULL;
+  }
+  return copy;
+}
+
+static int64_t add_span(history_track_t *track, ipmeta_addr128_t first,
+                        ipmeta_addr128_t last, uint32_t time,
+                        ipmeta_record_t *record)
+{
+  history_span_t *tmp;
+  uint64_t new_alloc;
+  history_span_t *span;
+
+  if (track->spans_cnt == track->spans_alloc) {
+    new_alloc = track->spans_alloc ? track->spans_alloc * 2 : 1024;
+    if ((tmp = realloc(track->spans, sizeof(history_span_t) * new_alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc spans");
+      return -1;
+    }
+    track->spans = tmp;
+    track->spans_alloc = new_alloc;
+  }
+
+  span = &track->spans[track->spans_cnt];
+  span->first = first;
+  span->last = last;
+  span->from = time;
+  span->to = SPAN_OPEN;
+  span->record = record;
+  track->index_valid = 0;
+  return (int64_t)track->spans_cnt++;
+}
+
+/* Merge the flattened prefixes of a snapshot into a track: spans that are
+   unchanged stay open, all others are closed, and new spans are opened for
+   the ranges that changed */
+static int add_ranges(ipmeta_history_t *history, history_track_t *track,
+                      int family, ipmeta_ranges_t *ranges, uint32_t time,
+                      uint64_t *opened_cnt, uint64_t *closed_cnt)
+{
+  uint64_t *open = NULL;
+  uint64_t open_cnt = 0;
+  ipmeta_record_t *record, *next;
+  ipmeta_addr128_t first, last;
+  history_span_t *span;
+  uint64_t i = 0, j = 0;
+  int64_t idx;
+
+  if ((open = malloc(sizeof(uint64_t) * ranges->cnt)) == NULL) {
+    ipmeta_log(__func__, "could not malloc open spans");
+    return -1;
+  }
+
+  while (i < ranges->cnt) {
+    if (ranges->records[i] == NULL) {
+      i++;
+      continue;
+    }
+    if ((record = intern_record(history, ranges->records[i])) == NULL) {
+      goto err;
+    }
+
+    /* adjacent ranges whose records have the same content form one span */
+    first = ranges->starts[i];
+    for (i++; i < ranges->cnt && ranges->records[i] != NULL; i++) {
+      if ((next = intern_record(history, ranges->records[i])) == NULL) {
+        goto err;
+      }
+      if (next != record) {
+        break;
+      }
+    }
+    last = (i < ranges->cnt) ? ipmeta_addr128_dec(ranges->starts[i])
+                             : ipmeta_addr128_max(family);
+
+    /* open spans that start before this range are not part of the snapshot
+       any more */
+    while (j < track->open_cnt &&
+           ipmeta_addr128_cmp(&track->spans[track->open[j]].first, &first) <
+             0) {
+      track->spans[track->open[j++]].to = time;
+      (*closed_cnt)++;
+    }
+
+    if (j < track->open_cnt) {
+      span = &track->spans[track->open[j]];
+      if (ipmeta_addr128_cmp(&span->first, &first) == 0 &&
+          ipmeta_addr128_cmp(&span->last, &last) == 0 &&
+          span->record == record) {
+        /* unchanged since the previous snapshot */
+        open[open_cnt++] = track->open[j++];
+        continue;
+      }
+    }
+
+    if ((idx = add_span(track, first, last, time, record)) < 0) {
+      goto err;
+    }
+    open[open_cnt++] = (uint64_t)idx;
+    (*opened_cnt)++;
+  }
+
+  while (j < track->open_cnt) {
+    track->spans[track->open[j++]].to = time;
+    (*closed_cnt)++;
+  }
+
+  free(track->open);
+  track->open = open;
+  track->open_cnt = open_cnt;
+  return 0;
+
+err:
+  free(open);
+  return -1;
+}
+
+/** A span to be sorted by its first address */
+typedef struct span_key {
+  ipmeta_addr128_t first;
+  uint64_t idx;
+} span_key_t;
+
+static int span_key_cmp(const void *a, const void *b)
+{
+  return ipmeta_addr128_cmp(&((const span_key_t *)a)->first,
+                            &((const span_key_t *)b)->first);
+}
+
+/* Fill max_last for the subtree of order[lo, hi), returning its maximum */
+static ipmeta_addr128_t build_max_last(history_track_t *track, uint64_t lo,
+                                       uint64_t hi)
+{
+  uint64_t mid = lo + (hi - lo) / 2;
+  ipmeta_addr128_t max = track->spans[track->order[mid]].last;
+  ipmeta_addr128_t sub;
+
+  if (lo < mid) {
+    sub = build_max_last(track, lo, mid);
+    if (ipmeta_addr128_cmp(&sub, &max) > 0) {
+      max = sub;
+    }
+  }
+  if (mid + 1 < hi) {
+    sub = build_max_last(track, mid + 1, hi);
+    if (ipmeta_addr128_cmp(&sub, &max) > 0) {
+      max = sub;
+    }
+  }
+  track->max_last[mid] = max;
+  return max;
+}
+
+static int build_index(history_track_t *track)
+{
+  span_key_t *keys;
+  uint64_t i;
+
+  free(track->order);
+  free(track->max_last);
+  track->max_last = NULL;
+
+  if ((track->order = malloc(sizeof(uint64_t) * (track->spans_cnt + 1))) ==
+        NULL ||
+      (track->max_last = malloc(sizeof(ipmeta_addr128_t) *
+                                (track->spans_cnt + 1))) == NULL ||
+      (keys = malloc(sizeof(span_key_t) * (track->spans_cnt + 1))) == NULL) {
+    ipmeta_log(__func__, "could not malloc span index");
+    return -1;
+  }
+
+  /* spans are appended in time order, so sorting them by address is all that
+     is needed */
+  for (i = 0; i < track->spans_cnt; i++) {
+    keys[i].first = track->spans[i].first;
+    keys[i].idx = i;
+  }
+  qsort(keys, track->spans_cnt, sizeof(span_key_t), span_key_cmp);
+  for (i = 0; i < track->spans_cnt; i++) {
+    track->order[i] = keys[i].idx;
+  }
+  free(keys);
+
+  if (track->spans_cnt > 0) {
+    build_max_last(track, 0, track->spans_cnt);
+  }
+  track->index_valid = 1;
+  return 0;
+}
+
+/* Find the span that contains an address at a given time */
+static history_span_t *find_span(history_track_t *track,
+                                 const ipmeta_addr128_t *addr, uint32_t time)
+{
+  struct {
+    uint64_t lo;
+    uint64_t hi;
+  } stack[128];
+  int depth = 0;
+  uint64_t lo, hi, mid;
+  history_span_t *span;
+
+  if (track->spans_cnt == 0) {
+    return NULL;
+  }
+  stack[depth].lo = 0;
+  stack[depth++].hi = track->spans_cnt;
+
+  while (depth > 0) {
+    depth--;
+    lo = stack[depth].lo;
+    hi = stack[depth].hi;
+    if (lo >= hi) {
+      continue;
+    }
+    mid = lo + (hi - lo) / 2;
+
+    /* no span of this subtree reaches the address */
+    if (ipmeta_addr128_cmp(&track->max_last[mid], addr) < 0) {
+      continue;
+    }
+
+    span = &track->spans[track->order[mid]];
+    if (ipmeta_addr128_cmp(&span->first, addr) <= 0) {
+      /* only one span contains the address at any given time */
+      if (ipmeta_addr128_cmp(&span->last, addr) >= 0 &&
+          span_valid_at(span, time)) {
+        return span;
+      }
+      stack[depth].lo = mid + 1;
+      stack[depth++].hi = hi;
+    }
+    stack[depth].lo = lo;
+    stack[depth++].hi = mid;
+  }
+
+  return NULL;
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+ipmeta_history_t *ipmeta_history_init(void)
+{
+  ipmeta_history_t *history;
+
+  if ((history = malloc_zero(sizeof(ipmeta_history_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc ipmeta_history_t");
+    return NULL;
+  }
+
+  if ((history->records = kh_init(ipmeta_histrec)) == NULL ||
+      (history->strings = ipmeta_strpool_init()) == NULL) {
+    ipmeta_log(__func__, "could not create record set");
+    ipmeta_history_free(history);
+    return NULL;
+  }
+
+  return history;
+}
+
+void ipmeta_history_free(ipmeta_history_t *history)
+{
+  history_track_t *track;
+  khiter_t k;
+  int i, j;
+
+  if (history == NULL) {
+    return;
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    for (j = 0; j < 2; j++) {
+      track = &history->tracks[i][j];
+      free(track->spans);
+      free(track->open);
+      free(track->order);
+      free(track->max_last);
+    }
+  }
+
+  if (history->records != NULL) {
+    for (k = kh_begin(history->records); k != kh_end(history->records); ++k) {
+      if (kh_exist(history->records, k)) {
+        ipmeta_record_copy_clear(kh_key(history->records, k));
+      }
+    }
+    kh_destroy(ipmeta_histrec, history->records);
+  }
+  ipmeta_arena_free(&history->arena);
+  ipmeta_strpool_free(history->strings);
+
+  free(history);
+}
+
+int ipmeta_history_add_snapshot(ipmeta_history_t *history, ipmeta_t *snapshot,
+                                uint32_t providermask, uint32_t time)
+{
+  static const int families[2] = {AF_INET, AF_INET6};
+  ipmeta_ranges_t ranges;
+  uint64_t opened_cnt = 0, closed_cnt = 0;
+  int i, f;
+
+  assert(history != NULL && snapshot != NULL);
+
+  if (providermask == 0) {
+    providermask = snapshot->all_provmask;
+  }
+  if ((providermask & ~snapshot->all_provmask) != 0) {
+    ipmeta_log(__func__, "not all providers are enabled in the snapshot");
+    return -1;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if ((providermask & IPMETA_PROV_TO_MASK(i + 1)) != 0 &&
+        (history->provmask & IPMETA_PROV_TO_MASK(i + 1)) != 0 &&
+        time <= history->last_time[i]) {
+      ipmeta_log(__func__,
+                 "snapshots must be added in time order (%" PRIu32
+                 " is not after %" PRIu32 ")",
+                 time, history->last_time[i]);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if ((providermask & IPMETA_PROV_TO_MASK(i + 1)) == 0) {
+      continue;
+    }
+    for (f = 0; f < 2; f++) {
+      if (ipmeta_ranges_build(snapshot->datastore, families[f], i + 1,
+                              &ranges) != 0) {
+        return -1;
+      }
+      if (add_ranges(history, &history->tracks[i][f], families[f], &ranges,
+                     time, &opened_cnt, &closed_cnt) != 0) {
+        ipmeta_ranges_clear(&ranges);
+        return -1;
+      }
+      ipmeta_ranges_clear(&ranges);
+    }
+    history->last_time[i] = time;
+    history->provmask |= IPMETA_PROV_TO_MASK(i + 1);
+  }
+
+  ipmeta_log(__func__,
+             "snapshot %" PRIu32 ": %" PRIu64 " spans opened, %" PRIu64
+             " closed (%" PRIu32 " distinct records)",
+             time, opened_cnt, closed_cnt, kh_size(history->records));
+  return 0;
+}
+
+int ipmeta_lookup_addr_at(ipmeta_history_t *history, uint32_t time,
+                          int family, void *addrp, uint32_t providermask,
+                          ipmeta_record_set_t *found)
+{
+  history_track_t *track;
+  history_span_t *span;
+  ipmeta_addr128_t addr;
+  int i;
+
+  assert(history != NULL && found != NULL);
+
+  ipmeta_record_set_clear(found);
+  if (family != AF_INET && family != AF_INET6) {
+    ipmeta_log(__func__, "unsupported address family %d", family);
+    return -1;
+  }
+  if (providermask == 0) {
+    providermask = history->provmask;
+  }
+
+  ipmeta_addr128_from_bytes(family, addrp, &addr);
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if ((providermask & history->provmask & IPMETA_PROV_TO_MASK(i + 1)) ==
+        0) {
+      continue;
+    }
+    track = &history->tracks[i][family_to_idx(family)];
+    if (track->index_valid == 0 && build_index(track) != 0) {
+      return -1;
+    }
+    if ((span = find_span(track, &addr, time)) != NULL &&
+        ipmeta_record_set_add_record(found, span->record, 1) != 0) {
+      return -1;
+    }
+  }
+
+  return (int)found->n_recs;
+}
+
+uint64_t ipmeta_history_get_span_cnt(ipmeta_history_t *history, int family)
+{
+  uint64_t cnt = 0;
+  int i;
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    cnt += history->tracks[i][family_to_idx(family)].spans_cnt;
+  }
+  return cnt;
+}
+
+uint32_t ipmeta_history_get_record_cnt(ipmeta_history_t *history)
+{
+  return kh_size(history->records);
+}
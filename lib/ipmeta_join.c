@@ -0,0 +1,127 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+#include "libipmeta_int.h"
+#include "ipmeta_ranges.h"
+
+int ipmeta_join(ipmeta_t *ipmeta, int family, uint32_t providermask,
+                ipmeta_join_cb_t *cb, void *user)
+{
+  ipmeta_ranges_t ranges[IPMETA_PROVIDER_MAX];
+  uint64_t idx[IPMETA_PROVIDER_MAX];
+  ipmeta_record_t *records[IPMETA_PROVIDER_MAX];
+  ipmeta_addr128_t first = {0, 0};
+  ipmeta_addr128_t last, next;
+  uint8_t first_bytes[sizeof(struct in6_addr)];
+  uint8_t last_bytes[sizeof(struct in6_addr)];
+  int have_next, have_record;
+  int i;
+  int rc = -1;
+
+  assert(ipmeta != NULL && cb != NULL);
+
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+  /* providers that are not enabled have no prefixes to join */
+  providermask &= ipmeta->all_provmask;
+
+  memset(ranges, 0, sizeof(ranges));
+  memset(idx, 0, sizeof(idx));
+  memset(records, 0, sizeof(records));
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if ((providermask & (1 << i)) != 0 &&
+        ipmeta_ranges_build(ipmeta->datastore, family, i + 1, &ranges[i]) !=
+          0) {
+      goto done;
+    }
+  }
+
+  /* each list of ranges covers the whole address space, so a joined range
+     ends wherever the range of any provider does */
+  for (;;) {
+    have_next = 0;
+    have_record = 0;
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      if (ranges[i].cnt == 0) {
+        continue;
+      }
+      records[i] = ranges[i].records[idx[i]];
+      have_record |= (records[i] != NULL);
+      if (idx[i] + 1 < ranges[i].cnt &&
+          (have_next == 0 ||
+           ipmeta_addr128_cmp(&ranges[i].starts[idx[i] + 1], &next) < 0)) {
+        next = ranges[i].starts[idx[i] + 1];
+        have_next = 1;
+      }
+    }
+
+    last = have_next ? ipmeta_addr128_dec(next) : ipmeta_addr128_max(family);
+
+    if (have_record) {
+      ipmeta_addr128_to_bytes(family, &first, first_bytes);
+      ipmeta_addr128_to_bytes(family, &last, last_bytes);
+      if (cb(family, first_bytes, last_bytes,
+             ipmeta_addr128_range_size(family, &first, &last), records,
+             user) != 0) {
+        goto done;
+      }
+    }
+
+    if (have_next == 0) {
+      break;
+    }
+    first = next;
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      if (idx[i] + 1 < ranges[i].cnt &&
+          ipmeta_addr128_cmp(&ranges[i].starts[idx[i] + 1], &next) == 0) {
+        idx[i]++;
+      }
+    }
+  }
+  rc = 0;
+
+done:
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    ipmeta_ranges_clear(&ranges[i]);
+  }
+  return rc;
+}
@@ -0,0 +1,285 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_provider.h"
+#include "ipmeta_ranges.h"
+
+struct ipmeta_projection {
+
+  /** The attribute that was projected */
+  ipmeta_attr_t attr;
+
+  /** Number of bytes used to store each code (1, 2 or 4) */
+  uint8_t code_size;
+
+  /** Start address of each IPv4 range (the first one is always 0) */
+  uint32_t *v4_starts;
+
+  /** Code of each IPv4 range */
+  void *v4_codes;
+
+  /** Number of IPv4 ranges */
+  uint64_t v4_cnt;
+
+  /** Start address of each IPv6 range (the first one is always ::) */
+  ipmeta_addr128_t *v6_starts;
+
+  /** Code of each IPv6 range */
+  void *v6_codes;
+
+  /** Number of IPv6 ranges */
+  uint64_t v6_cnt;
+};
+
+/* Copy codes into an array of the projection's code size */
+static void *pack_codes(const uint32_t *codes, uint64_t cnt, uint8_t code_size)
+{
+  void *packed;
+  uint64_t i;
+
+  if ((packed = malloc(code_size * cnt)) == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < cnt; i++) {
+    switch (code_size) {
+    case 1:
+      ((uint8_t *)packed)[i] = (uint8_t)codes[i];
+      break;
+    case 2:
+      ((uint16_t *)packed)[i] = (uint16_t)codes[i];
+      break;
+    default:
+      ((uint32_t *)packed)[i] = codes[i];
+      break;
+    }
+  }
+  return packed;
+}
+
+static inline uint32_t get_code(const ipmeta_projection_t *proj,
+                                const void *codes, uint64_t i)
+{
+  switch (proj->code_size) {
+  case 1:
+    return ((const uint8_t *)codes)[i];
+  case 2:
+    return ((const uint16_t *)codes)[i];
+  default:
+    return ((const uint32_t *)codes)[i];
+  }
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+uint32_t ipmeta_record_get_attr(const ipmeta_record_t *record,
+                                ipmeta_attr_t attr)
+{
+  switch (attr) {
+  case IPMETA_ATTR_NONE:
+    return 0;
+  case IPMETA_ATTR_COUNTRY:
+    return record->country_id;
+  case IPMETA_ATTR_CONTINENT:
+    return record->continent_id;
+  case IPMETA_ATTR_REGION:
+    return record->region_id;
+  case IPMETA_ATTR_TIMEZONE:
+    return record->timezone_id;
+  case IPMETA_ATTR_ASN:
+    return (record->asn_cnt == 1) ? record->asn[0] : 0;
+  }
+  return 0;
+}
+
+ipmeta_projection_t *ipmeta_projection_init(ipmeta_t *ipmeta,
+                                            ipmeta_provider_t *provider,
+                                            ipmeta_attr_t attr)
+{
+  ipmeta_projection_t *proj = NULL;
+  ipmeta_ranges_t ranges[2];
+  uint32_t *codes[2] = {NULL, NULL};
+  uint64_t cnt[2] = {0, 0};
+  uint32_t max_code = 0;
+  uint32_t code;
+  uint64_t i;
+  int f;
+
+  assert(ipmeta != NULL && provider != NULL);
+
+  memset(ranges, 0, sizeof(ranges));
+
+  if (ipmeta_is_provider_enabled(provider) == 0) {
+    ipmeta_log(__func__, "provider %s is not enabled", provider->name);
+    return NULL;
+  }
+  if (attr == IPMETA_ATTR_NONE) {
+    ipmeta_log(__func__, "no attribute to project");
+    return NULL;
+  }
+
+  if ((proj = malloc_zero(sizeof(ipmeta_projection_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc projection");
+    return NULL;
+  }
+  proj->attr = attr;
+
+  for (f = 0; f < 2; f++) {
+    if (ipmeta_ranges_build(ipmeta->datastore, (f == 0) ? AF_INET : AF_INET6,
+                            provider->id, &ranges[f]) != 0 ||
+        (codes[f] = malloc(sizeof(uint32_t) * ranges[f].cnt)) == NULL) {
+      goto err;
+    }
+    /* replace the records with their codes, merging ranges whose records
+       share a code */
+    for (i = 0; i < ranges[f].cnt; i++) {
+      code = (ranges[f].records[i] != NULL)
+               ? ipmeta_record_get_attr(ranges[f].records[i], attr)
+               : 0;
+      if (cnt[f] > 0 && codes[f][cnt[f] - 1] == code) {
+        continue;
+      }
+      ranges[f].starts[cnt[f]] = ranges[f].starts[i];
+      codes[f][cnt[f]++] = code;
+      if (code > max_code) {
+        max_code = code;
+      }
+    }
+  }
+
+  /* store the codes in as few bytes as possible */
+  proj->code_size = (max_code <= UINT8_MAX) ? 1
+                    : (max_code <= UINT16_MAX) ? 2 : 4;
+
+  proj->v4_cnt = cnt[0];
+  if ((proj->v4_starts = malloc(sizeof(uint32_t) * proj->v4_cnt)) == NULL ||
+      (proj->v4_codes = pack_codes(codes[0], proj->v4_cnt,
+                                   proj->code_size)) == NULL) {
+    goto err;
+  }
+  for (i = 0; i < proj->v4_cnt; i++) {
+    proj->v4_starts[i] = (uint32_t)ranges[0].starts[i].lo;
+  }
+
+  proj->v6_cnt = cnt[1];
+  if ((proj->v6_codes = pack_codes(codes[1], proj->v6_cnt,
+                                   proj->code_size)) == NULL) {
+    goto err;
+  }
+  /* the IPv6 starts are already in their final form */
+  proj->v6_starts = ranges[1].starts;
+  ranges[1].starts = NULL;
+
+  for (f = 0; f < 2; f++) {
+    ipmeta_ranges_clear(&ranges[f]);
+    free(codes[f]);
+  }
+  return proj;
+
+err:
+  ipmeta_log(__func__, "could not build projection");
+  for (f = 0; f < 2; f++) {
+    ipmeta_ranges_clear(&ranges[f]);
+    free(codes[f]);
+  }
+  ipmeta_projection_free(proj);
+  return NULL;
+}
+
+void ipmeta_projection_free(ipmeta_projection_t *proj)
+{
+  if (proj == NULL) {
+    return;
+  }
+  free(proj->v4_starts);
+  free(proj->v4_codes);
+  free(proj->v6_starts);
+  free(proj->v6_codes);
+  free(proj);
+}
+
+uint32_t ipmeta_lookup_attr(ipmeta_projection_t *proj, int family, void *addrp)
+{
+  uint64_t lo = 0, hi, mid;
+  uint32_t v4;
+  ipmeta_addr128_t a;
+
+  /* find the last range that starts at or before the address (the first
+     range always starts at address 0) */
+  if (family == AF_INET) {
+    memcpy(&v4, addrp, sizeof(v4));
+    v4 = ntohl(v4);
+    hi = proj->v4_cnt;
+    while (hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if (proj->v4_starts[mid] <= v4) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    return get_code(proj, proj->v4_codes, lo);
+  }
+
+  ipmeta_addr128_from_bytes(AF_INET6, addrp, &a);
+  hi = proj->v6_cnt;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (ipmeta_addr128_cmp(&proj->v6_starts[mid], &a) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return get_code(proj, proj->v6_codes, lo);
+}
+
+ipmeta_attr_t ipmeta_projection_get_attr(ipmeta_projection_t *proj)
+{
+  return proj->attr;
+}
+
+uint64_t ipmeta_projection_get_range_cnt(ipmeta_projection_t *proj, int family)
+{
+  return (family == AF_INET) ? proj->v4_cnt : proj->v6_cnt;
+}
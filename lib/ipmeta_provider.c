@@ -36,6 +36,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +45,8 @@
 
 #include "libipmeta_int.h"
 #include "ipmeta_ds.h"
+#include "ipmeta_ranges.h"
+#include "ipmeta_spatial.h"
 
 #include "ipmeta_provider.h"
 
@@ -63,6 +66,227 @@
 /* pfx2as */
 #include "ipmeta_provider_pfx2as.h"
 
+/** Number of id slots that are always allowed in the records_by_id array */
+#define RECORDS_BY_ID_MIN_LEN 65536
+
+/** Ids are considered sparse (and the provider switches to the id hash) once
+ * an id is more than this many times larger than the number of records */
+#define RECORDS_BY_ID_MAX_SPARSENESS 4
+
+/** Records are allocated together with their compact part, which is stored
+ * first so that it occupies the start of a cache line */
+typedef struct record_pair {
+  ipmeta_record_hot_t hot;
+  ipmeta_record_t full;
+
+  /** Cached output row of the record (see ipmeta_write_record) */
+  char *output;
+} record_pair_t;
+
+/** Alignment of record pairs (the compact part never straddles two lines) */
+#define RECORD_PAIR_ALIGN 32
+
+#define PAIR_FROM_FULL(rec)                                                    \
+  ((record_pair_t *)((char *)(rec) - offsetof(record_pair_t, full)))
+
+/* Hash the records of a provider by their attributes (their strings are
+ * interned) */
+static inline khint_t record_attrs_hash(const ipmeta_record_t *rec)
+{
+  return ipmeta_record_attrs_hash(rec, 1);
+}
+
+/* Compare all the attributes of two records */
+static inline int record_attrs_equal(const ipmeta_record_t *a,
+                                     const ipmeta_record_t *b)
+{
+  return memcmp(a->country_code, b->country_code, 2) == 0 &&
+         memcmp(a->continent_code, b->continent_code, 2) == 0 &&
+         a->region == b->region && a->city == b->city &&
+         a->post_code == b->post_code && a->latitude == b->latitude &&
+         a->longitude == b->longitude && a->metro_code == b->metro_code &&
+         a->area_code == b->area_code && a->region_code == b->region_code &&
+         a->conn_speed == b->conn_speed && a->timezone == b->timezone &&
+         a->accuracy == b->accuracy && a->asn_ip_cnt == b->asn_ip_cnt &&
+         a->asn_cnt == b->asn_cnt &&
+         (a->asn_cnt == 0 ||
+          memcmp(a->asn, b->asn, sizeof(uint32_t) * a->asn_cnt) == 0) &&
+         a->polygon_ids_cnt == b->polygon_ids_cnt &&
+         (a->polygon_ids_cnt == 0 ||
+          memcmp(a->polygon_ids, b->polygon_ids,
+                 sizeof(uint32_t) * a->polygon_ids_cnt) == 0);
+}
+
+KHASH_INIT(ipmeta_recattrs, const ipmeta_record_t *, char, 0,
+           record_attrs_hash, record_attrs_equal)
+
+/* Convert degrees to the fixed-point representation of compact records */
+static int32_t coord_to_fixed(double deg)
+{
+  double v = deg * IPMETA_RECORD_HOT_COORD_SCALE;
+
+  /* this is also false for NaN */
+  if (!(v > INT32_MIN && v < INT32_MAX)) {
+    return 0;
+  }
+  return (int32_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/* Fill the compact part of a record */
+static void fill_hot(ipmeta_record_t *rec, uint32_t cold_idx)
+{
+  ipmeta_record_hot_t *hot = &PAIR_FROM_FULL(rec)->hot;
+
+  memcpy(hot->country_code, rec->country_code, 2);
+  memcpy(hot->continent_code, rec->continent_code, 2);
+  hot->asn = (rec->asn_cnt == 1) ? rec->asn[0] : 0;
+  hot->latitude = coord_to_fixed(rec->latitude);
+  hot->longitude = coord_to_fixed(rec->longitude);
+  hot->id = rec->id;
+  hot->cold_idx = cold_idx;
+  hot->region_code = rec->region_code;
+  hot->asn_cnt = (rec->asn_cnt > UINT16_MAX) ? UINT16_MAX : rec->asn_cnt;
+  hot->source = rec->source;
+
+  /* from now on the record is known to be part of a record pair */
+  rec->self = rec;
+}
+
+/* Get the region id of a record, which is assigned to the pair of its country
+ * code and region (region codes such as "01" exist in many countries) */
+static int region_id(ipmeta_t *ipmeta, ipmeta_record_t *rec)
+{
+  char buf[256];
+  char *key = buf;
+  size_t len;
+  int rc;
+
+  if (rec->region == NULL) {
+    rec->region_id = 0;
+    return 0;
+  }
+
+  len = strlen(rec->region);
+  if (len + IPMETA_REGION_KEY_PREFIX_LEN + 1 > sizeof(buf) &&
+      (key = malloc(len + IPMETA_REGION_KEY_PREFIX_LEN + 1)) == NULL) {
+    return -1;
+  }
+  key[0] = (rec->country_code[0] != '\0') ? rec->country_code[0] : ' ';
+  key[1] = (rec->country_code[0] != '\0' && rec->country_code[1] != '\0')
+             ? rec->country_code[1]
+             : ' ';
+  key[2] = ':';
+  memcpy(key + IPMETA_REGION_KEY_PREFIX_LEN, rec->region, len + 1);
+
+  rc = ipmeta_strdict_id(ipmeta->regions, key, &rec->region_id);
+
+  if (key != buf) {
+    free(key);
+  }
+  return rc;
+}
+
+/* Fill the integer attribute codes and the compact part of every record of
+ * the provider */
+static int finalize_records(ipmeta_t *ipmeta, ipmeta_provider_t *provider)
+{
+  ipmeta_record_t *rec;
+  uint32_t i;
+
+  for (i = 0; i < provider->records_cnt; i++) {
+    rec = provider->records[i];
+
+    rec->country_id = ipmeta_country_id(rec->country_code);
+    rec->continent_id = ipmeta_continent_id(rec->continent_code);
+    if (region_id(ipmeta, rec) != 0 ||
+        ipmeta_strdict_id(ipmeta->timezones, rec->timezone,
+                          &rec->timezone_id) != 0) {
+      ipmeta_log(__func__, "could not assign attribute ids");
+      return -1;
+    }
+
+    fill_hot(rec, i);
+  }
+
+  return 0;
+}
+
+/* Add two /64 counts, saturating at UINT64_MAX */
+static inline uint64_t add_v6_cnt(uint64_t a, uint64_t b)
+{
+  return (a > UINT64_MAX - b) ? UINT64_MAX : a + b;
+}
+
+/* Add the address space of every range of the given family to the coverage of
+ * the record it maps to */
+static int add_family_coverage(ipmeta_provider_t *provider, int family)
+{
+  ipmeta_ranges_t ranges;
+  ipmeta_addr128_t last;
+  ipmeta_coverage_t *cov;
+  uint64_t n, i;
+
+  if (ipmeta_ranges_build(provider->ds, family, provider->id, &ranges) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < ranges.cnt; i++) {
+    if (ranges.records[i] == NULL) {
+      continue;
+    }
+    last = (i + 1 < ranges.cnt) ? ipmeta_addr128_dec(ranges.starts[i + 1])
+                                : ipmeta_addr128_max(family);
+    n = ipmeta_addr128_range_size(family, &ranges.starts[i], &last);
+    cov = &ranges.records[i]->coverage;
+    if (family == AF_INET) {
+      cov->v4_ip_cnt += n;
+    } else {
+      cov->v6_ip_cnt = add_v6_cnt(cov->v6_ip_cnt, n);
+    }
+  }
+
+  ipmeta_ranges_clear(&ranges);
+  return 0;
+}
+
+/* Compute how much address space maps to each record of the provider, and to
+ * each country */
+static int compute_coverage(ipmeta_provider_t *provider)
+{
+  ipmeta_coverage_t *cov;
+  ipmeta_record_t *rec;
+  uint32_t i;
+
+  for (i = 0; i < provider->records_cnt; i++) {
+    memset(&provider->records[i]->coverage, 0, sizeof(ipmeta_coverage_t));
+  }
+
+  if (add_family_coverage(provider, AF_INET) != 0 ||
+      add_family_coverage(provider, AF_INET6) != 0) {
+    ipmeta_log(__func__, "could not compute coverage of %s records",
+               provider->name);
+    return -1;
+  }
+
+  if (provider->country_coverage == NULL &&
+      (provider->country_coverage = malloc(
+         sizeof(ipmeta_coverage_t) * IPMETA_COUNTRY_ID_CNT)) == NULL) {
+    ipmeta_log(__func__, "could not malloc country coverage");
+    return -1;
+  }
+  memset(provider->country_coverage, 0,
+         sizeof(ipmeta_coverage_t) * IPMETA_COUNTRY_ID_CNT);
+
+  for (i = 0; i < provider->records_cnt; i++) {
+    rec = provider->records[i];
+    cov = &provider->country_coverage[rec->country_id];
+    cov->v4_ip_cnt += rec->coverage.v4_ip_cnt;
+    cov->v6_ip_cnt = add_v6_cnt(cov->v6_ip_cnt, rec->coverage.v6_ip_cnt);
+  }
+
+  return 0;
+}
+
 /** Convenience typedef for the provider alloc function type */
 typedef ipmeta_provider_t *(*provider_alloc_func_t)(void);
 
@@ -78,35 +302,6 @@ static const provider_alloc_func_t provider_alloc_functions[] = {
   ipmeta_provider_pfx2as_alloc,
 };
 
-void ipmeta_free_record(ipmeta_record_t *record)
-{
-  if (record == NULL) {
-    return;
-  }
-
-  free(record->region);
-  record->region = NULL;
-
-  free(record->city);
-  record->city = NULL;
-
-  free(record->post_code);
-  record->post_code = NULL;
-
-  free(record->conn_speed);
-  record->conn_speed = NULL;
-
-  free(record->polygon_ids);
-  record->polygon_ids = NULL;
-
-  free(record->asn);
-  record->asn = NULL;
-  record->asn_cnt = 0;
-
-  free(record);
-  return;
-}
-
 /* --- Public functions below here -- */
 
 int ipmeta_provider_alloc_all(ipmeta_t *ipmeta)
@@ -152,9 +347,10 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
 
   /* otherwise, we need to init this plugin */
 
-  /* initialize the record hash */
-  provider->all_records = kh_init(ipmeta_rechash);
+  /* records are indexed by id in a plain array until the ids turn out to be
+     sparse (see ipmeta_provider_insert_record) */
   provider->ds = ipmeta->datastore;
+  provider->strings = ipmeta->strings;
 
   /* now that we have set up the datastructure stuff, ask the provider to
      initialize. this will normally mean that it reads in some database and
@@ -163,15 +359,53 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
     goto err;
   }
 
+  /* all records are complete now */
+  if (finalize_records(ipmeta, provider) != 0) {
+    goto err;
+  }
+
+  /* and so are the prefixes */
+  if (provider->ds->finalize(provider->ds) != 0) {
+    goto err;
+  }
+
+  /* which lets us work out how much address space each record covers */
+  if (compute_coverage(provider) != 0) {
+    goto err;
+  }
+
+  /* and then give the provider a chance to use the final records */
+  if (provider->finalize(provider) != 0) {
+    goto err;
+  }
+
+  /* records can no longer be merged once loading is complete */
+  if (provider->unique_records != NULL) {
+    kh_destroy(ipmeta_recattrs, provider->unique_records);
+    provider->unique_records = NULL;
+  }
+
   /* 2017-03-31 AK moves this to after a successful init, otherwise the provider
      is marked as enabled even when it is not. But I'm not sure if this leads to
      a memory leak :/ */
   provider->enabled = 1;
 
+  ipmeta_log(__func__,
+             "loaded %" PRIu32 " %s records (%zu distinct strings shared by "
+             "all providers)",
+             provider->records_cnt, provider->name,
+             ipmeta_strpool_size(provider->strings));
+
   return 0;
 
 err:
   if (provider != NULL) {
+    if (provider->unique_records != NULL) {
+      kh_destroy(ipmeta_recattrs, provider->unique_records);
+      provider->unique_records = NULL;
+    }
+    free(provider->country_coverage);
+    provider->country_coverage = NULL;
     provider->ds = NULL;
     /* do not free the provider as we did not alloc it */
   }
@@ -191,13 +425,32 @@ void ipmeta_provider_free(ipmeta_t *ipmeta, ipmeta_provider_t *provider)
     /* remove the pointer from ipmeta */
     ipmeta->providers[provider->id - 1] = NULL;
 
-    /* free the records hash */
+    for (uint32_t i = 0; i < provider->records_cnt; i++) {
+      free(PAIR_FROM_FULL(provider->records[i])->output);
+    }
+
+    /* this is where the records are free'd */
+    ipmeta_arena_free(&provider->arena);
+
+    free(provider->records);
+    provider->records = NULL;
+    provider->records_cnt = 0;
+    provider->records_alloc = 0;
+
+    free(provider->records_by_id);
+    provider->records_by_id = NULL;
+    provider->records_by_id_len = 0;
+
     if (provider->all_records != NULL) {
-      /* this is where the records are free'd */
-      kh_free_vals(ipmeta_rechash, provider->all_records, ipmeta_free_record);
       kh_destroy(ipmeta_rechash, provider->all_records);
       provider->all_records = NULL;
     }
+
+    free(provider->country_coverage);
+    provider->country_coverage = NULL;
+
+    ipmeta_spatial_free(provider->spatial);
+    provider->spatial = NULL;
   }
 
   /* finally, free the actual provider structure */
@@ -222,27 +475,140 @@ void ipmeta_provider_free_state(ipmeta_provider_t *provider)
   provider->state = NULL;
 }
 
-ipmeta_record_t *ipmeta_provider_insert_record(ipmeta_provider_t *provider,
-                                               ipmeta_record_t *record)
+/* Move the id index of a provider from the records_by_id array to a hash */
+static int switch_to_id_hash(ipmeta_provider_t *provider)
 {
   khiter_t khiter;
   int khret;
 
+  if ((provider->all_records = kh_init(ipmeta_rechash)) == NULL) {
+    return -1;
+  }
+  kh_resize(ipmeta_rechash, provider->all_records, provider->records_cnt);
+  for (uint32_t i = 0; i < provider->records_cnt; i++) {
+    khiter = kh_put(ipmeta_rechash, provider->all_records,
+                    provider->records[i]->id, &khret);
+    kh_value(provider->all_records, khiter) = provider->records[i];
+  }
+
+  free(provider->records_by_id);
+  provider->records_by_id = NULL;
+  provider->records_by_id_len = 0;
+  return 0;
+}
+
+/* Add the record to the id index of the provider */
+static int index_record(ipmeta_provider_t *provider, ipmeta_record_t *record)
+{
+  ipmeta_record_t **tmp;
+  uint64_t new_len;
+  khiter_t khiter;
+  int khret;
+
+  if (provider->all_records == NULL &&
+      record->id >= provider->records_by_id_len) {
+    if (record->id >= RECORDS_BY_ID_MIN_LEN &&
+        (record->id / RECORDS_BY_ID_MAX_SPARSENESS > provider->records_cnt ||
+         record->id == UINT32_MAX)) {
+      /* too sparse to index by id */
+      if (switch_to_id_hash(provider) != 0) {
+        return -1;
+      }
+    } else {
+      new_len = (uint64_t)provider->records_by_id_len * 2;
+      if (new_len <= record->id) {
+        new_len = (uint64_t)record->id + 1;
+      }
+      if (new_len < 1024) {
+        new_len = 1024;
+      }
+      if (new_len > UINT32_MAX) {
+        new_len = UINT32_MAX;
+      }
+      if ((tmp = realloc(provider->records_by_id,
+                         sizeof(ipmeta_record_t *) * new_len)) == NULL) {
+        return -1;
+      }
+      memset(tmp + provider->records_by_id_len, 0,
+             sizeof(ipmeta_record_t *) *
+               (new_len - provider->records_by_id_len));
+      provider->records_by_id = tmp;
+      provider->records_by_id_len = (uint32_t)new_len;
+    }
+  }
+
+  if (provider->all_records != NULL) {
+    khiter = kh_put(ipmeta_rechash, provider->all_records, record->id, &khret);
+    assert(khret != 0); // id was not already present
+    kh_value(provider->all_records, khiter) = record;
+  } else {
+    assert(provider->records_by_id[record->id] == NULL);
+    provider->records_by_id[record->id] = record;
+  }
+  return 0;
+}
+
+ipmeta_record_t *ipmeta_provider_insert_record(ipmeta_provider_t *provider,
+                                               ipmeta_record_t *record)
+{
+  ipmeta_record_t **tmp;
+  uint32_t new_alloc;
+
   record->source = provider->id;
 
-  khiter = kh_put(ipmeta_rechash, provider->all_records, record->id, &khret);
-  assert(khret != 0); // id was not already present
-  kh_value(provider->all_records, khiter) = record;
+  if (provider->records_cnt == provider->records_alloc) {
+    new_alloc = provider->records_alloc ? provider->records_alloc * 2 : 1024;
+    if ((tmp = realloc(provider->records,
+                       sizeof(ipmeta_record_t *) * new_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not grow records array");
+      return NULL;
+    }
+    provider->records = tmp;
+    provider->records_alloc = new_alloc;
+  }
+
+  if (index_record(provider, record) != 0) {
+    ipmeta_log(__func__, "could not index record %" PRIu32, record->id);
+    return NULL;
+  }
+  provider->records[provider->records_cnt++] = record;
 
   return record;
 }
 
+void *ipmeta_provider_arena_alloc(ipmeta_provider_t *provider, size_t size)
+{
+  return ipmeta_arena_alloc(&provider->arena, size);
+}
+
+char *ipmeta_provider_arena_strndup(ipmeta_provider_t *provider,
+                                    const char *str, size_t len)
+{
+  return ipmeta_arena_strndup(&provider->arena, str, len);
+}
+
+char *ipmeta_provider_intern(ipmeta_provider_t *provider, const char *str)
+{
+  return ipmeta_strpool_intern(provider->strings, str);
+}
+
+ipmeta_record_t *ipmeta_provider_alloc_record(ipmeta_provider_t *provider)
+{
+  record_pair_t *pair;
+
+  if ((pair = ipmeta_arena_alloc_aligned(&provider->arena, sizeof(*pair),
+                                         RECORD_PAIR_ALIGN)) == NULL) {
+    return NULL;
+  }
+  return &pair->full;
+}
+
 ipmeta_record_t *ipmeta_provider_init_record(ipmeta_provider_t *provider,
                                              uint32_t id)
 {
   ipmeta_record_t *record;
 
-  if ((record = malloc_zero(sizeof(ipmeta_record_t))) == NULL) {
+  if ((record = ipmeta_provider_alloc_record(provider)) == NULL) {
     return NULL;
   }
 
@@ -256,6 +622,11 @@ ipmeta_record_t *ipmeta_provider_get_record(ipmeta_provider_t *provider,
 {
   khiter_t khiter;
 
+  if (provider->all_records == NULL) {
+    return (id < provider->records_by_id_len) ? provider->records_by_id[id]
+                                              : NULL;
+  }
+
   /* grab the corresponding record from the hash */
   if ((khiter = kh_get(ipmeta_rechash, provider->all_records, id)) ==
       kh_end(provider->all_records)) {
@@ -268,9 +639,7 @@ int ipmeta_provider_get_all_records(ipmeta_provider_t *provider,
                                     ipmeta_record_t ***records)
 {
   ipmeta_record_t **rec_arr = NULL;
-  ipmeta_record_t **rec_ptr = NULL;
-  unsigned rec_cnt = kh_size(provider->all_records);
-  khiter_t i;
+  unsigned rec_cnt = provider->records_cnt;
 
   /* if there are no records in the array, don't bother */
   if (rec_cnt == 0) {
@@ -282,22 +651,203 @@ int ipmeta_provider_get_all_records(ipmeta_provider_t *provider,
   if ((rec_arr = malloc(sizeof(ipmeta_record_t *) * rec_cnt)) == NULL) {
     return -1;
   }
-
-  rec_ptr = rec_arr;
-  /* insert all the records into the array */
-  for (i = kh_begin(provider->all_records); i != kh_end(provider->all_records);
-       ++i) {
-    if (kh_exist(provider->all_records, i)) {
-      *rec_ptr = kh_value(provider->all_records, i);
-      rec_ptr++;
-    }
-  }
+  memcpy(rec_arr, provider->records, sizeof(ipmeta_record_t *) * rec_cnt);
 
   /* return the array and the count */
   *records = rec_arr;
   return (int)rec_cnt;
 }
 
+int ipmeta_provider_peek_all_records(ipmeta_provider_t *provider,
+                                     ipmeta_record_t *const **records)
+{
+  *records = provider->records;
+  return (int)provider->records_cnt;
+}
+
+const ipmeta_coverage_t *
+ipmeta_provider_get_country_coverage(ipmeta_provider_t *provider,
+                                     const char *country_code)
+{
+  assert(provider != NULL);
+
+  if (provider->enabled == 0 || provider->country_coverage == NULL) {
+    return NULL;
+  }
+  return &provider->country_coverage[ipmeta_country_id(country_code)];
+}
+
+khint_t ipmeta_record_attrs_hash(const ipmeta_record_t *rec, int interned)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  uint64_t v;
+  double d;
+  int i;
+
+#define MIX(x)                                                                 \
+  do {                                                                         \
+    h ^= (uint64_t)(x);                                                        \
+    h *= 0xff51afd7ed558ccdULL;                                                \
+    h ^= h >> 32;                                                              \
+  } while (0)
+#define MIX_STR(s)                                                             \
+  MIX(interned ? (uint64_t)(uintptr_t)(s)                                      \
+               : kh_str_hash_func((s) != NULL ? (s) : ""))
+#define MIX_DOUBLE(x)                                                          \
+  do {                                                                         \
+    d = ((x) == 0) ? 0 : (x); /* -0.0 and 0.0 compare equal */               \
+    memcpy(&v, &d, sizeof(v));                                                 \
+    MIX(v);                                                                    \
+  } while (0)
+
+  MIX(rec->source);
+  MIX(((uint32_t)(uint8_t)rec->country_code[0] << 24) |
+      ((uint32_t)(uint8_t)rec->country_code[1] << 16) |
+      ((uint32_t)(uint8_t)rec->continent_code[0] << 8) |
+      (uint32_t)(uint8_t)rec->continent_code[1]);
+  MIX_STR(rec->region);
+  MIX_STR(rec->city);
+  MIX_STR(rec->post_code);
+  MIX_DOUBLE(rec->latitude);
+  MIX_DOUBLE(rec->longitude);
+  MIX(((uint64_t)rec->metro_code << 32) | rec->area_code);
+  MIX(((uint64_t)rec->region_code << 32) | (uint32_t)rec->accuracy);
+  MIX_STR(rec->conn_speed);
+  MIX_STR(rec->timezone);
+  MIX(rec->asn_cnt);
+  for (i = 0; i < rec->asn_cnt; i++) {
+    MIX(rec->asn[i]);
+  }
+  MIX(rec->polygon_ids_cnt);
+  for (i = 0; i < rec->polygon_ids_cnt; i++) {
+    MIX(rec->polygon_ids[i]);
+  }
+
+#undef MIX_DOUBLE
+#undef MIX_STR
+#undef MIX
+
+  return (khint_t)(h ^ (h >> 29));
+}
+
+char **ipmeta_provider_record_output(ipmeta_record_t *record)
+{
+  /* only the records allocated by libipmeta have a pair around them (a copy
+     of one, or a record built by the caller, must not be written through) */
+  if (record->self != record) {
+    return NULL;
+  }
+  return &PAIR_FROM_FULL(record)->output;
+}
+
+/* Intern a string that may be NULL */
+static int copy_str(ipmeta_strpool_t *strings, const char *str, char **copy)
+{
+  if (str == NULL) {
+    *copy = NULL;
+    return 0;
+  }
+  return ((*copy = ipmeta_strpool_intern(strings, str)) == NULL) ? -1 : 0;
+}
+
+ipmeta_record_t *ipmeta_record_copy(ipmeta_arena_t *arena,
+                                    ipmeta_strpool_t *strings,
+                                    const ipmeta_record_t *record,
+                                    uint32_t cold_idx)
+{
+  record_pair_t *pair;
+  ipmeta_record_t *copy;
+
+  if ((pair = ipmeta_arena_alloc_aligned(arena, sizeof(*pair),
+                                         RECORD_PAIR_ALIGN)) == NULL) {
+    goto err;
+  }
+  copy = &pair->full;
+  *copy = *record;
+  copy->next = NULL;
+  copy->region_id = 0;
+  copy->timezone_id = 0;
+  memset(&copy->coverage, 0, sizeof(copy->coverage));
+
+  if (copy_str(strings, record->region, &copy->region) != 0 ||
+      copy_str(strings, record->city, &copy->city) != 0 ||
+      copy_str(strings, record->post_code, &copy->post_code) != 0 ||
+      copy_str(strings, record->conn_speed, &copy->conn_speed) != 0 ||
+      copy_str(strings, record->timezone, &copy->timezone) != 0) {
+    goto err;
+  }
+
+  if (record->asn_cnt > 0) {
+    if ((copy->asn = ipmeta_arena_alloc(arena, sizeof(uint32_t) *
+                                                 record->asn_cnt)) == NULL) {
+      goto err;
+    }
+    memcpy(copy->asn, record->asn, sizeof(uint32_t) * record->asn_cnt);
+  }
+  if (record->polygon_ids_cnt > 0) {
+    if ((copy->polygon_ids = ipmeta_arena_alloc(
+           arena, sizeof(uint32_t) * record->polygon_ids_cnt)) == NULL) {
+      goto err;
+    }
+    memcpy(copy->polygon_ids, record->polygon_ids,
+           sizeof(uint32_t) * record->polygon_ids_cnt);
+  }
+
+  fill_hot(copy, cold_idx);
+  return copy;
+
+err:
+  ipmeta_log(__func__, "could not copy record %" PRIu32, record->id);
+  return NULL;
+}
+
+void ipmeta_record_copy_clear(ipmeta_record_t *record)
+{
+  free(PAIR_FROM_FULL(record)->output);
+  PAIR_FROM_FULL(record)->output = NULL;
+}
+
+const ipmeta_record_hot_t *ipmeta_record_get_hot(const ipmeta_record_t *record)
+{
+  /* only the records allocated by libipmeta have a compact part */
+  if (record == NULL || record->self != record) {
+    return NULL;
+  }
+  return &PAIR_FROM_FULL(record)->hot;
+}
+
+ipmeta_record_t *ipmeta_record_hot_get_full(const ipmeta_record_hot_t *hot)
+{
+  return &((record_pair_t *)hot)->full;
+}
+
+ipmeta_record_t *
+ipmeta_provider_find_identical_record(ipmeta_provider_t *provider,
+                                      const ipmeta_record_t *record)
+{
+  khiter_t khiter;
+
+  if (provider->unique_records == NULL ||
+      (khiter = kh_get(ipmeta_recattrs, provider->unique_records, record)) ==
+        kh_end(provider->unique_records)) {
+    return NULL;
+  }
+  return (ipmeta_record_t *)kh_key(provider->unique_records, khiter);
+}
+
+int ipmeta_provider_register_unique_record(ipmeta_provider_t *provider,
+                                           ipmeta_record_t *record)
+{
+  int khret;
+
+  if (provider->unique_records == NULL &&
+      (provider->unique_records = kh_init(ipmeta_recattrs)) == NULL) {
+    return -1;
+  }
+  kh_put(ipmeta_recattrs, provider->unique_records, record, &khret);
+  return (khret < 0) ? -1 : 0;
+}
+
 int ipmeta_provider_associate_record(ipmeta_provider_t *provider, int family,
     void *addrp, uint8_t pfxlen, ipmeta_record_t *record)
 {
@@ -38,6 +38,8 @@
 #include <inttypes.h>
 
 #include "libipmeta.h"
+#include "ipmeta_arena.h"
+#include "ipmeta_strpool.h"
 
 /** @file
  *
@@ -64,7 +66,8 @@
   int ipmeta_provider_##provname##_lookup_pfx(ipmeta_provider_t *provider,     \
       int family, void *addrp, uint8_t pfxlen, ipmeta_record_set_t *records);  \
   int ipmeta_provider_##provname##_lookup_addr(ipmeta_provider_t *provider,    \
-      int family, void *addrp, ipmeta_record_set_t *found);
+      int family, void *addrp, ipmeta_record_set_t *found);                    \
+  int ipmeta_provider_##provname##_finalize(ipmeta_provider_t *provider);
 
 /** Convenience macro that defines all the function pointers for the ipmeta
  * provider API
@@ -72,7 +75,8 @@
 #define IPMETA_PROVIDER_GENERATE_PTRS(provname)                                \
   ipmeta_provider_##provname##_init, ipmeta_provider_##provname##_free,        \
     ipmeta_provider_##provname##_lookup_pfx,                                   \
-    ipmeta_provider_##provname##_lookup_addr, 0, NULL, NULL, NULL
+    ipmeta_provider_##provname##_lookup_addr,                                  \
+    ipmeta_provider_##provname##_finalize
 
 /** Structure which represents a metadata provider */
 struct ipmeta_provider {
@@ -154,6 +158,17 @@ struct ipmeta_provider {
   int (*lookup_addr)(ipmeta_provider_t *provider, int family, void *addrp,
                      ipmeta_record_set_t *found);
 
+  /** Complete provider-specific state once all records are final
+   *
+   * @param provider      The provider to finalize
+   * @return 0 if successful, -1 otherwise
+   *
+   * This is called by the provider manager after the provider's init function
+   * has returned, and after the attribute codes and address coverage of every
+   * record have been filled in.
+   */
+  int (*finalize)(ipmeta_provider_t *provider);
+
   /** }@ */
 
   /**
@@ -168,12 +183,47 @@ struct ipmeta_provider {
 
   int enabled;
 
-  /** A hash of id => record for all allocated records of this provider */
+  /** All records of this provider, in the order they were inserted */
+  ipmeta_record_t **records;
+
+  /** Number of records in the records array */
+  uint32_t records_cnt;
+
+  /** Number of records allocated in the records array */
+  uint32_t records_alloc;
+
+  /** Records indexed by id (NULL for unused ids), while ids are dense */
+  ipmeta_record_t **records_by_id;
+
+  /** Number of slots allocated in the records_by_id array */
+  uint32_t records_by_id_len;
+
+  /** A hash of id => record, only used once the provider's ids turn out to
+   * be too sparse for records_by_id */
   khash_t(ipmeta_rechash) * all_records;
 
+  /** Set of records that later records with identical attributes may be
+   * merged into (only exists while the provider is being initialized) */
+  struct kh_ipmeta_recattrs_s *unique_records;
+
+  /** Arena that the records (and the memory they reference) are allocated
+   * from */
+  ipmeta_arena_t arena;
+
   /** The datastructure that will be used to perform IP => record lookups */
   struct ipmeta_ds *ds;
 
+  /** Number of IPv4 addresses (v4_ip_cnt) and IPv6 /64s (v6_ip_cnt) that map
+   * to records of each country, indexed by country id */
+  ipmeta_coverage_t *country_coverage;
+
+  /** Index of the locations of the records (built by the first spatial
+   * query, see ipmeta_spatial.h) */
+  struct ipmeta_spatial *spatial;
+
+  /** The string pool shared by all providers of the ipmeta instance */
+  struct ipmeta_strpool *strings;
+
   /** An opaque pointer to provider-specific state if needed by the provider */
   void *state;
 
@@ -238,30 +288,129 @@ void ipmeta_provider_free_state(ipmeta_provider_t *provider);
  *
  * @param provider      The metadata provider to associate the record with
  * @param record        Pointer to the record to be inserted
- * @return pointer to the record
+ * @return pointer to the record, NULL if an error occurred
  *
  * The record->id must be set before this function is called.
  * This function will set record->source and insert the record into the
  * provider's lookup table.
  *
- * The record will be free'd when ipmeta_free_provider() is called, including
- * *ALL* char pointers in the record.
+ * The record must have been allocated with ipmeta_provider_alloc_record, and
+ * *ALL* memory it points to with ipmeta_provider_arena_alloc (or
+ * ipmeta_provider_arena_strndup), or be strings returned by
+ * ipmeta_provider_intern. It will be released along with the provider's arena
+ * when ipmeta_provider_free() is called.
  */
 ipmeta_record_t *ipmeta_provider_insert_record(ipmeta_provider_t *provider,
                                                ipmeta_record_t *record);
 
+/** Allocate an empty record that lives as long as the provider
+ *
+ * @param provider      The metadata provider to allocate the record for
+ * @return the new (zeroed) record, NULL if an error occurred
+ *
+ * The record is allocated together with its compact part (see
+ * ipmeta_record_hot_t), which is filled once the provider's init function
+ * returns. The record is not inserted into the provider.
+ */
+ipmeta_record_t *ipmeta_provider_alloc_record(ipmeta_provider_t *provider);
+
+/** Allocate zeroed memory that lives as long as the provider
+ *
+ * @param provider      The metadata provider to allocate memory for
+ * @param size          The number of bytes to allocate
+ * @return a pointer to the memory, NULL if an error occurred
+ *
+ * Use this for the strings and arrays that records reference. The memory
+ * cannot be free'd individually.
+ */
+void *ipmeta_provider_arena_alloc(ipmeta_provider_t *provider, size_t size);
+
+/** Copy a string into memory that lives as long as the provider
+ *
+ * @param provider      The metadata provider to allocate memory for
+ * @param str           Pointer to the string to copy
+ * @param len           The number of characters to copy
+ * @return a nul-terminated copy of the string, NULL if an error occurred
+ */
+char *ipmeta_provider_arena_strndup(ipmeta_provider_t *provider,
+                                    const char *str, size_t len);
+
+/** Get the interned copy of a record attribute string
+ *
+ * @param provider      The metadata provider the string is for
+ * @param str           Pointer to the (nul-terminated) string to intern
+ * @return the shared copy of the string, NULL if an error occurred
+ *
+ * Identical strings (from any provider) are stored once, so interned strings
+ * can be compared by pointer. The returned string MUST NOT be modified, and
+ * lives until the ipmeta instance is free'd.
+ */
+char *ipmeta_provider_intern(ipmeta_provider_t *provider, const char *str);
+
 /** Allocate an empty metadata record for the given id
  *
  * @param provider      The metadata provider to associate the record with
  * @param id            The id to use to inialize the record
  * @return the new metadata record, NULL if an error occurred
  *
- * Allocate an empty record, set record->id = id, and call
- * ipmeta_provider_insert_record(provider, record).
+ * Allocate an empty record with ipmeta_provider_alloc_record, set
+ * record->id = id, and call ipmeta_provider_insert_record(provider, record).
  */
 ipmeta_record_t *ipmeta_provider_init_record(ipmeta_provider_t *provider,
                                              uint32_t id);
 
+/** Hash the attributes of a record
+ *
+ * @param rec           The record to hash
+ * @param interned      Non-zero if the strings of the record are interned in
+ *                      the same pool as those of every record it is compared
+ *                      to (so their pointers are hashed), zero to hash their
+ *                      contents (treating NULL like an empty string)
+ * @return the hash of the record
+ *
+ * Ids, asn_ip_cnt and the fields derived from the loaded data are not hashed,
+ * so records that are equal according to ipmeta_record_equal (or that only
+ * differ in those fields) have the same hash.
+ */
+khint_t ipmeta_record_attrs_hash(const ipmeta_record_t *rec, int interned);
+
+/** Get the slot that holds the cached output row of a record
+ *
+ * @param record        The record to get the slot for
+ * @return a pointer to the slot (which holds NULL until a row is cached), NULL
+ * if the record was not allocated by libipmeta (see ipmeta_record_t.self)
+ *
+ * A string stored in the slot must be allocated with malloc, and is free'd
+ * along with the provider.
+ */
+char **ipmeta_provider_record_output(ipmeta_record_t *record);
+
+/** Copy a record so that it can outlive the provider it came from
+ *
+ * @param arena         The arena to allocate the copy from
+ * @param strings       The pool to intern the strings of the copy in
+ * @param record        The record to copy
+ * @param cold_idx      The cold_idx to store in the compact part of the copy
+ * @return the copy, NULL if an error occurred
+ *
+ * The copy is laid out like the records of a provider, so it has its own
+ * compact part (see ipmeta_record_get_hot). Its region and timezone ids and
+ * its coverage are 0, as they only have a meaning within the instance of the
+ * original record.
+ * ipmeta_record_copy_clear must be called for the copy before the arena is
+ * free'd.
+ */
+ipmeta_record_t *ipmeta_record_copy(ipmeta_arena_t *arena,
+                                    ipmeta_strpool_t *strings,
+                                    const ipmeta_record_t *record,
+                                    uint32_t cold_idx);
+
+/** Free the memory that a record copy holds outside of its arena
+ *
+ * @param record        The record copy to clear
+ */
+void ipmeta_record_copy_clear(ipmeta_record_t *record);
+
 /** Get the metadata record for the given id
  *
  * @param provider      The metadata provider to retrieve the record from
@@ -271,6 +420,35 @@ ipmeta_record_t *ipmeta_provider_init_record(ipmeta_provider_t *provider,
 ipmeta_record_t *ipmeta_provider_get_record(ipmeta_provider_t *provider,
                                             uint32_t id);
 
+/** Find a registered record whose attributes are identical to the given one
+ *
+ * @param provider      The metadata provider to search
+ * @param record        The record to look for (need not be inserted)
+ * @return the identical record, NULL if there is none
+ *
+ * All fields other than id, source and next are compared. String attributes
+ * are compared by pointer, so they must have been interned with
+ * ipmeta_provider_intern. Only records registered with
+ * ipmeta_provider_register_unique_record during initialization of the
+ * provider are found.
+ */
+ipmeta_record_t *
+ipmeta_provider_find_identical_record(ipmeta_provider_t *provider,
+                                      const ipmeta_record_t *record);
+
+/** Register an inserted record so that later identical records can reuse it
+ *
+ * @param provider      The metadata provider the record belongs to
+ * @param record        The record to register
+ * @return 0 if the record was registered (or an identical record already
+ * was), -1 if an error occurred
+ *
+ * The set of registered records is discarded once the provider's init
+ * function returns, so this only deduplicates records while loading.
+ */
+int ipmeta_provider_register_unique_record(ipmeta_provider_t *provider,
+                                           ipmeta_record_t *record);
+
 /** Register a new prefix to record mapping for the given provider
  *
  * @param provider      The provider to register the mapping with
@@ -314,12 +492,6 @@ int ipmeta_provider_lookup_pfx(ipmeta_provider_t *provider, int family,
 int ipmeta_provider_lookup_addr(ipmeta_provider_t *provider, int family,
     void *addrp, ipmeta_record_set_t *found);
 
-/** Dealloacate a record.
- *
- * @param record   Pointer to the record to free.
- */
-void ipmeta_free_record(ipmeta_record_t *record);
-
 /** }@ */
 
 #endif /* __IPMETA_PROVIDER_H */
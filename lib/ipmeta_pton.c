@@ -0,0 +1,215 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ipmeta_pton.h"
+
+#define HEX_ENTRY(c, v) [c] = (v) + 1
+
+/** Value (plus one) of each hex digit, zero for all other characters */
+static const uint8_t hex_vals[256] = {
+  HEX_ENTRY('0', 0),   HEX_ENTRY('1', 1),   HEX_ENTRY('2', 2),
+  HEX_ENTRY('3', 3),   HEX_ENTRY('4', 4),   HEX_ENTRY('5', 5),
+  HEX_ENTRY('6', 6),   HEX_ENTRY('7', 7),   HEX_ENTRY('8', 8),
+  HEX_ENTRY('9', 9),   HEX_ENTRY('a', 0xa), HEX_ENTRY('b', 0xb),
+  HEX_ENTRY('c', 0xc), HEX_ENTRY('d', 0xd), HEX_ENTRY('e', 0xe),
+  HEX_ENTRY('f', 0xf), HEX_ENTRY('A', 0xa), HEX_ENTRY('B', 0xb),
+  HEX_ENTRY('C', 0xc), HEX_ENTRY('D', 0xd), HEX_ENTRY('E', 0xe),
+  HEX_ENTRY('F', 0xf),
+};
+
+/* Parse a dotted quad into 4 bytes in network order. As with inet_pton,
+ * exactly four decimal octets are required and leading zeros are rejected. */
+static int parse_v4(const char *p, const char *end, uint8_t *out)
+{
+  unsigned octet, d;
+  int i, digits;
+
+  for (i = 0; i < 4; i++) {
+    if (i > 0) {
+      if (p == end || *p != '.') {
+        return -1;
+      }
+      p++;
+    }
+    octet = 0;
+    for (digits = 0; p < end && (d = (unsigned)(*p - '0')) <= 9; digits++) {
+      octet = octet * 10 + d;
+      p++;
+    }
+    if (digits == 0 || digits > 3 || octet > 255 ||
+        (digits > 1 && p[-digits] == '0')) {
+      return -1;
+    }
+    out[i] = (uint8_t)octet;
+  }
+
+  return (p == end) ? 0 : -1;
+}
+
+/* Parse an IPv6 address into 16 bytes in network order (RFC 4291 text
+ * form, same rules as inet_pton) */
+static int parse_v6(const char *p, const char *end, uint8_t *out)
+{
+  uint8_t *tp = out;
+  uint8_t *endp = out + 16;
+  uint8_t *colonp = NULL;
+  const char *curtok;
+  unsigned val = 0;
+  unsigned d;
+  int digits = 0;
+  size_t n;
+  char ch;
+
+  /* a leading "::" needs both colons */
+  if (p < end && *p == ':') {
+    if (++p == end || *p != ':') {
+      return -1;
+    }
+  }
+
+  curtok = p;
+  while (p < end) {
+    ch = *p++;
+    if ((d = hex_vals[(uint8_t)ch]) != 0) {
+      if (++digits > 4) {
+        return -1;
+      }
+      val = (val << 4) | (d - 1);
+      continue;
+    }
+    if (ch == ':') {
+      curtok = p;
+      if (digits == 0) {
+        /* second colon of a "::" */
+        if (colonp != NULL) {
+          return -1;
+        }
+        colonp = tp;
+        continue;
+      }
+      if (p == end || tp + 2 > endp) {
+        return -1;
+      }
+      *tp++ = (uint8_t)(val >> 8);
+      *tp++ = (uint8_t)val;
+      digits = 0;
+      val = 0;
+      continue;
+    }
+    if (ch == '.' && tp + 4 <= endp) {
+      /* embedded dotted quad in the last 32 bits */
+      if (parse_v4(curtok, end, tp) != 0) {
+        return -1;
+      }
+      tp += 4;
+      digits = 0;
+      break;
+    }
+    return -1;
+  }
+
+  if (digits != 0) {
+    if (tp + 2 > endp) {
+      return -1;
+    }
+    *tp++ = (uint8_t)(val >> 8);
+    *tp++ = (uint8_t)val;
+  }
+
+  if (colonp != NULL) {
+    /* "::" must stand for at least one group of zeros */
+    if (tp == endp) {
+      return -1;
+    }
+    n = tp - colonp;
+    memmove(endp - n, colonp, n);
+    memset(colonp, 0, endp - n - colonp);
+    tp = endp;
+  }
+
+  return (tp == endp) ? 0 : -1;
+}
+
+int ipmeta_pton_pfx(const char *str, size_t len, ipvx_prefix_t *pfx)
+{
+  const char *end = str + len;
+  const char *slash;
+  unsigned masklen = 0;
+  unsigned d;
+  int max_len;
+
+  if ((slash = memchr(str, '/', len)) == NULL) {
+    slash = end;
+  }
+
+  if (memchr(str, ':', slash - str) != NULL) {
+    pfx->family = AF_INET6;
+    if (parse_v6(str, slash, pfx->addr.v6.s6_addr) != 0) {
+      return -1;
+    }
+  } else {
+    pfx->family = AF_INET;
+    if (parse_v4(str, slash, (uint8_t *)&pfx->addr.v4.s_addr) != 0) {
+      return -1;
+    }
+  }
+  max_len = ipvx_family_size(pfx->family);
+
+  if (slash == end) {
+    pfx->masklen = max_len;
+    return 0;
+  }
+
+  /* 1 to 3 decimal digits, no larger than the address size */
+  if (end - slash < 2 || end - slash > 4) {
+    return -1;
+  }
+  for (str = slash + 1; str < end; str++) {
+    if ((d = (unsigned)(*str - '0')) > 9) {
+      return -1;
+    }
+    masklen = masklen * 10 + d;
+  }
+  if (masklen > (unsigned)max_len) {
+    return -1;
+  }
+  pfx->masklen = masklen;
+  return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_PTON_H
+#define __IPMETA_PTON_H
+
+#include <stddef.h>
+
+#include "ipvx_utils.h"
+
+/** @file
+ *
+ * @brief Header file that exposes the internal address parser used by the
+ * lookup functions
+ *
+ * Unlike ipvx_pton_pfx, the string does not need to be nul-terminated (so a
+ * line can be parsed in place inside a larger buffer) and the common dotted
+ * quad and hex group forms are parsed directly rather than being copied and
+ * handed to inet_pton.
+ *
+ * @author Alistair King
+ *
+ */
+
+/** Parse an IPv4 or IPv6 address or prefix
+ *
+ * @param str           pointer to the address or prefix (e.g. "192.0.2.1",
+ *                      "192.0.2.0/24" or "2001:db8::/32")
+ * @param len           number of characters in str
+ * @param[out] pfx      set to the parsed prefix; a plain address is given
+ *                      the full mask length of its family
+ * @return 0 if the whole string is a valid address or prefix, -1 otherwise
+ *
+ * The accepted address syntax is the same as that of inet_pton (including
+ * IPv6 addresses with an embedded dotted quad).
+ */
+int ipmeta_pton_pfx(const char *str, size_t len, ipvx_prefix_t *pfx);
+
+#endif /* __IPMETA_PTON_H */
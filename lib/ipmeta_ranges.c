@@ -0,0 +1,254 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ranges.h"
+
+/** State used while the prefixes of a provider are flattened */
+typedef struct ranges_builder {
+  ipmeta_ranges_t *ranges;
+
+  /** Prefixes that contain the current position, innermost last */
+  struct {
+    ipmeta_addr128_t end;
+    ipmeta_record_t *record;
+  } stack[129];
+  int depth;
+
+} ranges_builder_t;
+
+static int addr_is_max(int family, const ipmeta_addr128_t *a)
+{
+  if (family == AF_INET) {
+    return a->lo == UINT32_MAX;
+  }
+  return a->hi == UINT64_MAX && a->lo == UINT64_MAX;
+}
+
+/* Get the first and last address of a prefix */
+static void prefix_range(int family, const void *addrp, uint8_t pfxlen,
+                         ipmeta_addr128_t *first, ipmeta_addr128_t *last)
+{
+  int host_bits = ((family == AF_INET) ? 32 : 128) - pfxlen;
+  uint64_t hi_host = 0, lo_host;
+
+  ipmeta_addr128_from_bytes(family, addrp, first);
+
+  if (host_bits >= 64) {
+    lo_host = UINT64_MAX;
+    hi_host = (host_bits == 64) ? 0 : (UINT64_MAX >> (128 - host_bits));
+  } else {
+    lo_host = (host_bits == 0) ? 0 : (UINT64_MAX >> (64 - host_bits));
+  }
+  first->hi &= ~hi_host;
+  first->lo &= ~lo_host;
+  last->hi = first->hi | hi_host;
+  last->lo = first->lo | lo_host;
+}
+
+/* Start a new range with the given record at start (which is never before the
+   start of the last range), merging it with its neighbours where possible */
+static int add_range(ipmeta_ranges_t *r, ipmeta_addr128_t start,
+                     ipmeta_record_t *record)
+{
+  ipmeta_addr128_t *tmp_starts;
+  ipmeta_record_t **tmp_records;
+  uint64_t new_alloc;
+
+  if (r->cnt > 0 && ipmeta_addr128_cmp(&r->starts[r->cnt - 1], &start) == 0) {
+    /* the last range turned out to be empty */
+    r->cnt--;
+  }
+  if (r->cnt > 0 && r->records[r->cnt - 1] == record) {
+    return 0;
+  }
+
+  if (r->cnt == r->alloc) {
+    new_alloc = r->alloc ? r->alloc * 2 : 1024;
+    if ((tmp_starts = realloc(r->starts, sizeof(ipmeta_addr128_t) *
+                                           new_alloc)) == NULL) {
+      return -1;
+    }
+    r->starts = tmp_starts;
+    if ((tmp_records = realloc(r->records, sizeof(ipmeta_record_t *) *
+                                             new_alloc)) == NULL) {
+      return -1;
+    }
+    r->records = tmp_records;
+    r->alloc = new_alloc;
+  }
+  r->starts[r->cnt] = start;
+  r->records[r->cnt] = record;
+  r->cnt++;
+  return 0;
+}
+
+/* Close the innermost prefix that contains the current position */
+static int pop_prefix(ranges_builder_t *b)
+{
+  ipmeta_addr128_t end = b->stack[--b->depth].end;
+
+  if (addr_is_max(b->ranges->family, &end)) {
+    return 0;
+  }
+  /* the enclosing prefix (or nothing) continues after the end */
+  return add_range(b->ranges, ipmeta_addr128_inc(end),
+                   (b->depth > 0) ? b->stack[b->depth - 1].record : NULL);
+}
+
+static int build_cb(int family, void *addrp, uint8_t pfxlen,
+                    ipmeta_record_t *record, void *user)
+{
+  ranges_builder_t *b = (ranges_builder_t *)user;
+  ipmeta_addr128_t first, last;
+
+  prefix_range(family, addrp, pfxlen, &first, &last);
+
+  /* prefixes arrive in address order, so any prefix that ends before this
+     one starts is finished */
+  while (b->depth > 0 &&
+         ipmeta_addr128_cmp(&b->stack[b->depth - 1].end, &first) < 0) {
+    if (pop_prefix(b) != 0) {
+      return -1;
+    }
+  }
+
+  if (add_range(b->ranges, first, record) != 0) {
+    return -1;
+  }
+
+  if (b->depth > 0 &&
+      ipmeta_addr128_cmp(&b->stack[b->depth - 1].end, &last) == 0) {
+    /* the enclosing prefix ends at the same address, so it never resumes */
+    b->stack[b->depth - 1].record = record;
+  } else {
+    assert(b->depth < (int)ARR_CNT(b->stack));
+    b->stack[b->depth].end = last;
+    b->stack[b->depth].record = record;
+    b->depth++;
+  }
+  return 0;
+}
+
+int ipmeta_ranges_build(ipmeta_ds_t *ds, int family, int provider_id,
+                        ipmeta_ranges_t *ranges)
+{
+  ranges_builder_t *b;
+  ipmeta_addr128_t zero = {0, 0};
+  int rc = -1;
+
+  memset(ranges, 0, sizeof(ipmeta_ranges_t));
+  ranges->family = family;
+
+  if ((b = malloc_zero(sizeof(ranges_builder_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc range builder");
+    return -1;
+  }
+  b->ranges = ranges;
+
+  if (add_range(ranges, zero, NULL) != 0 ||
+      ds->iterate(ds, family, IPMETA_PROV_TO_MASK(provider_id), build_cb, b) !=
+        0) {
+    goto done;
+  }
+  while (b->depth > 0) {
+    if (pop_prefix(b) != 0) {
+      goto done;
+    }
+  }
+  rc = 0;
+
+done:
+  free(b);
+  if (rc != 0) {
+    ipmeta_log(__func__, "could not flatten prefixes");
+    ipmeta_ranges_clear(ranges);
+  }
+  return rc;
+}
+
+void ipmeta_ranges_clear(ipmeta_ranges_t *ranges)
+{
+  free(ranges->starts);
+  free(ranges->records);
+  ranges->starts = NULL;
+  ranges->records = NULL;
+  ranges->cnt = ranges->alloc = 0;
+}
+
+void ipmeta_addr128_from_bytes(int family, const void *addrp,
+                               ipmeta_addr128_t *addr)
+{
+  const uint8_t *p = (const uint8_t *)addrp;
+  int i;
+
+  addr->hi = addr->lo = 0;
+  if (family == AF_INET) {
+    for (i = 0; i < 4; i++) {
+      addr->lo = (addr->lo << 8) | p[i];
+    }
+    return;
+  }
+  for (i = 0; i < 8; i++) {
+    addr->hi = (addr->hi << 8) | p[i];
+    addr->lo = (addr->lo << 8) | p[i + 8];
+  }
+}
+
+void ipmeta_addr128_to_bytes(int family, const ipmeta_addr128_t *addr,
+                             void *addrp)
+{
+  uint8_t *p = (uint8_t *)addrp;
+  int i;
+
+  if (family == AF_INET) {
+    for (i = 0; i < 4; i++) {
+      p[i] = (uint8_t)(addr->lo >> (24 - 8 * i));
+    }
+    return;
+  }
+  for (i = 0; i < 8; i++) {
+    p[i] = (uint8_t)(addr->hi >> (56 - 8 * i));
+    p[i + 8] = (uint8_t)(addr->lo >> (56 - 8 * i));
+  }
+}
@@ -0,0 +1,178 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_RANGES_H
+#define __IPMETA_RANGES_H
+
+#include <stdint.h>
+
+#include "libipmeta.h"
+#include "ipmeta_ds.h"
+
+/** @file
+ *
+ * @brief Header file that exposes the internal flattening of a provider's
+ * prefixes into address ranges
+ *
+ * The prefixes of a provider may be nested, in which case an address belongs
+ * to the record of the most specific prefix containing it. Flattening turns
+ * the prefixes into a sorted list of disjoint ranges that cover the whole
+ * address space, each with the record (or NULL) that addresses in the range
+ * map to. Adjacent ranges always have different records.
+ *
+ * @author Alistair King
+ *
+ */
+
+/** An address in host byte order (IPv4 addresses only use the low 32 bits) */
+typedef struct ipmeta_addr128 {
+  uint64_t hi;
+  uint64_t lo;
+} ipmeta_addr128_t;
+
+/** The flattened prefixes of one provider and address family */
+typedef struct ipmeta_ranges {
+  /** The address family */
+  int family;
+
+  /** First address of each range (the first one is always 0). Each range ends
+      just before the next one starts, and the last one at the end of the
+      address space. */
+  ipmeta_addr128_t *starts;
+
+  /** Record of each range (NULL if no prefix contains the range) */
+  ipmeta_record_t **records;
+
+  /** Number of ranges */
+  uint64_t cnt;
+
+  /** Number of ranges that have been allocated */
+  uint64_t alloc;
+
+} ipmeta_ranges_t;
+
+/** Flatten the prefixes of a provider
+ *
+ * @param ds            The datastructure holding the prefixes
+ * @param family        The address family to flatten (AF_INET or AF_INET6)
+ * @param provider_id   The id of the provider to flatten
+ * @param[out] ranges   Set to the ranges of the provider. Must be free'd
+ *                      using ipmeta_ranges_clear.
+ * @return 0 if successful, -1 otherwise
+ */
+int ipmeta_ranges_build(ipmeta_ds_t *ds, int family, int provider_id,
+                        ipmeta_ranges_t *ranges);
+
+/** Free the arrays of a set of ranges
+ *
+ * @param ranges        The ranges to clear
+ */
+void ipmeta_ranges_clear(ipmeta_ranges_t *ranges);
+
+/** Compare two addresses
+ *
+ * @return -1, 0 or 1 if a is less than, equal to or greater than b
+ */
+static inline int ipmeta_addr128_cmp(const ipmeta_addr128_t *a,
+                                     const ipmeta_addr128_t *b)
+{
+  if (a->hi != b->hi) {
+    return (a->hi < b->hi) ? -1 : 1;
+  }
+  if (a->lo != b->lo) {
+    return (a->lo < b->lo) ? -1 : 1;
+  }
+  return 0;
+}
+
+/** Get the address that follows an address */
+static inline ipmeta_addr128_t ipmeta_addr128_inc(ipmeta_addr128_t a)
+{
+  if (++a.lo == 0) {
+    a.hi++;
+  }
+  return a;
+}
+
+/** Get the address that precedes an address */
+static inline ipmeta_addr128_t ipmeta_addr128_dec(ipmeta_addr128_t a)
+{
+  if (a.lo-- == 0) {
+    a.hi--;
+  }
+  return a;
+}
+
+/** Get the last address of an address family */
+static inline ipmeta_addr128_t ipmeta_addr128_max(int family)
+{
+  ipmeta_addr128_t a;
+
+  a.hi = (family == AF_INET) ? 0 : UINT64_MAX;
+  a.lo = (family == AF_INET) ? UINT32_MAX : UINT64_MAX;
+  return a;
+}
+
+/** Get the size of a range of addresses
+ *
+ * @return the number of addresses in the range for IPv4, or the number of /64
+ * subnets that start in the range for IPv6 (saturating at UINT64_MAX)
+ */
+static inline uint64_t ipmeta_addr128_range_size(int family,
+                                                 const ipmeta_addr128_t *first,
+                                                 const ipmeta_addr128_t *last)
+{
+  uint64_t n;
+
+  if (family == AF_INET) {
+    return last->lo - first->lo + 1;
+  }
+
+  n = last->hi - first->hi;
+  if (first->lo == 0) {
+    /* (the whole address space has one too many to count) */
+    n = (n == UINT64_MAX) ? UINT64_MAX : n + 1;
+  }
+  return n;
+}
+
+/** Convert a struct in_addr or in6_addr to an address */
+void ipmeta_addr128_from_bytes(int family, const void *addrp,
+                               ipmeta_addr128_t *addr);
+
+/** Convert an address to a struct in_addr or in6_addr */
+void ipmeta_addr128_to_bytes(int family, const ipmeta_addr128_t *addr,
+                             void *addrp);
+
+#endif /* __IPMETA_RANGES_H */
@@ -0,0 +1,494 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds.h"
+#include "ipmeta_provider.h"
+#include "ipmeta_ranges.h"
+#include "ipmeta_revidx.h"
+
+/** The ranges that one provider maps to each key (a country or a record) */
+typedef struct range_index {
+  /** Number of keys */
+  uint32_t keys_cnt;
+
+  /** Index of the first range of each key (the ranges of key k end where
+      those of k + 1 start) */
+  uint32_t *offsets;
+
+  /** Ranges of all keys */
+  ipmeta_addr_range_t *ranges;
+
+} range_index_t;
+
+struct ipmeta_revidx {
+  /** Sorted ASNs that the pfx2as provider has prefixes for */
+  uint32_t *asns;
+
+  /** Number of ASNs */
+  uint32_t asns_cnt;
+
+  /** Index of the first prefix of each ASN (asns_cnt + 1 entries) */
+  uint32_t *asn_offsets;
+
+  /** Prefixes of all ASNs */
+  ipmeta_prefix_t *asn_prefixes;
+
+  /** Country index of each provider, keyed by country id (NULL if the
+      provider is not enabled) */
+  range_index_t *countries[IPMETA_PROVIDER_MAX];
+
+  /** Record index of each provider, keyed by the index of the record in the
+      provider's records array (NULL if the provider is not enabled) */
+  range_index_t *records[IPMETA_PROVIDER_MAX];
+};
+
+/** A prefix of an ASN, collected while the ASN index is built */
+typedef struct asn_prefix {
+  uint32_t asn;
+  ipmeta_prefix_t pfx;
+} asn_prefix_t;
+
+/** Prefixes collected while the ASN index is built */
+typedef struct asn_builder {
+  asn_prefix_t *entries;
+  uint64_t cnt;
+  uint64_t alloc;
+} asn_builder_t;
+
+/** The keys that a range index can be built for */
+typedef enum range_key {
+  RANGE_KEY_COUNTRY,
+  RANGE_KEY_RECORD,
+} range_key_t;
+
+/** A range of a key, collected while a range index is built */
+typedef struct keyed_range {
+  uint32_t key;
+  int family;
+  ipmeta_addr128_t first;
+  ipmeta_addr128_t last;
+} keyed_range_t;
+
+static int asn_prefix_cmp(const void *a, const void *b)
+{
+  const asn_prefix_t *pa = (const asn_prefix_t *)a;
+  const asn_prefix_t *pb = (const asn_prefix_t *)b;
+  int rc;
+
+  if (pa->asn != pb->asn) {
+    return (pa->asn < pb->asn) ? -1 : 1;
+  }
+  /* AF_INET sorts before AF_INET6 */
+  if (pa->pfx.family != pb->pfx.family) {
+    return (pa->pfx.family < pb->pfx.family) ? -1 : 1;
+  }
+  if ((rc = memcmp(pa->pfx.addr, pb->pfx.addr, sizeof(pa->pfx.addr))) != 0) {
+    return rc;
+  }
+  return (int)pa->pfx.pfxlen - (int)pb->pfx.pfxlen;
+}
+
+static int collect_asn_prefix(int family, void *addrp, uint8_t pfxlen,
+                              ipmeta_record_t *record, void *user)
+{
+  asn_builder_t *b = (asn_builder_t *)user;
+  asn_prefix_t *tmp;
+  uint64_t new_alloc;
+  int i;
+
+  for (i = 0; i < record->asn_cnt; i++) {
+    if (b->cnt == b->alloc) {
+      new_alloc = b->alloc ? b->alloc * 2 : 1024;
+      if ((tmp = realloc(b->entries, sizeof(asn_prefix_t) * new_alloc)) ==
+          NULL) {
+        return -1;
+      }
+      b->entries = tmp;
+      b->alloc = new_alloc;
+    }
+    memset(&b->entries[b->cnt], 0, sizeof(asn_prefix_t));
+    b->entries[b->cnt].asn = record->asn[i];
+    memcpy(b->entries[b->cnt].pfx.addr, addrp,
+           (family == AF_INET) ? sizeof(struct in_addr)
+                               : sizeof(struct in6_addr));
+    b->entries[b->cnt].pfx.family = family;
+    b->entries[b->cnt].pfx.pfxlen = pfxlen;
+    b->cnt++;
+  }
+  return 0;
+}
+
+static int build_asn_index(ipmeta_t *ipmeta, ipmeta_revidx_t *revidx)
+{
+  asn_builder_t b = {NULL, 0, 0};
+  uint64_t i;
+  uint32_t n;
+  int rc = -1;
+
+  if ((ipmeta->all_provmask & IPMETA_PROV_TO_MASK(IPMETA_PROVIDER_PFX2AS)) !=
+        0 &&
+      (ipmeta->datastore->iterate(ipmeta->datastore, AF_INET,
+                                  IPMETA_PROV_TO_MASK(IPMETA_PROVIDER_PFX2AS),
+                                  collect_asn_prefix, &b) != 0 ||
+       ipmeta->datastore->iterate(ipmeta->datastore, AF_INET6,
+                                  IPMETA_PROV_TO_MASK(IPMETA_PROVIDER_PFX2AS),
+                                  collect_asn_prefix, &b) != 0)) {
+    goto done;
+  }
+  if (b.cnt > UINT32_MAX) {
+    goto done;
+  }
+  qsort(b.entries, b.cnt, sizeof(asn_prefix_t), asn_prefix_cmp);
+
+  for (i = 0, n = 0; i < b.cnt; i++) {
+    n += (i == 0 || b.entries[i].asn != b.entries[i - 1].asn);
+  }
+  revidx->asns_cnt = n;
+  if ((revidx->asns = malloc(sizeof(uint32_t) * (n + 1))) == NULL ||
+      (revidx->asn_offsets = malloc(sizeof(uint32_t) * (n + 1))) == NULL ||
+      (revidx->asn_prefixes = malloc(sizeof(ipmeta_prefix_t) *
+                                     (b.cnt + 1))) == NULL) {
+    goto done;
+  }
+
+  for (i = 0, n = 0; i < b.cnt; i++) {
+    if (i == 0 || b.entries[i].asn != b.entries[i - 1].asn) {
+      revidx->asns[n] = b.entries[i].asn;
+      revidx->asn_offsets[n++] = (uint32_t)i;
+    }
+    revidx->asn_prefixes[i] = b.entries[i].pfx;
+  }
+  revidx->asn_offsets[n] = (uint32_t)b.cnt;
+  rc = 0;
+
+done:
+  free(b.entries);
+  return rc;
+}
+
+/* Collect the ranges of one family that a provider maps to each key, merging
+   adjacent ranges of the same key */
+static int collect_ranges(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
+                          int family, range_key_t key_type,
+                          keyed_range_t **entries, uint64_t *cnt,
+                          uint64_t *alloc)
+{
+  ipmeta_ranges_t ranges;
+  keyed_range_t *prev, *tmp;
+  ipmeta_addr128_t last, next;
+  uint32_t key;
+  uint64_t i;
+
+  if (ipmeta_ranges_build(ipmeta->datastore, family, provider->id, &ranges) !=
+      0) {
+    return -1;
+  }
+
+  for (i = 0; i < ranges.cnt; i++) {
+    if (ranges.records[i] == NULL) {
+      continue;
+    }
+    if (key_type == RANGE_KEY_COUNTRY) {
+      /* ranges of an unknown country are not indexed */
+      if ((key = ranges.records[i]->country_id) == 0) {
+        continue;
+      }
+    } else {
+      key = ipmeta_record_get_hot(ranges.records[i])->cold_idx;
+    }
+    last = (i + 1 < ranges.cnt) ? ipmeta_addr128_dec(ranges.starts[i + 1])
+                                : ipmeta_addr128_max(family);
+
+    /* ranges of the same key that touch are merged */
+    if (*cnt > 0) {
+      prev = &(*entries)[*cnt - 1];
+      next = ipmeta_addr128_inc(prev->last);
+      if (prev->family == family && prev->key == key &&
+          ipmeta_addr128_cmp(&next, &ranges.starts[i]) == 0) {
+        prev->last = last;
+        continue;
+      }
+    }
+
+    if (*cnt == *alloc) {
+      *alloc = *alloc ? *alloc * 2 : 1024;
+      if ((tmp = realloc(*entries, sizeof(keyed_range_t) * *alloc)) == NULL) {
+        ipmeta_ranges_clear(&ranges);
+        return -1;
+      }
+      *entries = tmp;
+    }
+    (*entries)[*cnt].key = key;
+    (*entries)[*cnt].family = family;
+    (*entries)[*cnt].first = ranges.starts[i];
+    (*entries)[*cnt].last = last;
+    (*cnt)++;
+  }
+
+  ipmeta_ranges_clear(&ranges);
+  return 0;
+}
+
+static void range_index_free(range_index_t *idx)
+{
+  if (idx == NULL) {
+    return;
+  }
+  free(idx->offsets);
+  free(idx->ranges);
+  free(idx);
+}
+
+static range_index_t *build_range_index(ipmeta_t *ipmeta,
+                                        ipmeta_provider_t *provider,
+                                        range_key_t key_type)
+{
+  range_index_t *idx = NULL;
+  keyed_range_t *entries = NULL;
+  uint64_t cnt = 0, alloc = 0, i;
+  uint32_t *pos = NULL;
+  ipmeta_addr_range_t *range;
+  uint32_t k;
+
+  if (collect_ranges(ipmeta, provider, AF_INET, key_type, &entries, &cnt,
+                     &alloc) != 0 ||
+      collect_ranges(ipmeta, provider, AF_INET6, key_type, &entries, &cnt,
+                     &alloc) != 0 ||
+      cnt > UINT32_MAX ||
+      (idx = malloc_zero(sizeof(range_index_t))) == NULL) {
+    goto err;
+  }
+  idx->keys_cnt = (key_type == RANGE_KEY_COUNTRY) ? IPMETA_COUNTRY_ID_CNT
+                                                  : provider->records_cnt;
+  if ((idx->offsets = malloc_zero(sizeof(uint32_t) *
+                                  ((size_t)idx->keys_cnt + 1))) == NULL ||
+      (pos = malloc(sizeof(uint32_t) * ((size_t)idx->keys_cnt + 1))) ==
+        NULL ||
+      (idx->ranges = malloc(sizeof(ipmeta_addr_range_t) * (cnt + 1))) ==
+        NULL) {
+    goto err;
+  }
+
+  /* counting sort by key (the ranges of each key stay in address order) */
+  for (i = 0; i < cnt; i++) {
+    idx->offsets[entries[i].key + 1]++;
+  }
+  for (k = 0; k < idx->keys_cnt; k++) {
+    idx->offsets[k + 1] += idx->offsets[k];
+    pos[k] = idx->offsets[k];
+  }
+  for (i = 0; i < cnt; i++) {
+    range = &idx->ranges[pos[entries[i].key]++];
+    memset(range, 0, sizeof(ipmeta_addr_range_t));
+    ipmeta_addr128_to_bytes(entries[i].family, &entries[i].first,
+                            range->first);
+    ipmeta_addr128_to_bytes(entries[i].family, &entries[i].last, range->last);
+    range->family = entries[i].family;
+  }
+
+  free(pos);
+  free(entries);
+  return idx;
+
+err:
+  free(pos);
+  free(entries);
+  range_index_free(idx);
+  return NULL;
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+void ipmeta_revidx_free(ipmeta_revidx_t *revidx)
+{
+  int i;
+
+  if (revidx == NULL) {
+    return;
+  }
+  free(revidx->asns);
+  free(revidx->asn_offsets);
+  free(revidx->asn_prefixes);
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    range_index_free(revidx->countries[i]);
+    range_index_free(revidx->records[i]);
+  }
+  free(revidx);
+}
+
+int ipmeta_build_reverse_indexes(ipmeta_t *ipmeta)
+{
+  ipmeta_revidx_t *revidx;
+  int i;
+
+  assert(ipmeta != NULL);
+
+  ipmeta_revidx_free(ipmeta->revidx);
+  ipmeta->revidx = NULL;
+
+  if ((revidx = malloc_zero(sizeof(ipmeta_revidx_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc reverse indexes");
+    return -1;
+  }
+
+  if (build_asn_index(ipmeta, revidx) != 0) {
+    ipmeta_log(__func__, "could not build ASN index");
+    goto err;
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (ipmeta_is_provider_enabled(ipmeta->providers[i]) == 0) {
+      continue;
+    }
+    if ((revidx->countries[i] = build_range_index(
+           ipmeta, ipmeta->providers[i], RANGE_KEY_COUNTRY)) == NULL) {
+      ipmeta_log(__func__, "could not build country index of %s",
+                 ipmeta->providers[i]->name);
+      goto err;
+    }
+    if ((revidx->records[i] = build_range_index(
+           ipmeta, ipmeta->providers[i], RANGE_KEY_RECORD)) == NULL) {
+      ipmeta_log(__func__, "could not build record index of %s",
+                 ipmeta->providers[i]->name);
+      goto err;
+    }
+  }
+
+  ipmeta->revidx = revidx;
+  return 0;
+
+err:
+  ipmeta_revidx_free(revidx);
+  return -1;
+}
+
+int ipmeta_prefixes_by_asn(ipmeta_t *ipmeta, uint32_t asn,
+                           const ipmeta_prefix_t **prefixes)
+{
+  ipmeta_revidx_t *revidx = ipmeta->revidx;
+  uint32_t lo = 0, hi, mid;
+
+  if (revidx == NULL) {
+    ipmeta_log(__func__, "reverse indexes have not been built");
+    return -1;
+  }
+
+  *prefixes = NULL;
+  hi = revidx->asns_cnt;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (revidx->asns[mid] < asn) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == revidx->asns_cnt || revidx->asns[lo] != asn) {
+    return 0;
+  }
+
+  *prefixes = &revidx->asn_prefixes[revidx->asn_offsets[lo]];
+  return (int)(revidx->asn_offsets[lo + 1] - revidx->asn_offsets[lo]);
+}
+
+int ipmeta_prefixes_by_country(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
+                               const char *country_code,
+                               const ipmeta_addr_range_t **ranges)
+{
+  ipmeta_revidx_t *revidx = ipmeta->revidx;
+  range_index_t *idx;
+  uint16_t country_id;
+
+  assert(provider != NULL);
+
+  if (revidx == NULL) {
+    ipmeta_log(__func__, "reverse indexes have not been built");
+    return -1;
+  }
+
+  *ranges = NULL;
+  if ((idx = revidx->countries[provider->id - 1]) == NULL ||
+      (country_id = ipmeta_country_id(country_code)) == 0) {
+    return 0;
+  }
+
+  *ranges = &idx->ranges[idx->offsets[country_id]];
+  return (int)(idx->offsets[country_id + 1] - idx->offsets[country_id]);
+}
+
+int ipmeta_prefixes_by_record(ipmeta_t *ipmeta, ipmeta_record_t *record,
+                              const ipmeta_addr_range_t **ranges)
+{
+  ipmeta_revidx_t *revidx = ipmeta->revidx;
+  ipmeta_provider_t *provider;
+  const ipmeta_record_hot_t *hot;
+  range_index_t *idx;
+  uint32_t k;
+
+  assert(record != NULL);
+
+  if (revidx == NULL) {
+    ipmeta_log(__func__, "reverse indexes have not been built");
+    return -1;
+  }
+
+  *ranges = NULL;
+  if (record->source < 1 || record->source > IPMETA_PROVIDER_MAX ||
+      (idx = revidx->records[record->source - 1]) == NULL ||
+      (hot = ipmeta_record_get_hot(record)) == NULL) {
+    return 0;
+  }
+
+  /* the record must be one of this instance's (a copy kept by a history has
+     an index of its own) */
+  provider = ipmeta->providers[record->source - 1];
+  k = hot->cold_idx;
+  if (k >= provider->records_cnt || provider->records[k] != record ||
+      k >= idx->keys_cnt) {
+    return 0;
+  }
+
+  *ranges = &idx->ranges[idx->offsets[k]];
+  return (int)(idx->offsets[k + 1] - idx->offsets[k]);
+}
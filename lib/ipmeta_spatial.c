@@ -0,0 +1,479 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_provider.h"
+#include "ipmeta_spatial.h"
+
+/** Mean radius of the Earth, in km */
+#define EARTH_RADIUS_KM 6371.0088
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** The location of a record, as a point on the unit sphere */
+typedef struct spatial_point {
+  double xyz[3];
+  ipmeta_record_t *record;
+} spatial_point_t;
+
+struct ipmeta_spatial {
+  /** Points of all located records, arranged as an implicit k-d tree: the
+      root of the subtree holding points [lo, hi) is the point at
+      lo + (hi - lo) / 2, which splits them on axis (depth % 3) */
+  spatial_point_t *points;
+
+  /** Number of points */
+  uint32_t cnt;
+};
+
+/** A record found by a query */
+typedef struct spatial_match {
+  /** Squared straight-line distance on the unit sphere */
+  double dist2;
+  ipmeta_record_t *record;
+} spatial_match_t;
+
+/** State of a nearest-records query */
+typedef struct nearest_query {
+  double xyz[3];
+
+  /** Max-heap of the best matches so far (farthest first) */
+  spatial_match_t *heap;
+  int cnt;
+  int k;
+} nearest_query_t;
+
+/** State of a radius query */
+typedef struct within_query {
+  double xyz[3];
+  double max_dist2;
+  spatial_match_t *matches;
+  uint64_t cnt;
+  uint64_t alloc;
+} within_query_t;
+
+static void to_xyz(double latitude, double longitude, double *xyz)
+{
+  double lat = latitude * M_PI / 180.0;
+  double lon = longitude * M_PI / 180.0;
+
+  xyz[0] = cos(lat) * cos(lon);
+  xyz[1] = cos(lat) * sin(lon);
+  xyz[2] = sin(lat);
+}
+
+static double dist2(const double *a, const double *b)
+{
+  double dx = a[0] - b[0];
+  double dy = a[1] - b[1];
+  double dz = a[2] - b[2];
+
+  return dx * dx + dy * dy + dz * dz;
+}
+
+/* Convert a squared straight-line distance on the unit sphere to a
+   great-circle distance in km */
+static double dist2_to_km(double d2)
+{
+  double half_chord = sqrt(d2) / 2;
+
+  return 2 * asin(half_chord > 1 ? 1 : half_chord) * EARTH_RADIUS_KM;
+}
+
+static int match_cmp(const void *a, const void *b)
+{
+  const spatial_match_t *ma = (const spatial_match_t *)a;
+  const spatial_match_t *mb = (const spatial_match_t *)b;
+
+  if (ma->dist2 != mb->dist2) {
+    return (ma->dist2 < mb->dist2) ? -1 : 1;
+  }
+  /* break ties by id so that results do not depend on the tree layout */
+  if (ma->record->id != mb->record->id) {
+    return (ma->record->id < mb->record->id) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Move the point that belongs at index k (by the given axis) there, with
+   smaller points before it and larger ones after it (Wirth's selection) */
+static void select_point(spatial_point_t *points, int64_t lo, int64_t hi,
+                         int64_t k, int axis)
+{
+  spatial_point_t tmp;
+  int64_t i, j;
+  double x;
+
+  while (lo < hi) {
+    x = points[k].xyz[axis];
+    i = lo;
+    j = hi;
+    do {
+      while (points[i].xyz[axis] < x) {
+        i++;
+      }
+      while (x < points[j].xyz[axis]) {
+        j--;
+      }
+      if (i <= j) {
+        tmp = points[i];
+        points[i] = points[j];
+        points[j] = tmp;
+        i++;
+        j--;
+      }
+    } while (i <= j);
+    if (j < k) {
+      lo = i;
+    }
+    if (k < i) {
+      hi = j;
+    }
+  }
+}
+
+/* Arrange points [lo, hi) as a k-d tree */
+static void build_tree(spatial_point_t *points, uint32_t lo, uint32_t hi,
+                       int depth)
+{
+  uint32_t mid;
+
+  if (hi - lo < 2) {
+    return;
+  }
+  mid = lo + (hi - lo) / 2;
+  select_point(points, lo, (int64_t)hi - 1, mid, depth % 3);
+  build_tree(points, lo, mid, depth + 1);
+  build_tree(points, mid + 1, hi, depth + 1);
+}
+
+static ipmeta_spatial_t *build_index(ipmeta_provider_t *provider)
+{
+  ipmeta_spatial_t *spatial;
+  ipmeta_record_t *rec;
+  uint32_t i;
+
+  if ((spatial = malloc_zero(sizeof(ipmeta_spatial_t))) == NULL ||
+      (spatial->points = malloc(sizeof(spatial_point_t) *
+                                ((size_t)provider->records_cnt + 1))) ==
+        NULL) {
+    ipmeta_log(__func__, "could not malloc spatial index");
+    ipmeta_spatial_free(spatial);
+    return NULL;
+  }
+
+  for (i = 0; i < provider->records_cnt; i++) {
+    rec = provider->records[i];
+    if ((rec->latitude == 0 && rec->longitude == 0) ||
+        !isfinite(rec->latitude) || !isfinite(rec->longitude)) {
+      continue;
+    }
+    to_xyz(rec->latitude, rec->longitude, spatial->points[spatial->cnt].xyz);
+    spatial->points[spatial->cnt].record = rec;
+    spatial->cnt++;
+  }
+
+  build_tree(spatial->points, 0, spatial->cnt, 0);
+  return spatial;
+}
+
+/* Get the spatial index of a provider, building it if needed */
+static ipmeta_spatial_t *get_index(ipmeta_provider_t *provider)
+{
+  if (ipmeta_is_provider_enabled(provider) == 0) {
+    ipmeta_log(__func__, "provider is not enabled");
+    return NULL;
+  }
+  if (provider->spatial == NULL) {
+    provider->spatial = build_index(provider);
+  }
+  return provider->spatial;
+}
+
+static void heap_sift_down(spatial_match_t *heap, int cnt, int i)
+{
+  spatial_match_t tmp;
+  int child;
+
+  while ((child = 2 * i + 1) < cnt) {
+    if (child + 1 < cnt && match_cmp(&heap[child + 1], &heap[child]) > 0) {
+      child++;
+    }
+    if (match_cmp(&heap[child], &heap[i]) <= 0) {
+      break;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+static void heap_push(spatial_match_t *heap, int cnt, spatial_match_t *m)
+{
+  spatial_match_t tmp;
+  int i = cnt;
+
+  heap[i] = *m;
+  while (i > 0 && match_cmp(&heap[(i - 1) / 2], &heap[i]) < 0) {
+    tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static void search_nearest(spatial_point_t *points, uint32_t lo, uint32_t hi,
+                           int depth, nearest_query_t *q)
+{
+  spatial_point_t *p;
+  spatial_match_t m;
+  uint32_t mid;
+  double diff;
+  int axis = depth % 3;
+
+  if (lo >= hi) {
+    return;
+  }
+  mid = lo + (hi - lo) / 2;
+  p = &points[mid];
+
+  m.dist2 = dist2(q->xyz, p->xyz);
+  m.record = p->record;
+  if (q->cnt < q->k) {
+    heap_push(q->heap, q->cnt++, &m);
+  } else if (match_cmp(&m, &q->heap[0]) < 0) {
+    q->heap[0] = m;
+    heap_sift_down(q->heap, q->cnt, 0);
+  }
+
+  /* search the side of the split that the point is on first */
+  diff = q->xyz[axis] - p->xyz[axis];
+  if (diff < 0) {
+    search_nearest(points, lo, mid, depth + 1, q);
+  } else {
+    search_nearest(points, mid + 1, hi, depth + 1, q);
+  }
+  /* and the other side only if it could hold a nearer record */
+  if (q->cnt < q->k || diff * diff <= q->heap[0].dist2) {
+    if (diff < 0) {
+      search_nearest(points, mid + 1, hi, depth + 1, q);
+    } else {
+      search_nearest(points, lo, mid, depth + 1, q);
+    }
+  }
+}
+
+static int search_within(spatial_point_t *points, uint32_t lo, uint32_t hi,
+                         int depth, within_query_t *q)
+{
+  spatial_point_t *p;
+  spatial_match_t *tmp;
+  uint32_t mid;
+  double d2, diff;
+  int axis = depth % 3;
+
+  if (lo >= hi) {
+    return 0;
+  }
+  mid = lo + (hi - lo) / 2;
+  p = &points[mid];
+
+  if ((d2 = dist2(q->xyz, p->xyz)) <= q->max_dist2) {
+    if (q->cnt == q->alloc) {
+      q->alloc = q->alloc ? q->alloc * 2 : 64;
+      if ((tmp = realloc(q->matches, sizeof(spatial_match_t) * q->alloc)) ==
+          NULL) {
+        return -1;
+      }
+      q->matches = tmp;
+    }
+    q->matches[q->cnt].dist2 = d2;
+    q->matches[q->cnt].record = p->record;
+    q->cnt++;
+  }
+
+  diff = q->xyz[axis] - p->xyz[axis];
+  if ((diff <= 0 || diff * diff <= q->max_dist2) &&
+      search_within(points, lo, mid, depth + 1, q) != 0) {
+    return -1;
+  }
+  if ((diff >= 0 || diff * diff <= q->max_dist2) &&
+      search_within(points, mid + 1, hi, depth + 1, q) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+void ipmeta_spatial_free(ipmeta_spatial_t *spatial)
+{
+  if (spatial == NULL) {
+    return;
+  }
+  free(spatial->points);
+  free(spatial);
+}
+
+int ipmeta_provider_find_nearest(ipmeta_provider_t *provider, double latitude,
+                                 double longitude, int k,
+                                 ipmeta_record_t **records, double *distances)
+{
+  ipmeta_spatial_t *spatial;
+  nearest_query_t q;
+  int i;
+
+  assert(provider != NULL);
+  assert(records != NULL);
+
+  if (!isfinite(latitude) || !isfinite(longitude)) {
+    ipmeta_log(__func__, "invalid location");
+    return -1;
+  }
+  if ((spatial = get_index(provider)) == NULL) {
+    return -1;
+  }
+  if (k <= 0 || spatial->cnt == 0) {
+    return 0;
+  }
+
+  memset(&q, 0, sizeof(q));
+  to_xyz(latitude, longitude, q.xyz);
+  q.k = ((uint32_t)k > spatial->cnt) ? (int)spatial->cnt : k;
+  if ((q.heap = malloc(sizeof(spatial_match_t) * q.k)) == NULL) {
+    ipmeta_log(__func__, "could not malloc query state");
+    return -1;
+  }
+
+  search_nearest(spatial->points, 0, spatial->cnt, 0, &q);
+  qsort(q.heap, q.cnt, sizeof(spatial_match_t), match_cmp);
+
+  for (i = 0; i < q.cnt; i++) {
+    records[i] = q.heap[i].record;
+    if (distances != NULL) {
+      distances[i] = dist2_to_km(q.heap[i].dist2);
+    }
+  }
+
+  free(q.heap);
+  return q.cnt;
+}
+
+int ipmeta_provider_find_within(ipmeta_provider_t *provider, double latitude,
+                                double longitude, double radius,
+                                ipmeta_record_t ***records,
+                                double **distances)
+{
+  ipmeta_spatial_t *spatial;
+  within_query_t q;
+  ipmeta_record_t **rec_arr = NULL;
+  double *dist_arr = NULL;
+  double angle, chord;
+  uint64_t i;
+
+  assert(provider != NULL);
+  assert(records != NULL);
+
+  *records = NULL;
+  if (distances != NULL) {
+    *distances = NULL;
+  }
+
+  if (!isfinite(latitude) || !isfinite(longitude) || isnan(radius)) {
+    ipmeta_log(__func__, "invalid location or radius");
+    return -1;
+  }
+  if ((spatial = get_index(provider)) == NULL) {
+    return -1;
+  }
+  if (radius < 0 || spatial->cnt == 0) {
+    return 0;
+  }
+
+  memset(&q, 0, sizeof(q));
+  to_xyz(latitude, longitude, q.xyz);
+  /* the straight-line distance that corresponds to the radius (anything
+     beyond half way around the globe includes every point) */
+  angle = radius / EARTH_RADIUS_KM;
+  chord = (angle >= M_PI) ? 2.0 + 1e-9 : 2 * sin(angle / 2);
+  q.max_dist2 = chord * chord;
+
+  if (search_within(spatial->points, 0, spatial->cnt, 0, &q) != 0 ||
+      q.cnt > INT32_MAX) {
+    ipmeta_log(__func__, "could not collect records");
+    goto err;
+  }
+  if (q.cnt == 0) {
+    return 0;
+  }
+  qsort(q.matches, q.cnt, sizeof(spatial_match_t), match_cmp);
+
+  if ((rec_arr = malloc(sizeof(ipmeta_record_t *) * q.cnt)) == NULL ||
+      (distances != NULL &&
+       (dist_arr = malloc(sizeof(double) * q.cnt)) == NULL)) {
+    ipmeta_log(__func__, "could not malloc result arrays");
+    goto err;
+  }
+  for (i = 0; i < q.cnt; i++) {
+    rec_arr[i] = q.matches[i].record;
+    if (dist_arr != NULL) {
+      dist_arr[i] = dist2_to_km(q.matches[i].dist2);
+    }
+  }
+
+  free(q.matches);
+  *records = rec_arr;
+  if (distances != NULL) {
+    *distances = dist_arr;
+  }
+  return (int)q.cnt;
+
+err:
+  free(q.matches);
+  free(rec_arr);
+  free(dist_arr);
+  return -1;
+}
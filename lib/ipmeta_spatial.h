@@ -0,0 +1,68 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_SPATIAL_H
+#define __IPMETA_SPATIAL_H
+
+#include "libipmeta.h"
+
+/** @file
+ *
+ * @brief Header file that exposes the internal spatial index over the
+ * locations of a provider's records
+ *
+ * Record locations are stored as points on the unit sphere in a k-d tree, so
+ * that the nearest records to a point, or all records within a distance of
+ * it, can be found without scanning every record. Since the straight-line
+ * distance between two points on the sphere grows with the great-circle
+ * distance between them, searching the tree by straight-line distance gives
+ * exact great-circle results.
+ *
+ * The index of a provider is built the first time it is queried (see
+ * ipmeta_provider_find_nearest and ipmeta_provider_find_within).
+ *
+ * @author Alistair King
+ *
+ */
+
+/** Opaque structure holding the spatial index of a provider */
+typedef struct ipmeta_spatial ipmeta_spatial_t;
+
+/** Free a spatial index
+ *
+ * @param spatial       The index to free (may be NULL)
+ */
+void ipmeta_spatial_free(ipmeta_spatial_t *spatial);
+
+#endif /* __IPMETA_SPATIAL_H */
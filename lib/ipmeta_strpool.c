@@ -0,0 +1,204 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "khash.h"
+#include "utils.h"
+
+#include "ipmeta_arena.h"
+#include "ipmeta_strpool.h"
+
+KHASH_SET_INIT_STR(ipmeta_strset)
+KHASH_MAP_INIT_STR(ipmeta_strids, uint32_t)
+
+struct ipmeta_strpool {
+
+  /** Set of all interned strings (the keys are the pooled copies) */
+  khash_t(ipmeta_strset) * strings;
+
+  /** Arena holding the pooled copies */
+  ipmeta_arena_t arena;
+};
+
+struct ipmeta_strdict {
+
+  /** The pool that the strings are interned in */
+  ipmeta_strpool_t *pool;
+
+  /** Map from (pooled) string to id */
+  khash_t(ipmeta_strids) * ids;
+
+  /** Array of strings indexed by id (strs[0] is NULL) */
+  const char **strs;
+
+  /** Number of ids assigned (including 0) */
+  uint32_t strs_cnt;
+
+  /** Number of slots allocated in strs */
+  uint32_t strs_alloc;
+};
+
+ipmeta_strpool_t *ipmeta_strpool_init(void)
+{
+  ipmeta_strpool_t *pool;
+
+  if ((pool = malloc_zero(sizeof(ipmeta_strpool_t))) == NULL) {
+    return NULL;
+  }
+  if ((pool->strings = kh_init(ipmeta_strset)) == NULL) {
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void ipmeta_strpool_free(ipmeta_strpool_t *pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+  kh_destroy(ipmeta_strset, pool->strings);
+  ipmeta_arena_free(&pool->arena);
+  free(pool);
+}
+
+char *ipmeta_strpool_intern(ipmeta_strpool_t *pool, const char *str)
+{
+  khiter_t khiter;
+  char *copy;
+  int khret;
+
+  if ((khiter = kh_get(ipmeta_strset, pool->strings, str)) !=
+      kh_end(pool->strings)) {
+    return (char *)kh_key(pool->strings, khiter);
+  }
+
+  if ((copy = ipmeta_arena_strndup(&pool->arena, str, strlen(str))) ==
+      NULL) {
+    return NULL;
+  }
+  khiter = kh_put(ipmeta_strset, pool->strings, copy, &khret);
+  if (khret < 0) {
+    return NULL;
+  }
+  return copy;
+}
+
+size_t ipmeta_strpool_size(ipmeta_strpool_t *pool)
+{
+  return kh_size(pool->strings);
+}
+
+ipmeta_strdict_t *ipmeta_strdict_init(ipmeta_strpool_t *pool)
+{
+  ipmeta_strdict_t *dict;
+
+  if ((dict = malloc_zero(sizeof(ipmeta_strdict_t))) == NULL) {
+    return NULL;
+  }
+  dict->pool = pool;
+  if ((dict->ids = kh_init(ipmeta_strids)) == NULL) {
+    free(dict);
+    return NULL;
+  }
+  /* id 0 is reserved for NULL */
+  dict->strs_cnt = 1;
+  return dict;
+}
+
+void ipmeta_strdict_free(ipmeta_strdict_t *dict)
+{
+  if (dict == NULL) {
+    return;
+  }
+  kh_destroy(ipmeta_strids, dict->ids);
+  free(dict->strs);
+  free(dict);
+}
+
+int ipmeta_strdict_id(ipmeta_strdict_t *dict, const char *str, uint32_t *id)
+{
+  const char **tmp;
+  uint32_t new_alloc;
+  khiter_t khiter;
+  char *pooled;
+  int khret;
+
+  if (str == NULL) {
+    *id = 0;
+    return 0;
+  }
+
+  if ((khiter = kh_get(ipmeta_strids, dict->ids, str)) != kh_end(dict->ids)) {
+    *id = kh_val(dict->ids, khiter);
+    return 0;
+  }
+
+  if (dict->strs_cnt == UINT32_MAX ||
+      (pooled = ipmeta_strpool_intern(dict->pool, str)) == NULL) {
+    return -1;
+  }
+  if (dict->strs_cnt >= dict->strs_alloc) {
+    new_alloc = dict->strs_alloc ? dict->strs_alloc * 2 : 256;
+    if ((tmp = realloc(dict->strs, sizeof(char *) * new_alloc)) == NULL) {
+      return -1;
+    }
+    tmp[0] = NULL;
+    dict->strs = tmp;
+    dict->strs_alloc = new_alloc;
+  }
+
+  khiter = kh_put(ipmeta_strids, dict->ids, pooled, &khret);
+  if (khret < 0) {
+    return -1;
+  }
+  kh_val(dict->ids, khiter) = dict->strs_cnt;
+  dict->strs[dict->strs_cnt] = pooled;
+  *id = dict->strs_cnt++;
+  return 0;
+}
+
+const char *ipmeta_strdict_str(ipmeta_strdict_t *dict, uint32_t id)
+{
+  return (id != 0 && id < dict->strs_cnt) ? dict->strs[id] : NULL;
+}
+
+uint32_t ipmeta_strdict_cnt(ipmeta_strdict_t *dict)
+{
+  return dict->strs_cnt;
+}
@@ -0,0 +1,134 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __IPMETA_STRPOOL_H
+#define __IPMETA_STRPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @file
+ *
+ * @brief Header file that exposes the internal string interning pool
+ *
+ * Record attributes such as region, city and timezone names repeat across
+ * many thousands of records (and across providers). A single pool, owned by
+ * the ipmeta instance, stores one copy of each distinct string, so two
+ * interned strings are equal if and only if their pointers are equal.
+ *
+ * @author Alistair King
+ *
+ */
+
+/** Opaque structure holding the state of a string pool */
+typedef struct ipmeta_strpool ipmeta_strpool_t;
+
+/** Create an empty string pool
+ *
+ * @return a string pool, or NULL if an error occurred
+ */
+ipmeta_strpool_t *ipmeta_strpool_init(void);
+
+/** Free a string pool, including all of the strings interned in it
+ *
+ * @param pool          pointer to the pool to free
+ */
+void ipmeta_strpool_free(ipmeta_strpool_t *pool);
+
+/** Get the pooled copy of a string, adding it to the pool if needed
+ *
+ * @param pool          pointer to the pool
+ * @param str           pointer to the (nul-terminated) string to intern
+ * @return the pool's copy of the string, NULL if an error occurred
+ *
+ * The returned string MUST NOT be modified or free'd. It remains valid until
+ * the pool is free'd.
+ */
+char *ipmeta_strpool_intern(ipmeta_strpool_t *pool, const char *str);
+
+/** Get the number of distinct strings in a pool
+ *
+ * @param pool          pointer to the pool
+ * @return the number of strings interned in the pool
+ */
+size_t ipmeta_strpool_size(ipmeta_strpool_t *pool);
+
+/** Opaque structure holding the state of a string dictionary
+ *
+ * A dictionary assigns dense integer ids (starting at 1, 0 stands for NULL)
+ * to the distinct strings of one record attribute, so that consumers can
+ * aggregate by attribute using array indexing.
+ */
+typedef struct ipmeta_strdict ipmeta_strdict_t;
+
+/** Create an empty string dictionary
+ *
+ * @param pool          pointer to the pool that the dictionary's strings are
+ *                      interned in (must outlive the dictionary)
+ * @return a string dictionary, or NULL if an error occurred
+ */
+ipmeta_strdict_t *ipmeta_strdict_init(ipmeta_strpool_t *pool);
+
+/** Free a string dictionary
+ *
+ * @param dict          pointer to the dictionary to free
+ */
+void ipmeta_strdict_free(ipmeta_strdict_t *dict);
+
+/** Get the id of a string, assigning the next free id if needed
+ *
+ * @param dict          pointer to the dictionary
+ * @param str           pointer to the string (may be NULL)
+ * @param[out] id       set to the id of the string (0 if str is NULL)
+ * @return 0 if successful, -1 if an error occurred
+ */
+int ipmeta_strdict_id(ipmeta_strdict_t *dict, const char *str, uint32_t *id);
+
+/** Get the string with the given id
+ *
+ * @param dict          pointer to the dictionary
+ * @param id            the id to look up
+ * @return the (pooled) string, NULL if id is 0 or has not been assigned
+ */
+const char *ipmeta_strdict_str(ipmeta_strdict_t *dict, uint32_t id);
+
+/** Get the number of ids of a dictionary
+ *
+ * @param dict          pointer to the dictionary
+ * @return one more than the largest id assigned (i.e., the length of an array
+ * that can be indexed by any id)
+ */
+uint32_t ipmeta_strdict_cnt(ipmeta_strdict_t *dict);
+
+#endif /* __IPMETA_STRPOOL_H */
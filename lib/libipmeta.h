@@ -33,6 +33,7 @@
 #ifndef __LIBIPMETA_H
 #define __LIBIPMETA_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <wandio.h>
 #include <sys/socket.h> // for AF_INET*
@@ -62,6 +63,12 @@ typedef struct ipmeta_ds ipmeta_ds_t;
 /** Opaque struct holding a set of records */
 typedef struct ipmeta_record_set ipmeta_record_set_t;
 
+/** Opaque struct holding a single-attribute projection of a provider */
+typedef struct ipmeta_projection ipmeta_projection_t;
+
+/** Opaque struct holding the records of a series of snapshots over time */
+typedef struct ipmeta_history ipmeta_history_t;
+
 /** @} */
 
 /**
@@ -122,6 +129,76 @@ typedef enum ipmeta_ds_id {
 
 } ipmeta_ds_id_t;
 
+/** Integer codes for continents (see ipmeta_record_t.continent_id) */
+typedef enum ipmeta_continent {
+  /** Unknown (or missing) continent */
+  IPMETA_CONTINENT_UNKNOWN = 0,
+
+  /** Africa */
+  IPMETA_CONTINENT_AF = 1,
+
+  /** Antarctica */
+  IPMETA_CONTINENT_AN = 2,
+
+  /** Asia */
+  IPMETA_CONTINENT_AS = 3,
+
+  /** Europe */
+  IPMETA_CONTINENT_EU = 4,
+
+  /** North America */
+  IPMETA_CONTINENT_NA = 5,
+
+  /** Oceania */
+  IPMETA_CONTINENT_OC = 6,
+
+  /** South America */
+  IPMETA_CONTINENT_SA = 7,
+
+  /** Number of continent codes */
+  IPMETA_CONTINENT_CNT = 8,
+
+} ipmeta_continent_t;
+
+/** Record attributes that can be represented by a single integer code */
+typedef enum ipmeta_attr {
+  /** No attribute (every record has code 0) */
+  IPMETA_ATTR_NONE = 0,
+
+  /** Country (ipmeta_record_t.country_id) */
+  IPMETA_ATTR_COUNTRY = 1,
+
+  /** Continent (ipmeta_record_t.continent_id) */
+  IPMETA_ATTR_CONTINENT = 2,
+
+  /** Region (ipmeta_record_t.region_id) */
+  IPMETA_ATTR_REGION = 3,
+
+  /** Timezone (ipmeta_record_t.timezone_id) */
+  IPMETA_ATTR_TIMEZONE = 4,
+
+  /** Origin ASN (0 unless the record has exactly one ASN) */
+  IPMETA_ATTR_ASN = 5,
+
+} ipmeta_attr_t;
+
+/** Ways in which a record set can aggregate the matches added to it */
+typedef enum ipmeta_aggr {
+  /** Keep every match (the default) */
+  IPMETA_AGGR_NONE = 0,
+
+  /** Keep each record once, with the address counts of its matches summed */
+  IPMETA_AGGR_RECORD = 1,
+
+  /** Keep one record per provider and attribute code, with the address
+      counts of the matches of all records that share the code summed */
+  IPMETA_AGGR_ATTR = 2,
+
+} ipmeta_aggr_t;
+
+/** Number of possible country ids (see ipmeta_country_id) */
+#define IPMETA_COUNTRY_ID_CNT (1 + 36 * 36)
+
 /** @} */
 
 /**
@@ -129,6 +206,20 @@ typedef enum ipmeta_ds_id {
  *
  * @{ */
 
+/** Amount of address space that maps to a record (or group of records)
+ *
+ * Where prefixes of a provider overlap, addresses are only counted for the
+ * record of the most specific prefix that contains them.
+ */
+typedef struct ipmeta_coverage {
+  /** Number of IPv4 addresses */
+  uint64_t v4_ip_cnt;
+
+  /** Number of IPv6 /64 subnets (each one counted in the range it starts in) */
+  uint64_t v6_ip_cnt;
+
+} ipmeta_coverage_t;
+
 /** Structure which contains an IP meta-data record
  *
  * @todo use some sort of key-value record so that we don't have to extend this
@@ -208,6 +299,30 @@ typedef struct ipmeta_record {
   /** Accuracy radius of lat/lon, km (0 == unknown) */
   int accuracy;
 
+  /** Integer code of country_code (see ipmeta_country_id), 0 if unknown */
+  uint16_t country_id;
+
+  /** Integer code of continent_code */
+  ipmeta_continent_t continent_id;
+
+  /** Dictionary id of the region within its country, i.e. records with the
+      same region but different country codes have different ids (see
+      ipmeta_region_from_id), 0 if none */
+  uint32_t region_id;
+
+  /** Dictionary id of timezone (see ipmeta_timezone_from_id), 0 if none */
+  uint32_t timezone_id;
+
+  /** Address space that maps to this record. Unlike asn_ip_cnt, this is
+      computed from the prefixes that were loaded, so it is exact. */
+  ipmeta_coverage_t coverage;
+
+  /** Address of the record itself for the records that libipmeta allocated
+      (so it never matches in a copy of a record). It marks the records that
+      have internal state, such as a cached output row, and must not be
+      modified. */
+  const struct ipmeta_record *self;
+
   /* -- ADD NEW FIELDS ABOVE HERE -- */
 
   /** The next record in the list */
@@ -215,6 +330,86 @@ typedef struct ipmeta_record {
 
 } ipmeta_record_t;
 
+/** Scale of the fixed-point coordinates in ipmeta_record_hot_t (i.e., they are
+ * in millionths of a degree) */
+#define IPMETA_RECORD_HOT_COORD_SCALE 1000000
+
+/** Compact copy of the most frequently used fields of an ipmeta_record_t
+ *
+ * Every record held by a provider has one of these stored directly in front of
+ * it, and both can be reached from each other by address arithmetic (see
+ * ipmeta_record_get_hot, which only checks the record's self field, and
+ * ipmeta_record_hot_get_full). A lookup that only needs the fields below
+ * therefore never reads the rest of the full record.
+ *
+ * The compact record is filled once the provider has finished loading, and
+ * MUST NOT be modified.
+ */
+typedef struct ipmeta_record_hot {
+  /** ISO2 country code (not nul-terminated) */
+  char country_code[2];
+
+  /** Continent code (not nul-terminated) */
+  char continent_code[2];
+
+  /** The origin ASN if the record has exactly one, otherwise 0 */
+  uint32_t asn;
+
+  /** Latitude, in units of 1/IPMETA_RECORD_HOT_COORD_SCALE degrees */
+  int32_t latitude;
+
+  /** Longitude, in units of 1/IPMETA_RECORD_HOT_COORD_SCALE degrees */
+  int32_t longitude;
+
+  /** The ID of the full record */
+  uint32_t id;
+
+  /** Index of the full record in the provider's record list (as returned by
+   * ipmeta_provider_peek_all_records) */
+  uint32_t cold_idx;
+
+  /** Region code (see ipmeta_record_t.region_code) */
+  uint16_t region_code;
+
+  /** Number of ASNs of the full record (saturates at UINT16_MAX) */
+  uint16_t asn_cnt;
+
+  /** The provider that this record came from */
+  uint8_t source;
+
+  /** Unused (pads the structure to 32 bytes) */
+  uint8_t _pad[3];
+
+} ipmeta_record_hot_t;
+
+/** An IPv4 or IPv6 prefix */
+typedef struct ipmeta_prefix {
+  /** Prefix address, in network byte order (IPv4 only uses the first 4
+   * bytes) */
+  uint8_t addr[16];
+
+  /** The address family (AF_INET or AF_INET6) */
+  uint8_t family;
+
+  /** The prefix length */
+  uint8_t pfxlen;
+
+} ipmeta_prefix_t;
+
+/** An (inclusive) range of IPv4 or IPv6 addresses */
+typedef struct ipmeta_addr_range {
+  /** First address, in network byte order (IPv4 only uses the first 4
+   * bytes) */
+  uint8_t first[16];
+
+  /** Last address, in network byte order (IPv4 only uses the first 4 bytes) */
+  uint8_t last[16];
+
+  /** The address family (AF_INET or AF_INET6) */
+  uint8_t family;
+
+} ipmeta_addr_range_t;
+
 /** @} */
 
 /** Convert a provider id to a mask */
@@ -306,6 +501,50 @@ ipmeta_provider_t *ipmeta_get_provider_by_name(ipmeta_t *ipmeta,
 int ipmeta_lookup_pfx(ipmeta_t *ipmeta, int family, void *addrp, uint8_t pfxlen,
                   uint32_t provmask, ipmeta_record_set_t *records);
 
+/** Callback invoked by ipmeta_lookup_pfx_iter for each match
+ *
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to a struct in_addr or in6_addr containing the
+ *                      (network byte order) address of the matched prefix
+ * @param pfxlen        The length of the matched prefix
+ * @param record        The record that the matched prefix maps to
+ * @param num_ips       The number of IPv4 addresses or IPv6 /64 subnets
+ *                      matched
+ * @param user          The user pointer given to ipmeta_lookup_pfx_iter
+ * @return 0 to continue the lookup, any other value to stop
+ */
+typedef int(ipmeta_lookup_pfx_cb_t)(int family, void *addrp, uint8_t pfxlen,
+                                    ipmeta_record_t *record, uint64_t num_ips,
+                                    void *user);
+
+/** Look up the given IP prefix, passing each match to a callback as it is
+ * found
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to a struct in_addr or in6_addr containing the
+ *                      address to look up
+ * @param pfxlen        The prefix length (0-32 or 0-128)
+ * @param providermask  A bitmask indicating which providers should be used.
+ *                      Calculate this with a bitwise-or of 0 or more
+ *                      IPMETA_PROV_TO_MASK(id).
+ *                      Set to `0` to automatically use all active providers.
+ * @param cb            Callback to invoke for each match
+ * @param user          User pointer to pass to the callback
+ * @return the number of matches passed to the callback, or -1 if an error
+ *         occurred or the callback asked to stop.
+ *
+ * This finds the same matches as ipmeta_lookup_pfx, but rather than
+ * collecting them in a record set, each is handed to the callback along with
+ * the part of the prefix that it covers (which is always itself a prefix).
+ * No memory is allocated, so this is suited to very large prefixes, and the
+ * lookup can be abandoned early. Matches are not aggregated, and the bigarray
+ * datastructure reports one match per address.
+ */
+int ipmeta_lookup_pfx_iter(ipmeta_t *ipmeta, int family, void *addrp,
+                           uint8_t pfxlen, uint32_t providermask,
+                           ipmeta_lookup_pfx_cb_t *cb, void *user);
+
 /** Look up the given single IP address for a set of providers
  *
  * @param ipmeta        The ipmeta instance to use for the lookup
@@ -340,6 +579,253 @@ int ipmeta_lookup_addr(ipmeta_t *ipmeta, int family, void *addrp,
 int ipmeta_lookup(ipmeta_t *ipmeta, const char *addr_str,
                   uint32_t providermask, ipmeta_record_set_t *found);
 
+/** Callback invoked by ipmeta_lookup_lines for each address looked up
+ *
+ * @param addr_str      Pointer to the address or prefix (NOT nul-terminated)
+ * @param addr_len      Length of the address or prefix
+ * @param found_cnt     The result of the lookup, as returned by
+ *                      ipmeta_lookup (IPMETA_ERR_INPUT for bad input)
+ * @param found         The record set holding the matches
+ * @param user          The user pointer given to ipmeta_lookup_lines
+ * @return 0 to continue with the next line, any other value to stop
+ */
+typedef int(ipmeta_lookup_lines_cb_t)(const char *addr_str, size_t addr_len,
+                                      int found_cnt,
+                                      ipmeta_record_set_t *found, void *user);
+
+/** Look up each address or prefix in a newline-delimited buffer
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param buf           Pointer to the buffer of addresses, one per line
+ * @param len           Length of the buffer
+ * @param providermask  A bitmask indicating which providers should be used.
+ *                      Calculate this with a bitwise-or of 0 or more
+ *                      IPMETA_PROV_TO_MASK(id).
+ *                      Set to `0` to automatically use all active providers.
+ * @param found         Pointer to a record set to use for storing matches
+ * @param cb            Callback to invoke with the matches for each line
+ * @param user          User pointer to pass to the callback
+ * @return the number of lines that were looked up, or -1 if an internal error
+ *         occurred or the callback asked to stop.
+ *
+ * Lines are parsed in place (the buffer does not need to be nul-terminated),
+ * and each is looked up as it is parsed. Empty lines and lines starting with
+ * '#' are skipped, a trailing "\r" is ignored, as is anything following a '|'
+ * on a line. The last line does not need to end with a newline.
+ */
+int ipmeta_lookup_lines(ipmeta_t *ipmeta, const char *buf, size_t len,
+                        uint32_t providermask, ipmeta_record_set_t *found,
+                        ipmeta_lookup_lines_cb_t *cb, void *user);
+
+/** Callback invoked by ipmeta_foreach_prefix for each stored prefix
+ *
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to a struct in_addr or in6_addr containing the
+ *                      (network byte order) prefix address
+ * @param pfxlen        The prefix length
+ * @param record        The record of the prefix (the provider is given by
+ *                      record->source)
+ * @param user          The user pointer passed to ipmeta_foreach_prefix
+ * @return 0 to continue with the next prefix, any other value to stop
+ */
+typedef int(ipmeta_foreach_prefix_cb_t)(int family, void *addrp,
+                                        uint8_t pfxlen,
+                                        ipmeta_record_t *record, void *user);
+
+/** Visit every prefix loaded by a set of providers
+ *
+ * @param ipmeta        The ipmeta instance holding the providers
+ * @param family        The address family to visit (AF_INET or AF_INET6)
+ * @param providermask  A bitmask indicating which providers should be visited.
+ *                      Calculate this with a bitwise-or of 0 or more
+ *                      IPMETA_PROV_TO_MASK(id).
+ *                      Set to `0` to automatically use all active providers.
+ * @param cb            Callback to invoke for each prefix
+ * @param user          User pointer to pass to the callback
+ * @return 0 if all prefixes were visited, -1 if an error occurred or the
+ *         callback asked to stop
+ *
+ * The prefixes of each provider are visited in address order, and a prefix
+ * is always visited before the (more specific) prefixes it contains. Prefixes
+ * of different providers may be interleaved. The walk is done by the
+ * datastructure itself, so unlike a lookup of 0.0.0.0/0 it does not need to
+ * search for the prefixes, and it keeps no per-prefix state. The bigarray
+ * datastructure does not keep the original prefixes, so it visits the fewest
+ * prefixes that cover each run of addresses with the same record.
+ */
+int ipmeta_foreach_prefix(ipmeta_t *ipmeta, int family, uint32_t providermask,
+                          ipmeta_foreach_prefix_cb_t *cb, void *user);
+
+/** Callback invoked by ipmeta_join for each range of addresses
+ *
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param firstp        Pointer to a struct in_addr or in6_addr containing the
+ *                      first address of the range
+ * @param lastp         Pointer to a struct in_addr or in6_addr containing the
+ *                      last address of the range
+ * @param num_ips       The number of addresses in the range (for IPv6, the
+ *                      number of /64 subnets that start in the range)
+ * @param records       Array of IPMETA_PROVIDER_MAX records, indexed by
+ *                      provider id - 1, holding the record that each provider
+ *                      has for the range (NULL for providers that have no
+ *                      record, or that are not being joined)
+ * @param user          The user pointer passed to ipmeta_join
+ * @return 0 to continue with the next range, any other value to stop
+ */
+typedef int(ipmeta_join_cb_t)(int family, void *firstp, void *lastp,
+                              uint64_t num_ips, ipmeta_record_t **records,
+                              void *user);
+
+/** Join the prefixes of a set of providers
+ *
+ * @param ipmeta        The ipmeta instance holding the providers
+ * @param family        The address family to join (AF_INET or AF_INET6)
+ * @param providermask  A bitmask indicating which providers should be joined.
+ *                      Calculate this with a bitwise-or of 0 or more
+ *                      IPMETA_PROV_TO_MASK(id).
+ *                      Set to `0` to automatically use all active providers.
+ * @param cb            Callback to invoke for each range
+ * @param user          User pointer to pass to the callback
+ * @return 0 if successful, -1 if an error occurred or the callback asked to
+ *         stop
+ *
+ * The address space is split into the maximal ranges over which the record of
+ * every joined provider is the same, and the callback is invoked for each
+ * range (in address order) that at least one provider has a record for. The
+ * prefixes of each provider are first flattened into a sorted list of ranges,
+ * and the lists are then merged in a single pass, so the cost is linear in the
+ * number of prefixes.
+ */
+int ipmeta_join(ipmeta_t *ipmeta, int family, uint32_t providermask,
+                ipmeta_join_cb_t *cb, void *user);
+
+/** Check whether two records hold the same metadata
+ *
+ * @param a             The first record (may be NULL)
+ * @param b             The second record (may be NULL)
+ * @return 1 if both records are NULL, or both have the same provider and the
+ *         same values in every field, 0 otherwise
+ *
+ * The records may come from different ipmeta instances. Record ids, and the
+ * fields that are computed from the loaded data (the integer codes, ASN
+ * address counts and coverage), are not compared.
+ */
+int ipmeta_record_equal(const ipmeta_record_t *a, const ipmeta_record_t *b);
+
+/** Callback invoked by ipmeta_diff for each range of addresses whose record
+ * changed
+ *
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param firstp        Pointer to a struct in_addr or in6_addr containing the
+ *                      first address of the range
+ * @param lastp         Pointer to a struct in_addr or in6_addr containing the
+ *                      last address of the range
+ * @param num_ips       The number of addresses in the range (for IPv6, the
+ *                      number of /64 subnets that start in the range)
+ * @param old_record    The record of the range in the old instance (NULL if
+ *                      it had none)
+ * @param new_record    The record of the range in the new instance (NULL if
+ *                      it has none)
+ * @param user          The user pointer passed to ipmeta_diff
+ * @return 0 to continue with the next range, any other value to stop
+ */
+typedef int(ipmeta_diff_cb_t)(int family, void *firstp, void *lastp,
+                              uint64_t num_ips, ipmeta_record_t *old_record,
+                              ipmeta_record_t *new_record, void *user);
+
+/** Find the address ranges whose metadata differs between two instances
+ *
+ * @param old_ipmeta    The instance holding the old data
+ * @param new_ipmeta    The instance holding the new data
+ * @param family        The address family to compare (AF_INET or AF_INET6)
+ * @param provider_id   The provider whose data should be compared
+ * @param cb            Callback to invoke for each changed range
+ * @param user          User pointer to pass to the callback
+ * @return 0 if successful, -1 if an error occurred or the callback asked to
+ *         stop
+ *
+ * The prefixes of the provider in each instance are flattened into a sorted
+ * list of ranges (as for ipmeta_join), and both lists are then swept in a
+ * single pass. The callback is invoked, in address order, for each maximal
+ * range over which the old and new records stay the same but are not equal
+ * (see ipmeta_record_equal). Ranges that were added or removed have a NULL
+ * record on one side. A provider that is not enabled in an instance is
+ * treated as having no prefixes there.
+ *
+ * @note memory use is not bounded: both flattened range lists are held in
+ * memory during the sweep, which takes about 24 bytes per range of each
+ * instance (the datastructures can only be iterated with a callback, so they
+ * cannot be walked in step with bounded cursors).
+ */
+int ipmeta_diff(ipmeta_t *old_ipmeta, ipmeta_t *new_ipmeta, int family,
+                ipmeta_provider_id_t provider_id, ipmeta_diff_cb_t *cb,
+                void *user);
+
+/** Build the reverse indexes used by ipmeta_prefixes_by_asn,
+ * ipmeta_prefixes_by_country and ipmeta_prefixes_by_record
+ *
+ * @param ipmeta        The ipmeta instance to index
+ * @return 0 if the indexes were built successfully, -1 otherwise
+ *
+ * The indexes are optional, and are only built when this function is called
+ * (once all providers have been enabled). Enabling another provider drops
+ * them, after which they must be built again.
+ */
+int ipmeta_build_reverse_indexes(ipmeta_t *ipmeta);
+
+/** Get the prefixes that the pfx2as provider maps to an ASN
+ *
+ * @param ipmeta        The ipmeta instance to query
+ * @param asn           The ASN to get the prefixes of
+ * @param[out] prefixes Set to point to an array of prefixes, sorted by family
+ *                      (IPv4 first), address and prefix length. The array
+ *                      belongs to the index.
+ * @return the number of prefixes in the array, or -1 if the reverse indexes
+ *         have not been built
+ *
+ * Prefixes originated by a set of ASNs (MOAS) are returned for every ASN in
+ * the set.
+ */
+int ipmeta_prefixes_by_asn(ipmeta_t *ipmeta, uint32_t asn,
+                           const ipmeta_prefix_t **prefixes);
+
+/** Get the address ranges that a geolocation provider maps to a country
+ *
+ * @param ipmeta        The ipmeta instance to query
+ * @param provider      The provider to get the ranges of
+ * @param country_code  The ISO2 country code to get the ranges of
+ * @param[out] ranges   Set to point to an array of disjoint ranges, sorted by
+ *                      family (IPv4 first) and address. The array belongs to
+ *                      the index.
+ * @return the number of ranges in the array, or -1 if the reverse indexes
+ *         have not been built
+ *
+ * Where prefixes of the provider overlap, addresses belong to the country of
+ * the most specific prefix, and adjacent ranges are merged.
+ */
+int ipmeta_prefixes_by_country(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
+                               const char *country_code,
+                               const ipmeta_addr_range_t **ranges);
+
+/** Get the address ranges that map to a record
+ *
+ * @param ipmeta        The ipmeta instance to query
+ * @param record        The record to get the ranges of (e.g. as returned by
+ *                      ipmeta_provider_find_nearest)
+ * @param[out] ranges   Set to point to an array of disjoint ranges, sorted by
+ *                      family (IPv4 first) and address. The array belongs to
+ *                      the index.
+ * @return the number of ranges in the array, or -1 if the reverse indexes
+ *         have not been built
+ *
+ * Where prefixes of the record's provider overlap, addresses belong to the
+ * record of the most specific prefix. A record that does not belong to this
+ * instance (such as a copy of a record, or one from an ipmeta_history) has no
+ * ranges.
+ */
+int ipmeta_prefixes_by_record(ipmeta_t *ipmeta, ipmeta_record_t *record,
+                              const ipmeta_addr_range_t **ranges);
+
 /** Check if the given provider is enabled already
  *
  * @param provider      The provider to check the status of
@@ -373,6 +859,205 @@ const char *ipmeta_get_provider_name(ipmeta_provider_t *provider);
  */
 ipmeta_provider_t **ipmeta_get_all_providers(ipmeta_t *ipmeta);
 
+/** Get the integer code of a 2 character country code
+ *
+ * @param country_code  The country code (need not be nul-terminated)
+ * @return a stable code in [0, IPMETA_COUNTRY_ID_CNT), 0 if the code is
+ * unknown ("??", "--" etc.) or NULL
+ *
+ * Codes are computed from the characters alone (case-insensitively), so they
+ * are the same for every provider and every version of a database.
+ */
+uint16_t ipmeta_country_id(const char *country_code);
+
+/** Get the 2 character country code for an integer country code
+ *
+ * @param country_id    The integer code (see ipmeta_country_id)
+ * @param buf           Buffer of at least 3 bytes to write the code to
+ * @return buf, which holds "??" if the code is 0 or invalid
+ */
+char *ipmeta_country_from_id(uint16_t country_id, char *buf);
+
+/** Get the integer code of a 2 character continent code
+ *
+ * @param continent_code  The continent code (need not be nul-terminated)
+ * @return the continent code, IPMETA_CONTINENT_UNKNOWN if it is not known
+ */
+ipmeta_continent_t ipmeta_continent_id(const char *continent_code);
+
+/** Get the 2 character continent code for an integer continent code
+ *
+ * @param continent_id  The integer code
+ * @return the continent code ("??" for unknown or invalid codes)
+ */
+const char *ipmeta_continent_from_id(ipmeta_continent_t continent_id);
+
+/** Get the region name for a region dictionary id
+ *
+ * @param ipmeta        The ipmeta object the record came from
+ * @param region_id     The dictionary id (see ipmeta_record_t.region_id)
+ * @return the region name (without the country code that the id also
+ * depends on), NULL if the id is 0 or unknown
+ */
+const char *ipmeta_region_from_id(ipmeta_t *ipmeta, uint32_t region_id);
+
+/** Get the number of region dictionary ids
+ *
+ * @param ipmeta        The ipmeta object to get the count for
+ * @return one more than the largest region id assigned so far (i.e. the
+ * length of an array that can be indexed by region id)
+ */
+uint32_t ipmeta_region_id_cnt(ipmeta_t *ipmeta);
+
+/** Get the timezone name for a timezone dictionary id
+ *
+ * @param ipmeta        The ipmeta object the record came from
+ * @param timezone_id   The dictionary id (see ipmeta_record_t.timezone_id)
+ * @return the timezone name, NULL if the id is 0 or unknown
+ */
+const char *ipmeta_timezone_from_id(ipmeta_t *ipmeta, uint32_t timezone_id);
+
+/** Get the number of timezone dictionary ids
+ *
+ * @param ipmeta        The ipmeta object to get the count for
+ * @return one more than the largest timezone id assigned so far
+ */
+uint32_t ipmeta_timezone_id_cnt(ipmeta_t *ipmeta);
+
+/** Get the integer code of an attribute of a record
+ *
+ * @param record        The record to get the attribute of
+ * @param attr          The attribute to get
+ * @return the code of the attribute (0 if the record does not have it)
+ */
+uint32_t ipmeta_record_get_attr(const ipmeta_record_t *record,
+                                ipmeta_attr_t attr);
+
+/** Build a projection of one attribute of a provider
+ *
+ * @param ipmeta        The ipmeta object the provider belongs to
+ * @param provider      The (enabled) provider to project
+ * @param attr          The attribute to keep
+ * @return the projection, NULL if an error occurred
+ *
+ * A projection maps every IPv4 and IPv6 address to the code of the given
+ * attribute of the record that the provider has for the address (see
+ * ipmeta_record_get_attr), or to 0 if there is no such record. Adjacent
+ * address ranges with the same code are merged, so a projection is usually
+ * far smaller than the provider it was built from, and it remains valid after
+ * the ipmeta object has been free'd.
+ */
+ipmeta_projection_t *ipmeta_projection_init(ipmeta_t *ipmeta,
+                                            ipmeta_provider_t *provider,
+                                            ipmeta_attr_t attr);
+
+/** Free a projection
+ *
+ * @param proj          The projection to free
+ */
+void ipmeta_projection_free(ipmeta_projection_t *proj);
+
+/** Look up the attribute code of a single address in a projection
+ *
+ * @param proj          The projection to look the address up in
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to a struct in_addr or in6_addr containing the
+ *                      address to look up
+ * @return the attribute code for the address, 0 if the provider had no record
+ * for it
+ */
+uint32_t ipmeta_lookup_attr(ipmeta_projection_t *proj, int family,
+                            void *addrp);
+
+/** Get the attribute that a projection was built for
+ *
+ * @param proj          The projection
+ * @return the projected attribute
+ */
+ipmeta_attr_t ipmeta_projection_get_attr(ipmeta_projection_t *proj);
+
+/** Get the number of (merged) address ranges in a projection
+ *
+ * @param proj          The projection
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @return the number of ranges (including those with code 0)
+ */
+uint64_t ipmeta_projection_get_range_cnt(ipmeta_projection_t *proj,
+                                         int family);
+
+/** Create an empty history of snapshots
+ *
+ * @return the history, NULL if an error occurred
+ *
+ * A history stores each address range once, together with the period that
+ * it mapped to the same record, and each distinct record once, so its memory
+ * grows with the number of changes between snapshots rather than with the
+ * number of snapshots.
+ */
+ipmeta_history_t *ipmeta_history_init(void);
+
+/** Free a history
+ *
+ * @param history       The history to free
+ */
+void ipmeta_history_free(ipmeta_history_t *history);
+
+/** Add the data of a snapshot to a history
+ *
+ * @param history       The history to add the snapshot to
+ * @param snapshot      The ipmeta instance holding the snapshot
+ * @param providermask  Mask of the providers to add (0 for all providers
+ *                      enabled in the snapshot)
+ * @param time          The time of the snapshot (e.g. a unix timestamp or a
+ *                      day number, as long as it is used consistently)
+ * @return 0 if successful, -1 if an error occurred
+ *
+ * The snapshots of each provider must be added in increasing time order. The
+ * records are copied, so the snapshot can be freed once it has been added.
+ * The data of a snapshot is considered valid until the time of the next
+ * snapshot of the same provider (indefinitely for the latest snapshot).
+ */
+int ipmeta_history_add_snapshot(ipmeta_history_t *history, ipmeta_t *snapshot,
+                                uint32_t providermask, uint32_t time);
+
+/** Look up a single address as it was at a given time
+ *
+ * @param history       The history to look the address up in
+ * @param time          The time to look the address up at
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @param addrp         Pointer to the address (network byte order)
+ * @param providermask  Mask of the providers to consider (0 for all)
+ * @param found         The record set to add the matching records to
+ * @return the number of matching records, -1 if an error occurred
+ *
+ * The record set is cleared first. Each provider contributes at most one
+ * record: the one from its latest snapshot at or before the given time.
+ * Records returned from a history have no region or timezone ids and no
+ * coverage.
+ *
+ * @note the lookup index is rebuilt by the first lookup after snapshots were
+ * added, so lookups and ipmeta_history_add_snapshot must not run
+ * concurrently.
+ */
+int ipmeta_lookup_addr_at(ipmeta_history_t *history, uint32_t time,
+                          int family, void *addrp, uint32_t providermask,
+                          ipmeta_record_set_t *found);
+
+/** Get the number of address ranges stored in a history
+ *
+ * @param history       The history
+ * @param family        The address family (AF_INET or AF_INET6)
+ * @return the number of ranges of all providers and snapshots
+ */
+uint64_t ipmeta_history_get_span_cnt(ipmeta_history_t *history, int family);
+
+/** Get the number of distinct records stored in a history
+ *
+ * @param history       The history
+ * @return the number of records of all providers and snapshots
+ */
+uint32_t ipmeta_history_get_record_cnt(ipmeta_history_t *history);
+
 /** Initialize a new record set instance
  *
  * @return the record set instance created, NULL if an error occurs
@@ -397,6 +1082,36 @@ void ipmeta_record_set_free(ipmeta_record_set_t **record_set_p);
  */
 void ipmeta_record_set_clear(ipmeta_record_set_t *this);
 
+/** Set how a record set aggregates the matches that are added to it
+ *
+ * @param record_set    The record set to configure
+ * @param aggr          The kind of aggregation to use
+ * @param attr          The attribute to aggregate by, if aggr is
+ *                      IPMETA_AGGR_ATTR (IPMETA_ATTR_NONE otherwise)
+ * @return 0 if successful, -1 if an error occurred
+ *
+ * Matches are aggregated as the lookup adds them to the set, so, for
+ * example, a prefix lookup with IPMETA_AGGR_RECORD returns each distinct
+ * record once per provider, with the number of IPv4 addresses (or IPv6 /64s)
+ * that map to it, rather than once per matching sub-prefix. Matches without a
+ * record (addresses that no prefix covers) are counted in a single entry whose
+ * record is NULL.
+ *
+ * With IPMETA_AGGR_ATTR, the aggregation key is the provider and the
+ * attribute code of the record (see ipmeta_record_get_attr). Each entry holds
+ * the first record that was matched for its key, and its count covers every
+ * record with the same key, so only the attribute itself is meaningful for
+ * the entry. Records whose code is 0 (e.g., an unknown country, or a MOAS
+ * prefix for IPMETA_ATTR_ASN) have nothing in common, so they are aggregated
+ * by record instead, as with IPMETA_AGGR_RECORD. Entries keep the order in
+ * which they were first matched.
+ *
+ * The setting remains in effect until it is changed, and is kept when the set
+ * is cleared. Changing it clears the set.
+ */
+int ipmeta_record_set_set_aggregation(ipmeta_record_set_t *record_set,
+                                      ipmeta_aggr_t aggr, ipmeta_attr_t attr);
+
 /** Move the record set iterator pointer to the first element
  *
  * @param record_set    The record set instance
@@ -418,6 +1133,39 @@ void ipmeta_record_set_rewind(ipmeta_record_set_t *record_set);
 ipmeta_record_t *ipmeta_record_set_next(ipmeta_record_set_t *record_set,
                                         uint64_t *num_ips);
 
+/** Get the compact part of the next record in the record set iterator
+ *
+ * @param record_set    The record set instance
+ * @param[out] num_ips  Pointer to an int which will be set to the number of
+ *                      matched IPv4 addresses or IPv6 /64 subnets
+ *                      (optional)
+ *
+ * @return a pointer to the compact record, NULL if there are no more records
+ *
+ * This is equivalent to ipmeta_record_get_hot(ipmeta_record_set_next(...)).
+ */
+const ipmeta_record_hot_t *
+ipmeta_record_set_next_hot(ipmeta_record_set_t *record_set, uint64_t *num_ips);
+
+/** Get the compact part of a record
+ *
+ * @param record        Pointer to a record returned by a lookup (or by
+ *                      ipmeta_provider_get_all_records)
+ * @return a pointer to the compact copy of the record's frequently used fields,
+ * NULL if the record was not allocated by libipmeta (e.g., it is a copy of a
+ * record, see ipmeta_record_t.self)
+ *
+ * Only the self field of the record is read.
+ */
+const ipmeta_record_hot_t *ipmeta_record_get_hot(const ipmeta_record_t *record);
+
+/** Get the full record that a compact record belongs to
+ *
+ * @param hot           Pointer to a compact record
+ * @return a pointer to the full record
+ */
+ipmeta_record_t *ipmeta_record_hot_get_full(const ipmeta_record_hot_t *hot);
+
 #ifdef __GNUC__
 #define ATTR_FORMAT_PRINTF(i,j) __attribute__((format(printf, i, j)))
 #else
@@ -514,6 +1262,10 @@ void ipmeta_dump_record_header(void);
  *
  * Each field in the record is written to the given file in pipe-delimited
  * format (prefixed with the IP string given)
+ *
+ * The fields of a record that belongs to a provider are formatted once, the
+ * first time the record is written, and the cached text is reused for all
+ * later rows that use the same record.
  */
 void ipmeta_write_record(iow_t *file, ipmeta_record_t *record, char *ip_str,
                          uint64_t num_ips);
@@ -541,6 +1293,75 @@ void ipmeta_write_record_header(iow_t *file);
 int ipmeta_provider_get_all_records(ipmeta_provider_t *provider,
                                     ipmeta_record_t ***records);
 
+/** Get the array of all the metadata records registered with the given
+ *  provider, without copying it
+ *
+ * @param provider      The metadata provider to retrieve the records from
+ * @param[out] records  Returns the provider's array of metadata records
+ * @return the number of records in the array
+ *
+ * @note The array belongs to the provider. DO NOT free or modify it (or the
+ * records it contains). It is only valid until the provider is freed.
+ */
+int ipmeta_provider_peek_all_records(ipmeta_provider_t *provider,
+                                     ipmeta_record_t *const **records);
+
+/** Get the address space that maps to records of the given country
+ *
+ * @param provider      The metadata provider to get the coverage for
+ * @param country_code  The 2 character country code
+ * @return the coverage of the country (all zero for a country that has no
+ * records), NULL if the provider is not enabled
+ *
+ * The totals are computed when the provider is initialized, so this does not
+ * search the records. Records with an unknown or invalid country code are
+ * counted together under "??".
+ */
+const ipmeta_coverage_t *
+ipmeta_provider_get_country_coverage(ipmeta_provider_t *provider,
+                                     const char *country_code);
+
+/** Find the records of a provider that are located nearest to a point
+ *
+ * @param provider      The metadata provider to search
+ * @param latitude      Latitude of the point, in degrees
+ * @param longitude     Longitude of the point, in degrees
+ * @param k             The maximum number of records to find
+ * @param[out] records  Array of (at least) k records to fill, nearest first
+ * @param[out] distances  Array of (at least) k distances to fill with the
+ *                      great-circle distance (in km) to each record, or NULL
+ * @return the number of records found (less than k only if the provider has
+ * fewer located records), -1 if an error occurred
+ *
+ * Records without a location (latitude and longitude both 0) are ignored.
+ * The spatial index of the provider is built by the first query, which takes
+ * O(n log n) time; later queries take O(k log n) time.
+ */
+int ipmeta_provider_find_nearest(ipmeta_provider_t *provider, double latitude,
+                                 double longitude, int k,
+                                 ipmeta_record_t **records, double *distances);
+
+/** Find the records of a provider that are located within a distance of a
+ *  point
+ *
+ * @param provider      The metadata provider to search
+ * @param latitude      Latitude of the point, in degrees
+ * @param longitude     Longitude of the point, in degrees
+ * @param radius        The maximum great-circle distance, in km
+ * @param[out] records  Returns an array of the records found, nearest first
+ * @param[out] distances  Returns an array with the distance (in km) to each
+ *                      record, unless NULL is passed
+ * @return the number of records found, -1 if an error occurred
+ *
+ * @note It is the caller's responsibility to free the arrays (which are NULL
+ * if no records are found). DO NOT free the records contained in the array.
+ * See ipmeta_provider_find_nearest for how the spatial index is built.
+ */
+int ipmeta_provider_find_within(ipmeta_provider_t *provider, double latitude,
+                                double longitude, double radius,
+                                ipmeta_record_t ***records,
+                                double **distances);
+
 /**
  * @name Logging functions
  *
@@ -579,6 +1400,21 @@ int ipmeta_provider_maxmind_get_iso2_list(const char ***countries);
 int ipmeta_provider_maxmind_get_country_continent_list(
   const char ***continents);
 
+/** Retrieve the pfx2as record for the given set of origin ASNs
+ *
+ * @param provider      The pfx2as provider to retrieve the record from
+ * @param asns          Array of ASNs (in any order, duplicates are ignored)
+ * @param asn_cnt       Number of ASNs in the array
+ * @return the record for this ASN set, or NULL if no prefix in the loaded
+ * pfx2as data is originated by exactly this set of ASNs
+ *
+ * @note AS sets and MOAS entries are treated identically, and the ASNs in a
+ * pfx2as record are always stored in ascending order.
+ */
+ipmeta_record_t *
+ipmeta_provider_pfx2as_get_record_by_asns(ipmeta_provider_t *provider,
+                                          const uint32_t *asns, int asn_cnt);
+
 /** Information about a single Net Acuity region */
 typedef struct ipmeta_provider_netacq_edge_region {
   /** A unique code for this region */
@@ -638,6 +1474,9 @@ typedef struct ipmeta_polygon {
   /** User-provided code for this polygon */
   char *usercode;
 
+  /** Address space that maps to records located in this polygon */
+  ipmeta_coverage_t coverage;
+
 } ipmeta_polygon_t;
 
 /** Information about a Polygon table */
@@ -656,6 +1495,13 @@ typedef struct ipmeta_polygon_table {
   /** Number of polygons in the table */
   int polygons_cnt;
 
+  /** Polygons indexed by id (NULL for unused ids), or NULL if the ids of the
+      table are too sparse to be indexed directly */
+  ipmeta_polygon_t **polygons_by_id;
+
+  /** Number of slots in the polygons_by_id array */
+  uint32_t polygons_by_id_len;
+
 } ipmeta_polygon_table_t;
 
 /** Retrieve a list of Net Acuity region objects
@@ -685,6 +1531,39 @@ int ipmeta_provider_netacq_edge_get_countries(
   ipmeta_provider_t *provider,
   ipmeta_provider_netacq_edge_country_t ***countries);
 
+/** Retrieve the Net Acuity region with the given code
+ *
+ * @param provider      The provider to retrieve the region from
+ * @param code          The region code (e.g. ipmeta_record_t.region_code)
+ * @return the region object, NULL if there is no region with this code
+ *
+ * Regions are indexed by code when they are loaded, so this does not search
+ * the region list.
+ */
+ipmeta_provider_netacq_edge_region_t *
+ipmeta_provider_netacq_edge_get_region_by_code(ipmeta_provider_t *provider,
+                                               uint32_t code);
+
+/** Retrieve the Net Acuity country with the given code
+ *
+ * @param provider      The provider to retrieve the country from
+ * @param code          The Net Acuity country code
+ * @return the country object, NULL if there is no country with this code
+ */
+ipmeta_provider_netacq_edge_country_t *
+ipmeta_provider_netacq_edge_get_country_by_code(ipmeta_provider_t *provider,
+                                                uint32_t code);
+
+/** Retrieve the polygon with the given id from a polygon table
+ *
+ * @param table         The polygon table to retrieve the polygon from
+ * @param id            The polygon id (e.g. from ipmeta_record_t.polygon_ids)
+ * @return the polygon object, NULL if the table has no polygon with this id
+ */
+ipmeta_polygon_t *
+ipmeta_polygon_table_get_polygon_by_id(ipmeta_polygon_table_t *table,
+                                       uint32_t id);
+
 /** Retrieve a list of Polygon table objects
  *
  * @param provider       The provider to retrieve the polygon tables from
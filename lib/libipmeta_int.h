@@ -40,6 +40,8 @@
 #include "khash.h"
 
 #include "libipmeta.h"
+#include "ipmeta_revidx.h"
+#include "ipmeta_strpool.h"
 
 /** @file
  *
@@ -51,6 +53,9 @@
 
 KHASH_MAP_INIT_INT(ipmeta_rechash, struct ipmeta_record *)
 
+/** Maps an aggregation key to the index of its entry in a record set */
+KHASH_MAP_INIT_INT64(ipmeta_aggrhash, size_t)
+
 /**
  * @name Internal Datastructures
  *
@@ -59,6 +64,9 @@ KHASH_MAP_INIT_INT(ipmeta_rechash, struct ipmeta_record *)
  *
  * @{ */
 
+/** Length of the country code prefix of the keys of ipmeta.regions */
+#define IPMETA_REGION_KEY_PREFIX_LEN 3
+
 /** Structure which holds state for a libipmeta instance */
 struct ipmeta {
 
@@ -70,6 +78,20 @@ struct ipmeta {
   struct ipmeta_ds *datastore;
 
   uint32_t all_provmask;
+
+  /** Pool of the attribute strings shared by the records of all providers */
+  ipmeta_strpool_t *strings;
+
+  /** Dictionary of regions (see ipmeta_record_t.region_id). Region codes are
+      only unique within a country, so the keys are the country code (padded
+      to 2 characters with spaces), a ':' and the region name. */
+  ipmeta_strdict_t *regions;
+
+  /** Dictionary of timezone names (see ipmeta_record_t.timezone_id) */
+  ipmeta_strdict_t *timezones;
+
+  /** Reverse indexes (NULL unless ipmeta_build_reverse_indexes was called) */
+  ipmeta_revidx_t *revidx;
 };
 
 /** Structure which holds a set of records, returned by a query */
@@ -81,6 +103,26 @@ struct ipmeta_record_set {
 
   size_t _cursor;
   size_t _alloc_size;
+
+  /** How matches are aggregated (see ipmeta_record_set_set_aggregation) */
+  ipmeta_aggr_t aggr;
+
+  /** The attribute to aggregate by, for IPMETA_AGGR_ATTR */
+  ipmeta_attr_t aggr_attr;
+
+  /** Index of the entry of each aggregation key (only used when aggregating)
+   */
+  khash_t(ipmeta_aggrhash) * aggr_index;
+
+  /** If set, matches are passed to this callback instead of being stored
+   * (see ipmeta_lookup_pfx_iter) */
+  ipmeta_lookup_pfx_cb_t *sink;
+
+  /** The user pointer to pass to the sink */
+  void *sink_user;
+
+  /** Set if the sink asked to stop */
+  int sink_stopped;
 };
 
 /** @} */
@@ -98,6 +140,27 @@ struct ipmeta_record_set {
 int ipmeta_record_set_add_record(ipmeta_record_set_t *record_set,
                                  ipmeta_record_t *rec, uint64_t num_ips);
 
+/** Add a match for (part of) a prefix lookup to a record set
+ *
+ * @param record_set    The record set instance to add the match to
+ * @param rec           The record that was matched
+ * @param num_ips       The number of IPv4 addresses or IPv6 /64 subnets
+ *                      matched in this record
+ * @param family        The address family of the matched prefix
+ * @param addrp         Pointer to the (network byte order) address of the
+ *                      matched prefix (bits beyond pfxlen are ignored)
+ * @param pfxlen        The length of the matched prefix
+ *
+ * @return 0 if successful, or -1 if realloc failed or the sink of the set
+ * asked to stop
+ *
+ * The prefix is only used when the set has a sink, otherwise this is the same
+ * as ipmeta_record_set_add_record.
+ */
+int ipmeta_record_set_add_match(ipmeta_record_set_t *record_set,
+                                ipmeta_record_t *rec, uint64_t num_ips,
+                                int family, const void *addrp, uint8_t pfxlen);
+
 /** Empties the set.
  *
  * @param record_set    The record set instance to clear the records for
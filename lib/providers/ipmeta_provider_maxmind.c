@@ -48,9 +48,9 @@
 
 #include "khash.h"
 #include "utils.h"
-#include "csv.h"
 #include "ipvx_utils.h"
 
+#include "ipmeta_csv.h"
 #include "ipmeta_ds.h"
 #include "ipmeta_provider_maxmind.h"
 
@@ -93,14 +93,14 @@ typedef struct ipmeta_provider_maxmind_state {
   char *locations_file;
   char *blocks_file[8];
   int blocks_file_cnt;
+  int dedup_records; // share one record between identical v2 blocks
 
   /* State for CSV parser */
-  struct csv_parser parser;
   const char *current_filename;
   int current_line;
   int current_column; // column ID (not column number)
   int first_column; // ID of first column for the current file format
-  void (*parse_row)(int, void *);
+  int (*parse_row)(ipmeta_provider_t *, ipmeta_csv_row_t *);
   ipmeta_record_t *record;
   uint32_t loc_id;
   ipvx_prefix_t block_lower; // v1: low end of range; v2: prefix
@@ -116,6 +116,7 @@ typedef struct ipmeta_provider_maxmind_state {
   khash_t(ipm_records) *loc_records;
 
   uint32_t block_cnt; // for v2
+  ipmeta_record_t blk_record; // v2 block being parsed
 } ipmeta_provider_maxmind_state_t;
 
 enum { FILETYPE_BLK, FILETYPE_LOC };
@@ -192,10 +193,12 @@ static void usage(ipmeta_provider_t *provider)
 {
   fprintf(
     stderr,
-    "provider usage: %s {-l locations -b blocks}|{-d directory}\n"
+    "provider usage: %s {-l locations -b blocks}|{-d directory} [-u]\n"
     "   -d <dir>    directory containing v1 blocks and location files\n"
     "   -l <file>   v1 or v2 locations file (requires -b)\n"
-    "   -b <file>   v1 or v2 blocks file (requires -l; may be repeated)\n",
+    "   -b <file>   v1 or v2 blocks file (requires -l; may be repeated)\n"
+    "   -u          share one record between v2 blocks with identical\n"
+    "               attributes (record ids are then no longer per-block)\n",
     provider->name);
 }
 
@@ -219,7 +222,7 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
 
   /* remember the argv strings DO NOT belong to us */
 
-  while ((opt = getopt(argc, argv, "b:d:D:l:?")) >= 0) {
+  while ((opt = getopt(argc, argv, "b:d:D:l:u?")) >= 0) {
     switch (opt) {
     case 'b':
       if (state->blocks_file_cnt >= ARR_CNT(state->blocks_file)) {
@@ -249,6 +252,10 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
       state->locations_file = strdup(optarg);
       break;
 
+    case 'u':
+      state->dedup_records = 1;
+      break;
+
     case '?':
     case ':':
     default:
@@ -318,8 +325,7 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
     ipmeta_log(__func__, "ERROR: " fmt " at %s:%d:%d",                         \
       __VA_ARGS__, (state)->current_filename, (state)->current_line,           \
       state->current_column % 1000);                                           \
-    (state)->parser.status = CSV_EUSER;                                        \
-    return;                                                                    \
+    return -1;                                                                 \
   } while (0)
 
 // Handle a row error.  (Requires at least 3 arguments.)
@@ -327,8 +333,7 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
   do {                                                                         \
     ipmeta_log(__func__, "ERROR: " fmt " at %s:%d",                            \
       __VA_ARGS__, (state)->current_filename, (state)->current_line);          \
-    (state)->parser.status = CSV_EUSER;                                        \
-    return;                                                                    \
+    return -1;                                                                 \
   } while (0)
 
 // Handle an invalid column value.
@@ -341,25 +346,37 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
     }                                                                          \
   } while (0)
 
-// strdup a non-NULL column value and handle error.  type must be row or col.
-#define coldup(state, type, dst, src)                                          \
-  if ((src) && !((dst) = strdup(src))) {                                       \
+// Intern a non-NULL column value and handle error.  type must be row or col.
+#define colintern(provider, state, type, dst, src)                             \
+  if ((src) && !((dst) = ipmeta_provider_intern((provider), (src)))) {         \
     type##_error((state), "Out of memory for \"%s\"", (src));                  \
   } else (void)0 /* this makes a semicolon after it valid */
 
-#define check_column_count(state, endcol)                                      \
-  if ((state)->current_column != (endcol)) {                                   \
+#define check_column_count(state, row, endcol)                                 \
+  if ((row)->fields_cnt != (endcol) - (state)->first_column) {                 \
     row_error((state), "Expected %d columns, found %d",                        \
-      (endcol) % 1000, (state)->current_column % 1000);                        \
+      (endcol) - (state)->first_column, (row)->fields_cnt);                    \
   } else (void)0 /* this makes a semicolon after it valid */
 
+// Parse each cell of a row.
+#define parse_cells(provider, state, row)                                      \
+  do {                                                                         \
+    int col;                                                                   \
+    for (col = 0; col < (row)->fields_cnt; col++) {                            \
+      (state)->current_column = (state)->first_column + col;                   \
+      if (parse_maxmind_cell((provider), (row)->fields[col],                   \
+            (row)->lens[col]) != 0) {                                          \
+        return -1;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
 /* Parse a maxmind cell */
-static void parse_maxmind_cell(void *s, size_t i, void *data)
+static int parse_maxmind_cell(ipmeta_provider_t *provider, char *tok,
+    size_t len)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
-  char *tok = (char *)s;
-  char *end;
+  uint32_t tmp_u32;
 
   /*
   ipmeta_log(__func__, "row: %d, column: %d, tok: %s",
@@ -373,9 +390,8 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   switch (state->current_column) {
   case LOCATION1_COL_ID:
   case LOCATION2_COL_GNID:
-    state->record = malloc_zero(sizeof(ipmeta_record_t));
-    rec->id = strtoul(tok, &end, 10);
-    if (end == tok || *end || errno == ERANGE) {
+    state->record = ipmeta_provider_alloc_record(provider);
+    if (ipmeta_csv_parse_u32(tok, len, &rec->id) != 0) {
       col_invalid(state, "Invalid ID", tok);
     }
     break;
@@ -413,7 +429,7 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION1_COL_REGION:
   case LOCATION2_COL_SUBDIV1_CODE:
     /* region string */
-    coldup(state, col, rec->region, tok);
+    colintern(provider, state, col, rec->region, tok);
     break;
 
   case LOCATION2_COL_SUBDIV1_NAME:
@@ -424,7 +440,7 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION1_COL_CITY:
   case LOCATION2_COL_CITY_NAME:
     /* city */
-    coldup(state, col, rec->city, tok);
+    colintern(provider, state, col, rec->city, tok);
     break;
 
   case BLOCKS2_COL_POSTAL:
@@ -433,7 +449,7 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
     // fall through
   case LOCATION1_COL_POSTAL:
     /* postal code */
-    coldup(state, col, rec->post_code, tok);
+    colintern(provider, state, col, rec->post_code, tok);
     break;
 
   case BLOCKS2_COL_LAT:
@@ -443,8 +459,8 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION1_COL_LAT:
     /* latitude */
     if (tok && *tok) {
-        rec->latitude = strtod(tok, &end);
-        if (end == tok || *end || rec->latitude < -90 || rec->latitude > 90) {
+        if (ipmeta_csv_parse_double(tok, len, &rec->latitude) != 0 ||
+            rec->latitude < -90 || rec->latitude > 90) {
           col_invalid(state, "Invalid latitude", tok);
         }
     } else {
@@ -461,7 +477,6 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
          * a possibly valid GNID.
          */
         state->loc_id = 0;
-        free(state->record);
         state->record = NULL;
     }
     break;
@@ -473,8 +488,8 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION1_COL_LONG:
     /* longitude */
     if (tok && *tok) {
-        rec->longitude = strtod(tok, &end);
-        if (end == tok || *end || rec->longitude < -180 || rec->longitude > 180) {
+        if (ipmeta_csv_parse_double(tok, len, &rec->longitude) != 0 ||
+            rec->longitude < -180 || rec->longitude > 180) {
           col_invalid(state, "Invalid longitude", tok);
         }
     } else {
@@ -483,7 +498,6 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
          * empty. Drop any row with a GNID but without other useful values.
          */
         state->loc_id = 0;
-        free(state->record);
         state->record = NULL;
     }
     break;
@@ -492,8 +506,7 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION2_COL_METRO_CODE:
     /* metro code - whatever the heck that is */
     if (tok && *tok) {
-      rec->metro_code = strtoul(tok, &end, 10);
-      if (end == tok || *end || errno == ERANGE) {
+      if (ipmeta_csv_parse_u32(tok, len, &rec->metro_code) != 0) {
         col_invalid(state, "Invalid metro code", tok);
       }
     } // else, empty field is 0
@@ -502,15 +515,14 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
   case LOCATION1_COL_AREA:
     /* area code - (phone) */
     if (tok && *tok) {
-      rec->area_code = strtoul(tok, &end, 10);
-      if (end == tok || *end || errno == ERANGE) {
+      if (ipmeta_csv_parse_u32(tok, len, &rec->area_code) != 0) {
         col_invalid(state, "Invalid area code", tok);
       }
     } // else, empty field is 0
     break;
 
   case LOCATION2_COL_TIMEZONE:
-    coldup(state, col, rec->timezone, tok);
+    colintern(provider, state, col, rec->timezone, tok);
     break;
 
   case LOCATION2_COL_IS_IN_EU:
@@ -520,27 +532,28 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
     if (!rec)
       break; // ignore this record because it had no GNID or was malformed
     if (tok && *tok) {
-      rec->accuracy = strtoul(tok, &end, 10);
-      if (end == tok || *end || rec->accuracy > EARTH_CIRCUMFERENCE / 4) {
+      if (ipmeta_csv_parse_u32(tok, len, &tmp_u32) != 0 ||
+          tmp_u32 > EARTH_CIRCUMFERENCE / 4) {
         col_invalid(state, "Invalid accuracy radius", tok);
       }
+      rec->accuracy = tmp_u32;
     } // else, empty field is 0
     break;
 
   case BLOCKS1_COL_STARTIP:
     /* start ip */
-    state->block_lower.addr.v4.s_addr = htonl(strtoul(tok, &end, 10));
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &tmp_u32) != 0) {
       col_invalid(state, "Invalid start IP", tok);
     }
+    state->block_lower.addr.v4.s_addr = htonl(tmp_u32);
     break;
 
   case BLOCKS1_COL_ENDIP:
     /* end ip */
-    state->block_upper.addr.v4.s_addr = htonl(strtoul(tok, &end, 10));
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &tmp_u32) != 0) {
       col_invalid(state, "Invalid end IP", tok);
     }
+    state->block_upper.addr.v4.s_addr = htonl(tmp_u32);
     break;
 
   case BLOCKS2_COL_NETWORK:
@@ -557,13 +570,14 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
       state->loc_id = 0;
       break;
     }
-    // Now we know we'll need state->record.
-    state->record = malloc_zero(sizeof(ipmeta_record_t));
+    // Now we know we'll need state->record.  It is only copied into the
+    // provider once the whole row has been parsed (see parse_blocks2_row).
+    memset(&state->blk_record, 0, sizeof(ipmeta_record_t));
+    state->record = &state->blk_record;
     // fall through
   case BLOCKS1_COL_ID:
     // location id (foreign key)
-    state->loc_id = strtoul(tok, &end, 10);
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &state->loc_id) != 0) {
       col_invalid(state, "Invalid ID", tok);
     }
     break;
@@ -580,20 +594,20 @@ static void parse_maxmind_cell(void *s, size_t i, void *data)
 
 #undef rec
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-/** Handle an end-of-row event from the CSV parser */
-static void parse_maxmind_location1_row(int c, void *data)
+/** Parse a v1 locations row */
+static int parse_maxmind_location1_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
 
   khiter_t khiter;
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, LOCATION1_COL_ENDCOL);
+  check_column_count(state, row, LOCATION1_COL_ENDCOL);
+  parse_cells(provider, state, row);
 
   /* look up the continent code */
   char *cc = state->record->country_code;
@@ -605,26 +619,28 @@ static void parse_maxmind_location1_row(int c, void *data)
   uint16_t u16_continent = kh_value(state->country_continent, khiter);
   u16_to_c2(u16_continent, state->record->continent_code);
 
-  ipmeta_provider_insert_record(provider, state->record);
+  if (ipmeta_provider_insert_record(provider, state->record) == NULL) {
+    row_error(state, "%s", "Failed to insert record");
+  }
 
   // reset for next record
   state->current_line++;
-  state->current_column = state->first_column;
   state->record = NULL;
 
-  return;
+  return 0;
 }
 
-static void parse_blocks1_row(int c, void *data)
+static int parse_blocks1_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
 
   ipvx_prefix_list_t *pfx_list, *pfx_node;
   ipmeta_record_t *record = NULL;
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, BLOCKS1_COL_ENDCOL);
+  check_column_count(state, row, BLOCKS1_COL_ENDCOL);
+  parse_cells(provider, state, row);
 
   assert(state->loc_id > 0);
 
@@ -652,18 +668,20 @@ static void parse_blocks1_row(int c, void *data)
 
   // reset for next record
   state->current_line++;
-  state->current_column = state->first_column;
   state->loc_id = 0;
+
+  return 0;
 }
 
-static void parse_maxmind_location2_row(int c, void *data)
+static int parse_maxmind_location2_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
   int khret;
 
   // make sure we parsed exactly as many columns as we anticipated
-  check_column_count(state, LOCATION2_COL_ENDCOL);
+  check_column_count(state, row, LOCATION2_COL_ENDCOL);
+  parse_cells(provider, state, row);
 
   // In maxmind v2, location information is split across location and block
   // records.  We store this incomplete location record in state->loc_records,
@@ -675,55 +693,73 @@ static void parse_maxmind_location2_row(int c, void *data)
 
   // reset for next record
   state->current_line++;
-  state->current_column = state->first_column;
 
-  return;
+  return 0;
 }
 
-static void parse_blocks2_row(int c, void *data)
+static int parse_blocks2_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
 
   // make sure we parsed exactly as many columns as we anticipated
-  check_column_count(state, BLOCKS2_COL_ENDCOL);
+  check_column_count(state, row, BLOCKS2_COL_ENDCOL);
+  parse_cells(provider, state, row);
 
   ipmeta_record_t *blk_rec = state->record;
+  ipmeta_record_t *rec;
   if (!state->record)
     goto end; // we're ignoring this record because it had no GNID
 
-  blk_rec->id = ++state->block_cnt;
-
-  ipmeta_provider_insert_record(provider, blk_rec);
-
   // Copy fields from the loc record to the block record.  (We can't just use
   // a single record structure, because multiple block records may refer to
   // the same location record).
   khiter_t k = kh_get(ipm_records, state->loc_records, state->loc_id);
   ipmeta_record_t *loc_rec = kh_val(state->loc_records, k);
 
-  // coldup(state, row, blk_rec->locale_code, loc_rec->locale_code);
+  // The strings are interned, so they can simply be shared with loc_rec.
   memcpy(blk_rec->continent_code, loc_rec->continent_code, 2);
   memcpy(blk_rec->country_code, loc_rec->country_code, 2);
-  coldup(state, row, blk_rec->region, loc_rec->region);
-  coldup(state, row, blk_rec->city, loc_rec->city);
+  blk_rec->region = loc_rec->region;
+  blk_rec->city = loc_rec->city;
   blk_rec->metro_code = loc_rec->metro_code;
-  coldup(state, row, blk_rec->timezone, loc_rec->timezone);
-  // TODO: Share the strings with loc_rec instead of duplicating them.
+  blk_rec->timezone = loc_rec->timezone;
+
+  if (state->dedup_records &&
+      (rec = ipmeta_provider_find_identical_record(provider, blk_rec)) !=
+        NULL) {
+    // an earlier block has exactly the same attributes
+    blk_rec = rec;
+  } else {
+    if ((rec = ipmeta_provider_alloc_record(provider)) == NULL) {
+      row_error(state, "%s", "Could not allocate record");
+    }
+    memcpy(rec, blk_rec, sizeof(ipmeta_record_t));
+    blk_rec = rec;
+    blk_rec->id = ++state->block_cnt;
+
+    if (ipmeta_provider_insert_record(provider, blk_rec) == NULL) {
+      row_error(state, "%s", "Failed to insert record");
+    }
+    if (state->dedup_records &&
+        ipmeta_provider_register_unique_record(provider, blk_rec) != 0) {
+      row_error(state, "%s", "Failed to register record");
+    }
+  }
 
   // add prefix to the trie
   if (ipmeta_provider_associate_record(provider, state->block_lower.family,
         &state->block_lower.addr, state->block_lower.masklen, blk_rec) != 0) {
     row_error(state, "%s", "Failed to associate record");
-    return;
   }
 
 end:
   // reset for next record
   state->current_line++;
-  state->current_column = state->first_column;
   state->record = NULL;
   state->loc_id = 0;
+
+  return 0;
 }
 
 #define startswith(buf, str)  (strncmp(buf, str "", sizeof(str)-1) == 0)
@@ -735,6 +771,8 @@ static int read_maxmind_file(ipmeta_provider_t *provider, int filetype,
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
   char buffer[BUFFER_LEN];
   io_t *file;
+  ipmeta_csv_t *csv = NULL;
+  ipmeta_csv_row_t *row;
   int read = 0;
   int rc = -1; // fail, until proven otherwise
   int found_type = -1;
@@ -840,35 +878,25 @@ static int read_maxmind_file(ipmeta_provider_t *provider, int filetype,
   }
   state->maxmind_version = found_version;
 
-  csv_init(&(state->parser), CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI |
-      CSV_APPEND_NULL | CSV_EMPTY_IS_NULL);
+  if ((csv = ipmeta_csv_init(file)) == NULL) {
+    goto end;
+  }
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
-    if (csv_parse(&(state->parser), buffer, read, parse_maxmind_cell,
-                  state->parse_row, provider) != read) {
-      ipmeta_log(__func__, "Error parsing %s file", provider->name);
-      ipmeta_log(__func__, "CSV Error: %s",
-                 csv_strerror(csv_error(&(state->parser))));
-      goto end;
+  while ((read = ipmeta_csv_read_row(csv, &row)) > 0) {
+    if (state->parse_row(provider, row) != 0) {
+      read = -1;
+      break;
     }
   }
   if (read < 0) {
-    ipmeta_log(__func__, "Error reading file %s", filename);
-    goto end;
-  }
-
-  if (csv_fini(&(state->parser), parse_maxmind_cell, state->parse_row,
-        provider) != 0) {
     ipmeta_log(__func__, "Error parsing %s file %s", provider->name, filename);
-    ipmeta_log(__func__, "CSV Error: %s",
-               csv_strerror(csv_error(&(state->parser))));
     goto end;
   }
 
   rc = 0; // success
 
 end:
-  csv_free(&(state->parser));
+  ipmeta_csv_free(csv);
   wandio_destroy(file);
   return rc;
 }
@@ -1598,7 +1626,7 @@ void ipmeta_provider_maxmind_free(ipmeta_provider_t *provider)
     }
 
     if (state->loc_records) {
-      kh_free_vals(ipm_records, state->loc_records, ipmeta_free_record);
+      /* the records themselves live in the provider's arena */
       kh_destroy(ipm_records, state->loc_records);
       state->loc_records = NULL;
     }
@@ -1622,6 +1650,12 @@ int ipmeta_provider_maxmind_lookup_addr(ipmeta_provider_t *provider, int family,
   return ipmeta_provider_lookup_addr(provider, family, addrp, found);
 }
 
+int ipmeta_provider_maxmind_finalize(ipmeta_provider_t *provider)
+{
+  /* nothing to do */
+  return 0;
+}
+
 /* ========== HELPER FUNCTIONS ========== */
 
 int ipmeta_provider_maxmind_get_iso2_list(const char ***countries)
@@ -40,6 +40,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,9 +51,9 @@
 
 #include "khash.h"
 #include "utils.h"
-#include "csv.h"
 #include "ipvx_utils.h"
 
+#include "ipmeta_csv.h"
 #include "ipmeta_ds.h"
 #include "ipmeta_provider_netacq_edge.h"
 
@@ -59,8 +61,6 @@
 
 #define STATE(provname) (IPMETA_PROVIDER_STATE(netacq_edge, provname))
 
-#define BUFFER_LEN 1024
-
 #define POLYGON_FILE_CNT_MAX 8 /* increase as you like */
 
 #pragma GCC diagnostic ignored "-Wtrigraphs"
@@ -80,6 +80,31 @@ typedef struct na_to_polygon {
 
 } na_to_polygon_t;
 
+/** A tuple of polygon ids (one per polygon table) */
+typedef struct polygon_ids_key {
+  uint32_t *ids;
+  int cnt;
+} polygon_ids_key_t;
+
+static inline khint_t polygon_ids_hash(polygon_ids_key_t key)
+{
+  khint_t h = (khint_t)key.cnt;
+  int i;
+
+  for (i = 0; i < key.cnt; i++) {
+    h = (h << 5) - h + kh_int_hash_func(key.ids[i]);
+  }
+  return h;
+}
+
+#define polygon_ids_equal(a, b)                                                \
+  ((a).cnt == (b).cnt &&                                                       \
+   memcmp((a).ids, (b).ids, sizeof(uint32_t) * (a).cnt) == 0)
+
+/** Set of the distinct polygon id tuples */
+KHASH_INIT(polyids, polygon_ids_key_t, char, 0, polygon_ids_hash,
+           polygon_ids_equal)
+
 /** Holds the state for an instance of this provider */
 typedef struct ipmeta_provider_netacq_edge_state {
 
@@ -92,25 +117,39 @@ typedef struct ipmeta_provider_netacq_edge_state {
   char *polygon_files[POLYGON_FILE_CNT_MAX];
   int polygon_files_cnt;
   char *na_to_polygon_file;
+  int dedup_records; /* share one record between identical locations */
 
   /* array of region decode info */
   ipmeta_provider_netacq_edge_region_t **regions;
   int regions_cnt;
 
+  /* regions indexed by code (NULL if the codes are too sparse) */
+  ipmeta_provider_netacq_edge_region_t **regions_by_code;
+  uint32_t regions_by_code_len;
+
   /* array of country decode info */
   ipmeta_provider_netacq_edge_country_t **countries;
   int countries_cnt;
 
+  /* countries indexed by code (NULL if the codes are too sparse) */
+  ipmeta_provider_netacq_edge_country_t **countries_by_code;
+  uint32_t countries_by_code_len;
+
   /* array of polygon decode info */
   ipmeta_polygon_table_t **polygon_tables;
   int polygon_tables_cnt;
 
-  /* temp mapping array of netacq2polygon info (one per locid) */
-  na_to_polygon_t **na_to_polygons;
+  /* temp mapping array of netacq2polygon info (indexed by locid, NULL if the
+     location has no polygons). Each entry points to a polygon id tuple that
+     is shared by all locations in the same polygons. */
+  uint32_t **na_to_polygons;
   int na_to_polygons_cnt;
+  int na_to_polygons_alloc;
+
+  /* temp set of the distinct polygon id tuples */
+  khash_t(polyids) *polygon_ids_set;
 
   /* State for CSV parser */
-  struct csv_parser parser;
   int current_line;
   int current_column; // column ID (not column number)
   ipmeta_record_t tmp_record;
@@ -273,7 +312,9 @@ static void usage(ipmeta_provider_t *provider)
           "       -p <file>     netacq2polygon mapping file\n"
           "       -t <file>     polygon table file\n"
           "                       (can be used up to %d times to specify "
-          "multiple tables)\n",
+          "multiple tables)\n"
+          "       -u            share one record between ipv6 rows (and ipv4\n"
+          "                       locations) with identical attributes\n",
           provider->name, POLYGON_FILE_CNT_MAX);
 }
 
@@ -296,7 +337,7 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
 
   /* remember the argv strings DO NOT belong to us */
 
-  while ((opt = getopt(argc, argv, "b:c:D:l:6:r:p:t:?")) >= 0) {
+  while ((opt = getopt(argc, argv, "b:c:D:l:6:r:p:t:u?")) >= 0) {
     switch (opt) {
     case 'b':
       state->blocks_file = strdup(optarg);
@@ -332,6 +373,10 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
       state->polygon_files[state->polygon_files_cnt++] = strdup(optarg);
       break;
 
+    case 'u':
+      state->dedup_records = 1;
+      break;
+
     case '?':
     case ':':
     default:
@@ -358,71 +403,67 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
 
 static int read_netacq_edge_file(ipmeta_provider_t *provider, io_t *file,
     const char *label,
-    void (*parse_cell)(void *, size_t, void *),
-    void (*parse_row)(int, void *))
+    int (*parse_row)(ipmeta_provider_t *, ipmeta_csv_row_t *))
 {
-  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-
-  char buffer[BUFFER_LEN];
-  int read = 0;
-
-  csv_init(&(state->parser), CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI |
-      CSV_APPEND_NULL | CSV_EMPTY_IS_NULL);
+  ipmeta_csv_t *csv;
+  ipmeta_csv_row_t *row;
+  int rc;
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
-    if (csv_parse(&(state->parser), buffer, read, parse_cell, parse_row,
-          provider) != read) {
-      ipmeta_log(__func__, "Error parsing %s %s file", provider->name, label);
-      ipmeta_log(__func__, "CSV Error: %s",
-                 csv_strerror(csv_error(&(state->parser))));
-      return -1;
-    }
-  }
-  if (read < 0) {
-    ipmeta_log(__func__, "Error reading %s file", label);
+  if ((csv = ipmeta_csv_init(file)) == NULL) {
     return -1;
   }
 
-  if (csv_fini(&(state->parser), parse_cell, parse_row, provider) != 0) {
+  while ((rc = ipmeta_csv_read_row(csv, &row)) > 0) {
+    if (parse_row(provider, row) != 0) {
+      rc = -1;
+      break;
+    }
+  }
+  if (rc < 0) {
     ipmeta_log(__func__, "Error parsing %s %s file", provider->name, label);
-    ipmeta_log(__func__, "CSV Error: %s",
-               csv_strerror(csv_error(&(state->parser))));
-    return -1;
   }
 
-  csv_free(&(state->parser));
-  return 0;
+  ipmeta_csv_free(csv);
+  return rc;
 }
 
 #define log_invalid_col(state, label, tok) \
     ipmeta_log(__func__, "%s \"%s\" at %d:%d", label, tok ? tok : "(empty)",   \
         state->current_line, state->current_column % 1000)
 
-#define check_column_count(state, label, endcol)                               \
-  if ((state)->current_column != (endcol)) {                                   \
+#define check_column_count(state, label, row, firstcol, endcol)                \
+  if ((row)->fields_cnt != (endcol) - (firstcol)) {                            \
     ipmeta_log(__func__,                                                       \
       "ERROR in %s file, line %d: Expected %d columns, found %d", label,       \
-      (state)->current_line, (endcol) % 1000, (state)->current_column % 1000); \
-    (state)->parser.status = CSV_EUSER;                                        \
-    return;                                                                    \
+      (state)->current_line, (endcol) - (firstcol), (row)->fields_cnt);        \
+    return -1;                                                                 \
   } else (void)0 /* this is here to make a semicolon after it valid */
 
+/** The locations columns that are parsed (all others are skipped) */
+static const int location_used_cols[] = {
+  LOCATION_COL_ID,    LOCATION_COL_CC,       LOCATION_COL_REGION,
+  LOCATION_COL_CITY,  LOCATION_COL_POSTAL,   LOCATION_COL_LAT,
+  LOCATION_COL_LONG,  LOCATION_COL_METRO,    LOCATION_COL_RCODE,
+  LOCATION_COL_CONTCODE, LOCATION_COL_CONN,
+};
+
+/** The ipv6 columns that are parsed (all others are skipped) */
+static const int ipv6_used_cols[] = {
+  IPV6_COL_STARTIPTEXT, IPV6_COL_ENDIPTEXT, IPV6_COL_CC,
+  IPV6_COL_REGION,      IPV6_COL_CITY,      IPV6_COL_LAT,
+  IPV6_COL_LONG,        IPV6_COL_POSTAL,    IPV6_COL_METRO,
+  IPV6_COL_RCODE,       IPV6_COL_CONTCODE,  IPV6_COL_CONN,
+};
+
 /* Parse a netacq_edge location cell or ipv6 cell */
-static void parse_location_or_ipv6_cell(void *s, size_t i, void *data)
+static int parse_location_or_ipv6_cell(ipmeta_provider_t *provider, char *tok,
+    size_t len)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
   ipmeta_record_t *tmp = &(state->tmp_record);
-  char *tok = (char *)s;
 
-  uint16_t tmp_continent;
-
-  char *end;
-
-  /* skip header */
-  if (state->current_line < HEADER_ROW_CNT) {
-    return;
-  }
+  uint32_t tmp_u32;
+  size_t i;
 
   /*
     ipmeta_log(__func__, "row: %d, column: %d, tok: %s",
@@ -434,39 +475,33 @@ static void parse_location_or_ipv6_cell(void *s, size_t i, void *data)
   switch (state->current_column) {
   case LOCATION_COL_ID:
     /* init this record */
-    tmp->id = strtoul(tok, &end, 10);
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &tmp->id) != 0) {
       log_invalid_col(state, "Invalid ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   case IPV6_COL_STARTIPTEXT:
-    if (inet_pton(AF_INET6, tok, &state->block_lower.addr.v6) != 1) {
+    if (tok == NULL ||
+        inet_pton(AF_INET6, tok, &state->block_lower.addr.v6) != 1) {
       log_invalid_col(state, "Invalid Start IP", tok);
-      state->parser.status = CSV_EUSER;
+      return -1;
     }
     break;
 
   case IPV6_COL_ENDIPTEXT:
-    if (inet_pton(AF_INET6, tok, &state->block_upper.addr.v6) != 1) {
+    if (tok == NULL ||
+        inet_pton(AF_INET6, tok, &state->block_upper.addr.v6) != 1) {
       log_invalid_col(state, "Invalid End IP", tok);
-      state->parser.status = CSV_EUSER;
+      return -1;
     }
     break;
 
-  case IPV6_COL_STARTIP:
-  case IPV6_COL_ENDIP:
-    break; // not used
-
   case LOCATION_COL_CC:
   case IPV6_COL_CC:
-    if (tok == NULL ||
-        ((strlen(tok) != 2) && !(strlen(tok) == 1 && tok[0] == '?'))) {
+    if (tok == NULL || ((len != 2) && !(len == 1 && tok[0] == '?'))) {
       log_invalid_col(state, "Invalid country code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     // ugly hax to s/uk/GB/ in country names
     if (tok[0] == 'u' && tok[1] == 'k') {
@@ -488,160 +523,144 @@ static void parse_location_or_ipv6_cell(void *s, size_t i, void *data)
   case IPV6_COL_REGION:
     if (tok == NULL) {
       log_invalid_col(state, "Invalid region code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     // s/*/?/g
-    for (i = 0; i < strlen(tok); i++) {
+    for (i = 0; i < len; i++) {
       if (tok[i] == '*') {
         tok[i] = '?';
       }
     }
-    if ((tmp->region = strdup(tok)) == NULL) {
+    if ((tmp->region = ipmeta_provider_intern(provider, tok)) == NULL) {
       ipmeta_log(__func__, "Region code copy failed (%s)", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   case LOCATION_COL_CITY:
   case IPV6_COL_CITY:
     if (tok != NULL) {
-      tmp->city = strndup(tok, strlen(tok));
+      tmp->city = ipmeta_provider_intern(provider, tok);
     }
     break;
 
   case LOCATION_COL_POSTAL:
   case IPV6_COL_POSTAL:
-    tmp->post_code = strndup(tok, strlen(tok));
+    if (tok != NULL) {
+      tmp->post_code = ipmeta_provider_intern(provider, tok);
+    }
     break;
 
   case LOCATION_COL_LAT:
   case IPV6_COL_LAT:
-    tmp->latitude = strtod(tok, &end);
-    if (end == tok || *end || tmp->latitude < -90 || tmp->latitude > 90) {
+    if (ipmeta_csv_parse_double(tok, len, &tmp->latitude) != 0 ||
+        tmp->latitude < -90 || tmp->latitude > 90) {
       log_invalid_col(state, "Invalid latitude", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   case LOCATION_COL_LONG:
   case IPV6_COL_LONG:
     /* longitude */
-    tmp->longitude = strtod(tok, &end);
-    if (end == tok || *end || tmp->longitude < -180 || tmp->longitude > 180) {
+    if (ipmeta_csv_parse_double(tok, len, &tmp->longitude) != 0 ||
+        tmp->longitude < -180 || tmp->longitude > 180) {
       log_invalid_col(state, "Invalid longitude", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   case LOCATION_COL_METRO:
   case IPV6_COL_METRO:
     /* metro code - whatever the heck that is */
-    if (tok != NULL) {
-      tmp->metro_code = strtoul(tok, &end, 10);
-      if (end == tok || *end || errno == ERANGE) {
-        log_invalid_col(state, "Invalid metro code", tok);
-        state->parser.status = CSV_EUSER;
-        return;
-      }
+    if (tok != NULL &&
+        ipmeta_csv_parse_u32(tok, len, &tmp->metro_code) != 0) {
+      log_invalid_col(state, "Invalid metro code", tok);
+      return -1;
     }
     break;
 
-  case LOCATION_COL_AREACODES:
-  case IPV6_COL_AREACODES:
-  case LOCATION_COL_CC3:
-  case IPV6_COL_CC3:
-  case LOCATION_COL_CNTRYCODE:
-  case IPV6_COL_CNTRYCODE:
-    break;
-
   case LOCATION_COL_RCODE:
   case IPV6_COL_RCODE:
-    tmp->region_code = strtoul(tok, &end, 10);
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &tmp_u32) != 0) {
       log_invalid_col(state, "Invalid region code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
-    break;
-
-  case LOCATION_COL_CITYCODE:
-  case IPV6_COL_CITYCODE:
+    tmp->region_code = tmp_u32;
     break;
 
   case LOCATION_COL_CONTCODE:
   case IPV6_COL_CONTCODE:
     if (tok != NULL) {
-      tmp_continent = strtoul(tok, &end, 10);
-      if (end == tok || *end || tmp_continent > CONTINENT_MAX) {
+      if (ipmeta_csv_parse_u32(tok, len, &tmp_u32) != 0 ||
+          tmp_u32 > CONTINENT_MAX) {
         log_invalid_col(state, "Invalid continent code", tok);
-        state->parser.status = CSV_EUSER;
-        return;
+        return -1;
       }
-      memcpy(tmp->continent_code, continent_strings[tmp_continent], 2);
+      memcpy(tmp->continent_code, continent_strings[tmp_u32], 2);
     }
     break;
 
-  case LOCATION_COL_INTERNAL:
-  case IPV6_COL_INTERNAL:
-    break;
-
   case LOCATION_COL_CONN:
   case IPV6_COL_CONN:
     if (tok != NULL) {
-      tmp->conn_speed = strndup(tok, strlen(tok));
+      tmp->conn_speed = ipmeta_provider_intern(provider, tok);
     }
     break;
 
-  case LOCATION_COL_CNTRYCONF:
-  case IPV6_COL_CNTRYCONF:
-  case LOCATION_COL_REGCONF:
-  case IPV6_COL_REGCONF:
-  case LOCATION_COL_CITYCONF:
-  case IPV6_COL_CITYCONF:
-  case LOCATION_COL_POSTCONF:
-  case IPV6_COL_POSTCONF:
-  case LOCATION_COL_GMTOFF:
-  case IPV6_COL_GMTOFF:
-  case LOCATION_COL_INDST:
-  case IPV6_COL_INDST:
-    break;
-
   default:
-    log_invalid_col(state, "Unexpected trailing column", tok);
-    state->parser.status = CSV_EUSER;
-    return;
+    log_invalid_col(state, "Unexpected column", tok);
+    return -1;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-/** Handle an end-of-row event from the CSV parser */
-static void parse_location_row(int c, void *data)
+/** Parse the used columns of a location or ipv6 row */
+static int parse_location_or_ipv6_cols(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row, const int *cols, int cols_cnt)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  ipmeta_record_t *record;
+  int col;
   int i;
 
+  for (i = 0; i < cols_cnt; i++) {
+    state->current_column = cols[i];
+    col = cols[i] % 1000;
+    if (parse_location_or_ipv6_cell(provider, row->fields[col],
+          row->lens[col]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Parse a locations row */
+static int parse_location_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
+{
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  ipmeta_record_t *record;
+
   /* skip header */
   if (state->current_line < HEADER_ROW_CNT) {
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "locations", LOCATION_COL_ENDCOL);
+  check_column_count(state, "locations", row, LOCATION_COL_FIRSTCOL,
+                     LOCATION_COL_ENDCOL);
+
+  if (parse_location_or_ipv6_cols(provider, row, location_used_cols,
+        ARR_CNT(location_used_cols)) != 0) {
+    return -1;
+  }
 
   if ((record = ipmeta_provider_init_record(provider, state->tmp_record.id)) ==
       NULL) {
     ipmeta_log(__func__, "ERROR: Could not initialize meta record");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
 
   state->tmp_record.source = provider->id;
@@ -654,30 +673,26 @@ static void parse_location_row(int c, void *data)
   /* tag with polygon id, if there is a match in the netacq2polygons table */
   if ((record->id < state->na_to_polygons_cnt) &&
       state->na_to_polygons[record->id] != NULL) {
-    if ((record->polygon_ids =
-           malloc(sizeof(uint32_t) * state->polygon_tables_cnt)) == NULL) {
-      ipmeta_log(__func__, "ERROR: Could not allocate polygon ids array");
-      state->parser.status = CSV_EUSER;
-      return;
-    }
-
-    for (i = 0; i < state->polygon_tables_cnt; i++) {
-      record->polygon_ids[i] =
-        state->na_to_polygons[record->id]->polygon_ids[i];
-    }
+    /* the tuple lives in the provider's arena and is shared */
+    record->polygon_ids = state->na_to_polygons[record->id];
     record->polygon_ids_cnt = state->polygon_tables_cnt;
   }
 
+  /* let identical ipv6 rows reuse this record */
+  if (state->dedup_records &&
+      ipmeta_provider_register_unique_record(provider, record) != 0) {
+    ipmeta_log(__func__, "ERROR: Could not register meta record");
+    return -1;
+  }
+
   /* done processing the line */
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = LOCATION_COL_FIRSTCOL;
   /* reset the temp record */
   memset(&(state->tmp_record), 0, sizeof(ipmeta_record_t));
 
-  return;
+  return 0;
 }
 
 /** Read a locations file */
@@ -692,77 +707,78 @@ static int read_locations(ipmeta_provider_t *provider, io_t *file)
   assert(state->max_loc_id == 0);
 
   return read_netacq_edge_file(provider, file, "Location",
-      parse_location_or_ipv6_cell, parse_location_row);
+      parse_location_row);
 }
 
 /** Parse a blocks cell */
-static void parse_blocks_cell(void *s, size_t i, void *data)
+static int parse_blocks_cell(ipmeta_provider_t *provider, char *tok,
+    size_t len)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  char *tok = (char *)s;
-  char *end;
-
-  /* skip header */
-  if (state->current_line < HEADER_ROW_CNT) {
-    return;
-  }
+  uint32_t ip;
 
   switch (state->current_column) {
   case BLOCKS_COL_STARTIP:
     /* start ip */
-    state->block_lower.addr.v4.s_addr = htonl(strtoul(tok, &end, 10));
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &ip) != 0) {
       log_invalid_col(state, "Invalid start IP", tok);
-      state->parser.status = CSV_EUSER;
+      return -1;
     }
+    state->block_lower.addr.v4.s_addr = htonl(ip);
     break;
 
   case BLOCKS_COL_ENDIP:
     /* end ip */
-    state->block_upper.addr.v4.s_addr = htonl(strtoul(tok, &end, 10));
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &ip) != 0) {
       log_invalid_col(state, "Invalid end IP", tok);
-      state->parser.status = CSV_EUSER;
+      return -1;
     }
+    state->block_upper.addr.v4.s_addr = htonl(ip);
     break;
 
   case BLOCKS_COL_ID:
     /* id */
-    state->loc_id = strtoul(tok, &end, 10);
-    if (end == tok || *end || errno == ERANGE) {
+    if (ipmeta_csv_parse_u32(tok, len, &state->loc_id) != 0) {
       log_invalid_col(state, "Invalid ID", tok);
-      state->parser.status = CSV_EUSER;
+      return -1;
     }
     break;
 
   default:
     log_invalid_col(state, "Unexpected trailing column", tok);
-    state->parser.status = CSV_EUSER;
+    return -1;
     break;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-static void parse_blocks_row(int c, void *data)
+static int parse_blocks_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  int col;
 
   ipvx_prefix_list_t *pfx_list, *pfx_node;
   ipmeta_record_t *record = NULL;
 
   if (state->current_line < HEADER_ROW_CNT) {
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* done processing the line */
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "blocks", BLOCKS_COL_ENDCOL);
+  check_column_count(state, "blocks", row, BLOCKS_COL_FIRSTCOL,
+                     BLOCKS_COL_ENDCOL);
+
+  for (col = 0; col < row->fields_cnt; col++) {
+    state->current_column = BLOCKS_COL_FIRSTCOL + col;
+    if (parse_blocks_cell(provider, row->fields[col], row->lens[col]) != 0) {
+      return -1;
+    }
+  }
 
   assert(state->loc_id > 0);
 
@@ -770,8 +786,7 @@ static void parse_blocks_row(int c, void *data)
   if (ipvx_range_to_prefix(&state->block_lower, &state->block_upper, &pfx_list) !=
       0) {
     ipmeta_log(__func__, "ERROR: Could not convert range to pfxs");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
   assert(pfx_list != NULL);
 
@@ -780,8 +795,7 @@ static void parse_blocks_row(int c, void *data)
       NULL) {
     ipmeta_log(__func__, "ERROR: Missing record for location %d",
                state->loc_id);
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
 
   /* iterate over and add each prefix to the trie */
@@ -790,16 +804,15 @@ static void parse_blocks_row(int c, void *data)
     if (ipmeta_provider_associate_record(provider, pfx->family,
           &pfx->addr.v4, pfx->masklen, record) != 0) {
       ipmeta_log(__func__, "ERROR: Failed to associate record");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
   }
   ipvx_prefix_list_free(pfx_list);
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = BLOCKS_COL_FIRSTCOL;
+
+  return 0;
 }
 
 /** Read a blocks file  */
@@ -817,13 +830,13 @@ static int read_blocks(ipmeta_provider_t *provider, io_t *file)
   state->block_upper.masklen = 32;
 
   return read_netacq_edge_file(provider, file, "Blocks",
-      parse_blocks_cell, parse_blocks_row);
+      parse_blocks_row);
 }
 
-/** Handle an end-of-row event from the CSV parser */
-static void parse_ipv6_row(int c, void *data)
+/** Parse an ipv6 row */
+static int parse_ipv6_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
   ipvx_prefix_list_t *pfx_list, *pfx_node;
   ipmeta_record_t *record = NULL;
@@ -831,28 +844,45 @@ static void parse_ipv6_row(int c, void *data)
   /* skip header */
   if (state->current_line < HEADER_ROW_CNT) {
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "ipv6", IPV6_COL_ENDCOL);
+  check_column_count(state, "ipv6", row, IPV6_COL_FIRSTCOL,
+                     IPV6_COL_ENDCOL);
 
-  if ((record = ipmeta_provider_init_record(provider, state->loc_id)) ==
-      NULL) {
-    ipmeta_log(__func__, "ERROR: Could not initialize meta record");
-    state->parser.status = CSV_EUSER;
-    return;
+  if (parse_location_or_ipv6_cols(provider, row, ipv6_used_cols,
+        ARR_CNT(ipv6_used_cols)) != 0) {
+    return -1;
   }
 
-  state->tmp_record.source = provider->id;
-  memcpy(record, &(state->tmp_record), sizeof(ipmeta_record_t));
+  if (state->dedup_records &&
+      (record = ipmeta_provider_find_identical_record(
+         provider, &state->tmp_record)) != NULL) {
+    /* an earlier row (or ipv4 location) has exactly the same attributes */
+  } else {
+    if ((record = ipmeta_provider_init_record(provider, state->loc_id)) ==
+        NULL) {
+      ipmeta_log(__func__, "ERROR: Could not initialize meta record");
+      return -1;
+    }
+
+    state->tmp_record.source = provider->id;
+    memcpy(record, &(state->tmp_record), sizeof(ipmeta_record_t));
+
+    if (state->dedup_records &&
+        ipmeta_provider_register_unique_record(provider, record) != 0) {
+      ipmeta_log(__func__, "ERROR: Could not register meta record");
+      return -1;
+    }
+    state->loc_id++; // generate our own ids
+  }
 
   /* convert the range to prefixes */
   if (ipvx_range_to_prefix(&state->block_lower, &state->block_upper, &pfx_list) !=
       0) {
     ipmeta_log(__func__, "ERROR: Could not convert range to prefixes");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
   assert(pfx_list);
 
@@ -862,8 +892,7 @@ static void parse_ipv6_row(int c, void *data)
     if (ipmeta_provider_associate_record(provider, pfx->family,
           &pfx->addr.v6, pfx->masklen, record) != 0) {
       ipmeta_log(__func__, "ERROR: Failed to associate record");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
   }
   ipvx_prefix_list_free(pfx_list);
@@ -871,12 +900,10 @@ static void parse_ipv6_row(int c, void *data)
   /* reset the temp record */
   memset(&(state->tmp_record), 0, sizeof(ipmeta_record_t));
 
-  state->loc_id++; // generate our own ids
-
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = IPV6_COL_FIRSTCOL;
+
+  return 0;
 }
 
 /** Read a ipv6 file */
@@ -887,10 +914,9 @@ static int read_ipv6(ipmeta_provider_t *provider, io_t *file)
   /* reset the state variables before we start */
   state->current_column = IPV6_COL_FIRSTCOL;
   state->current_line = 0;
-  // The IPv4 loc_ids are (nearly) contiguous.  If we break this trend now,
-  // khash's linear probing would perform very poorly due to clustering of the
-  // default int_hash_func.  To maintain good performance, we must continue
-  // the contiguous trend with our self-generated IPv6 loc_ids.
+  // The IPv4 loc_ids are (nearly) contiguous, so the provider manager indexes
+  // records by id in a plain array.  Continue the contiguous trend with our
+  // self-generated IPv6 loc_ids so that they stay dense too.
   state->loc_id = state->max_loc_id + 1;
   state->block_lower.family = AF_INET6;
   state->block_upper.family = AF_INET6;
@@ -899,32 +925,24 @@ static int read_ipv6(ipmeta_provider_t *provider, io_t *file)
   memset(&(state->tmp_record), 0, sizeof(ipmeta_record_t));
 
   return read_netacq_edge_file(provider, file, "IPv6",
-      parse_location_or_ipv6_cell, parse_ipv6_row);
+      parse_ipv6_row);
 }
 
 /** Parse a regions cell */
-static void parse_regions_cell(void *s, size_t i, void *data)
+static int parse_regions_cell(ipmeta_provider_t *provider, char *tok)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  char *tok = (char *)s;
   char *end;
 
   int j;
   int len;
 
-  /* skip header */
-  if (state->current_line < HEADER_ROW_CNT) {
-    return;
-  }
-
   switch (state->current_column) {
   case REGION_COL_COUNTRY:
     /* country */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid ISO country code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     len = strnlen(tok, 3);
     for (j = 0; j < len; j++) {
@@ -941,8 +959,7 @@ static void parse_regions_cell(void *s, size_t i, void *data)
     /* region */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid ISO region code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
 
     /* remove the ***-? region and the ?-? regions */
@@ -969,8 +986,7 @@ static void parse_regions_cell(void *s, size_t i, void *data)
     /* description */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid description code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     state->tmp_region.name = strndup(tok, strlen(tok));
     break;
@@ -979,45 +995,51 @@ static void parse_regions_cell(void *s, size_t i, void *data)
     state->tmp_region.code = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   default:
     log_invalid_col(state, "Unexpected trailing column", tok);
-    state->parser.status = CSV_EUSER;
+    return -1;
     break;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-static void parse_regions_row(int c, void *data)
+static int parse_regions_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  int col;
 
   ipmeta_provider_netacq_edge_region_t *region = NULL;
 
   if (state->current_line < HEADER_ROW_CNT) {
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* done processing the line */
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "regions", REGION_COL_ENDCOL);
+  check_column_count(state, "regions", row, REGION_COL_FIRSTCOL,
+                     REGION_COL_ENDCOL);
+
+  for (col = 0; col < row->fields_cnt; col++) {
+    state->current_column = REGION_COL_FIRSTCOL + col;
+    if (parse_regions_cell(provider, row->fields[col]) != 0) {
+      return -1;
+    }
+  }
 
   if (state->tmp_region_ignore == 0) {
     /* copy the tmp region structure into a new struct */
     if ((region = malloc(sizeof(ipmeta_provider_netacq_edge_region_t))) ==
         NULL) {
       ipmeta_log(__func__, "ERROR: Could not allocate memory for region");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     memcpy(region, &(state->tmp_region),
            sizeof(ipmeta_provider_netacq_edge_region_t));
@@ -1027,8 +1049,7 @@ static void parse_regions_row(int c, void *data)
            state->regions, sizeof(ipmeta_provider_netacq_edge_region_t *) *
                              (state->regions_cnt + 1))) == NULL) {
       ipmeta_log(__func__, "ERROR: Could not allocate memory for region array");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     /* now poke it in */
     state->regions[state->regions_cnt++] = region;
@@ -1036,11 +1057,11 @@ static void parse_regions_row(int c, void *data)
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = REGION_COL_FIRSTCOL;
   /* reset the tmp region info */
   memset(&(state->tmp_region), 0, sizeof(ipmeta_provider_netacq_edge_region_t));
   state->tmp_region_ignore = 0;
+
+  return 0;
 }
 
 /** Read a region decode file  */
@@ -1055,31 +1076,23 @@ static int read_regions(ipmeta_provider_t *provider, io_t *file)
   state->tmp_region_ignore = 0;
 
   return read_netacq_edge_file(provider, file, "Regions",
-      parse_regions_cell, parse_regions_row);
+      parse_regions_row);
 }
 
 /** Parse a country cell */
-static void parse_country_cell(void *s, size_t i, void *data)
+static int parse_country_cell(ipmeta_provider_t *provider, char *tok)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  char *tok = (char *)s;
   char *end;
 
   int j;
 
-  /* skip header */
-  if (state->current_line < HEADER_ROW_CNT) {
-    return;
-  }
-
   switch (state->current_column) {
   case COUNTRY_COL_ISO3:
     /* country 3 char */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid ISO-3 country code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     if (tok[0] == '*' && tok[1] == '*' && tok[2] == '*') {
       state->tmp_country.iso3[0] = '?';
@@ -1101,8 +1114,7 @@ static void parse_country_cell(void *s, size_t i, void *data)
     /* country 2 char */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid ISO-2 country code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     // ugly hax to s/uk/GB/ in country names
     if (tok[0] == 'u' && tok[1] == 'k') {
@@ -1128,8 +1140,7 @@ static void parse_country_cell(void *s, size_t i, void *data)
     /* name */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid country name", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     state->tmp_country.name = strndup(tok, strlen(tok));
     break;
@@ -1138,8 +1149,7 @@ static void parse_country_cell(void *s, size_t i, void *data)
     state->tmp_country.regions = strtoul(tok, &end, 10);
     if (end == tok || *end || state->tmp_country.regions > 1) {
       log_invalid_col(state, "Invalid regions value", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
@@ -1147,8 +1157,7 @@ static void parse_country_cell(void *s, size_t i, void *data)
     state->tmp_country.continent_code = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid continent code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
@@ -1156,8 +1165,7 @@ static void parse_country_cell(void *s, size_t i, void *data)
     /* continent 2 char*/
     if (tok == NULL || strnlen(tok, 2) != 2) {
       log_invalid_col(state, "Invalid 2-char continent code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     // s/**/??/
     if (tok[0] == '*' && tok[1] == '*') {
@@ -1177,45 +1185,51 @@ static void parse_country_cell(void *s, size_t i, void *data)
     state->tmp_country.code = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid code", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
 
   default:
     log_invalid_col(state, "Unexpected trailing column", tok);
-    state->parser.status = CSV_EUSER;
+    return -1;
     break;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-static void parse_country_row(int c, void *data)
+static int parse_country_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  int col;
 
   ipmeta_provider_netacq_edge_country_t *country = NULL;
 
   if (state->current_line < HEADER_ROW_CNT) {
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* done processing the line */
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "country", COUNTRY_COL_ENDCOL);
+  check_column_count(state, "country", row, COUNTRY_COL_FIRSTCOL,
+                     COUNTRY_COL_ENDCOL);
+
+  for (col = 0; col < row->fields_cnt; col++) {
+    state->current_column = COUNTRY_COL_FIRSTCOL + col;
+    if (parse_country_cell(provider, row->fields[col]) != 0) {
+      return -1;
+    }
+  }
 
   if (state->tmp_country_ignore == 0) {
     /* copy the tmp country structure into a new struct */
     if ((country = malloc(sizeof(ipmeta_provider_netacq_edge_country_t))) ==
         NULL) {
       ipmeta_log(__func__, "ERROR: Could not allocate memory for country");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     memcpy(country, &(state->tmp_country),
            sizeof(ipmeta_provider_netacq_edge_country_t));
@@ -1226,8 +1240,7 @@ static void parse_country_row(int c, void *data)
                                (state->countries_cnt + 1))) == NULL) {
       ipmeta_log(__func__,
                  "ERROR: Could not allocate memory for country array");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     /* now poke it in */
     state->countries[state->countries_cnt++] = country;
@@ -1235,12 +1248,12 @@ static void parse_country_row(int c, void *data)
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = COUNTRY_COL_FIRSTCOL;
   /* reset the tmp country info */
   memset(&(state->tmp_country), 0,
          sizeof(ipmeta_provider_netacq_edge_country_t));
   state->tmp_country_ignore = 0;
+
+  return 0;
 }
 
 /** Read a country decode file  */
@@ -1256,15 +1269,13 @@ static int read_countries(ipmeta_provider_t *provider, io_t *file)
   state->tmp_country_ignore = 0;
 
   return read_netacq_edge_file(provider, file, "Country",
-      parse_country_cell, parse_country_row);
+      parse_country_row);
 }
 
 /* Parse a polygon decode table cell */
-static void parse_polygons_cell(void *s, size_t i, void *data)
+static int parse_polygons_cell(ipmeta_provider_t *provider, char *tok)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  char *tok = (char *)s;
   char *end;
   char *sfx;
 
@@ -1276,8 +1287,7 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
       /* create a new polygon table */
       if ((new_table = malloc_zero(sizeof(ipmeta_polygon_table_t))) == NULL) {
         ipmeta_log(__func__, "Cannot allocate polygon table (%s)", tok);
-        state->parser.status = CSV_EUSER;
-        return;
+        return -1;
       }
       /* we extract the table name from this column name */
       new_table->id = state->polygon_tables_cnt;
@@ -1288,8 +1298,7 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
       }
       if ((new_table->ascii_id = strdup(tok)) == NULL) {
         ipmeta_log(__func__, "Cannot allocate polygon table name");
-        state->parser.status = CSV_EUSER;
-        return;
+        return -1;
       }
 
       /* malloc some space in the table array for this table */
@@ -1298,16 +1307,14 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
                      sizeof(ipmeta_polygon_table_t *) *
                        (state->polygon_tables_cnt + 1))) == NULL) {
         ipmeta_log(__func__, "ERROR: Could not allocate polygon table array");
-        state->parser.status = CSV_EUSER;
-        return;
+        return -1;
       }
 
       state->polygon_tables[state->polygon_tables_cnt++] = new_table;
     }
     /* else, ignore the other column names, we don't care */
 
-    state->current_column++;
-    return;
+    return 0;
   }
 
   switch (state->current_column) {
@@ -1316,24 +1323,21 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
     state->tmp_polygon.id = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid polygon ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   case POLYGON_COL_NAME:
     /* Polygon name string */
     if ((state->tmp_polygon.name = strdup(tok == NULL ? "" : tok)) == NULL) {
       ipmeta_log(__func__, "Cannot allocate memory for Polygon name");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   case POLYGON_COL_FQID:
     /* Fully-Qualified ID */
     if ((state->tmp_polygon.fqid = strdup(tok == NULL ? "" : tok)) == NULL) {
       ipmeta_log(__func__, "Cannot allocate memory for Polygon FQID");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   case POLYGON_COL_USERCODE:
@@ -1341,8 +1345,7 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
     if ((state->tmp_polygon.usercode = strdup(tok == NULL ? "" : tok)) ==
         NULL) {
       ipmeta_log(__func__, "Cannot allocate memory for Polygon user code");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   default:
@@ -1350,25 +1353,31 @@ static void parse_polygons_cell(void *s, size_t i, void *data)
     break;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-/** Handle an end-of-row event for the polygon decode table*/
-static void parse_polygons_row(int c, void *data)
+/** Parse a polygon decode table row */
+static int parse_polygons_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  int col;
 
   ipmeta_polygon_table_t *table = NULL;
   ipmeta_polygon_t *polygon = NULL;
 
+  for (col = 0; col < row->fields_cnt; col++) {
+    state->current_column = POLYGON_COL_FIRSTCOL + col;
+    if (parse_polygons_cell(provider, row->fields[col]) != 0) {
+      return -1;
+    }
+  }
+
   /* process the header row */
   if (state->current_line == 0) {
     /* all is done by the col parser */
-    state->current_column = POLYGON_COL_FIRSTCOL;
     state->current_line++;
-    return;
+    return 0;
   }
 
   table = state->polygon_tables[state->polygon_tables_cnt - 1];
@@ -1377,13 +1386,13 @@ static void parse_polygons_row(int c, void *data)
   /* done processing the line */
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  check_column_count(state, "polygons", POLYGON_COL_ENDCOL);
+  check_column_count(state, "polygons", row, POLYGON_COL_FIRSTCOL,
+                     POLYGON_COL_ENDCOL);
 
   /* copy the tmp polygon struct into a new one */
   if ((polygon = malloc(sizeof(ipmeta_polygon_t))) == NULL) {
     ipmeta_log(__func__, "ERROR: Could not allocate memory for polygon");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
   memcpy(polygon, &(state->tmp_polygon), sizeof(ipmeta_polygon_t));
 
@@ -1392,18 +1401,17 @@ static void parse_polygons_row(int c, void *data)
          realloc(table->polygons, sizeof(ipmeta_polygon_t *) *
                                     (table->polygons_cnt + 1))) == NULL) {
     ipmeta_log(__func__, "ERROR: Could not allocate memory for polygon array");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
   /* now poke it in */
   table->polygons[table->polygons_cnt++] = polygon;
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = POLYGON_COL_FIRSTCOL;
   /* reset the tmp region info */
   memset(&(state->tmp_polygon), 0, sizeof(ipmeta_polygon_t));
+
+  return 0;
 }
 
 /** Read a polygon decode file */
@@ -1417,15 +1425,14 @@ static int read_polygons(ipmeta_provider_t *provider, io_t *file)
   memset(&(state->tmp_polygon), 0, sizeof(ipmeta_polygon_t));
 
   return read_netacq_edge_file(provider, file, "Polygons",
-      parse_polygons_cell, parse_polygons_row);
+      parse_polygons_row);
 }
 
 /* Parse a netacq2polygon table cell */
-static void parse_na_to_polygon_cell(void *s, size_t i, void *data)
+static int parse_na_to_polygon_cell(ipmeta_provider_t *provider, char *tok)
 {
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
-  char *tok = (char *)s;
+  int i;
   char *end;
   char *sfx;
   int found = 0;
@@ -1450,13 +1457,11 @@ static void parse_na_to_polygon_cell(void *s, size_t i, void *data)
 
       if (found == 0) {
         ipmeta_log(__func__, "Missing Polygon Table for (%s)", tok);
-        state->parser.status = CSV_EUSER;
-        return;
+        return -1;
       }
     }
 
-    state->current_column++;
-    return;
+    return 0;
   }
 
   switch (state->current_column) {
@@ -1464,103 +1469,143 @@ static void parse_na_to_polygon_cell(void *s, size_t i, void *data)
     /* Netacq id */
     if (tok == NULL) {
       log_invalid_col(state, "Invalid Net Acuity ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     state->tmp_na_to_polygon.na_loc_id = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid Net Acuity ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   default:
     table_id = state->tmp_na_col_to_tbl[state->current_column % 1000];
     if (tok == NULL) {
       log_invalid_col(state, "Invalid polygon ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     state->tmp_na_to_polygon.polygon_ids[table_id] = strtoul(tok, &end, 10);
     if (end == tok || *end || errno == ERANGE) {
       log_invalid_col(state, "Invalid polygon ID", tok);
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     break;
   }
 
-  /* move on to the next column */
-  state->current_column++;
+  return 0;
 }
 
-/** Handle an end-of-row event for the netacq2polygon table*/
-static void parse_na_to_polygon_row(int c, void *data)
+/* Get the shared copy of the polygon id tuple of the current row */
+static uint32_t *intern_polygon_ids(ipmeta_provider_t *provider)
 {
-  int i;
-  ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  polygon_ids_key_t key;
+  khiter_t khiter;
+  int khret;
+
+  key.ids = state->tmp_na_to_polygon.polygon_ids;
+  key.cnt = state->polygon_tables_cnt;
+
+  if (state->polygon_ids_set == NULL &&
+      (state->polygon_ids_set = kh_init(polyids)) == NULL) {
+    return NULL;
+  }
+  if ((khiter = kh_get(polyids, state->polygon_ids_set, key)) !=
+      kh_end(state->polygon_ids_set)) {
+    return kh_key(state->polygon_ids_set, khiter).ids;
+  }
+
+  /* first time we have seen this tuple */
+  if ((key.ids = ipmeta_provider_arena_alloc(provider,
+         sizeof(uint32_t) * (key.cnt > 0 ? key.cnt : 1))) == NULL) {
+    return NULL;
+  }
+  memcpy(key.ids, state->tmp_na_to_polygon.polygon_ids,
+         sizeof(uint32_t) * key.cnt);
+  kh_put(polyids, state->polygon_ids_set, key, &khret);
+  if (khret < 0) {
+    return NULL;
+  }
+  return key.ids;
+}
 
-  na_to_polygon_t *n2p = NULL;
+/** Parse a netacq2polygon table row */
+static int parse_na_to_polygon_row(ipmeta_provider_t *provider,
+    ipmeta_csv_row_t *row)
+{
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  uint32_t loc_id;
+  uint32_t **tmp;
+  uint64_t new_alloc;
+  int col;
+
+  for (col = 0; col < row->fields_cnt; col++) {
+    state->current_column = NA_TO_POLYGON_COL_FIRSTCOL + col;
+    if (parse_na_to_polygon_cell(provider, row->fields[col]) != 0) {
+      return -1;
+    }
+  }
 
   /* process the header row */
   if (state->current_line == 0) {
     /** all work is done in the col parser ? */
-    state->current_column = NA_TO_POLYGON_COL_FIRSTCOL;
     state->current_line++;
-    return;
+    return 0;
   }
 
   /* done processing the line */
 
   /* make sure we parsed exactly as many columns as we anticipated */
-  if (state->current_column <= NA_TO_POLYGON_COL_NETACQ_LOC_ID) {
+  if (row->fields_cnt <= NA_TO_POLYGON_COL_NETACQ_LOC_ID) {
     ipmeta_log(__func__, "Missing location ID");
-    state->parser.status = CSV_EUSER;
-    return;
-  }
-
-  /* copy the tmp polygon struct into a new one */
-  if ((n2p = malloc(sizeof(na_to_polygon_t))) == NULL) {
-    ipmeta_log(__func__, "ERROR: Could not allocate memory for polygon");
-    state->parser.status = CSV_EUSER;
-    return;
+    return -1;
   }
-  memcpy(n2p, &(state->tmp_na_to_polygon), sizeof(na_to_polygon_t));
+  loc_id = state->tmp_na_to_polygon.na_loc_id;
 
   /* if this id would overflow the table, just make the table bigger */
-  if ((n2p->na_loc_id + 1) > state->na_to_polygons_cnt) {
-    if ((state->na_to_polygons =
-           realloc(state->na_to_polygons,
-                   sizeof(na_to_polygon_t *) * (n2p->na_loc_id + 1))) == NULL) {
+  if (loc_id >= (uint32_t)state->na_to_polygons_alloc) {
+    new_alloc = (uint64_t)state->na_to_polygons_alloc * 2;
+    if (new_alloc <= loc_id) {
+      new_alloc = (uint64_t)loc_id + 1;
+    }
+    if (new_alloc > INT_MAX) {
+      ipmeta_log(__func__, "ERROR: Location ID %" PRIu32 " is too large",
+                 loc_id);
+      return -1;
+    }
+    if ((tmp = realloc(state->na_to_polygons,
+                       sizeof(uint32_t *) * new_alloc)) == NULL) {
       ipmeta_log(__func__,
                  "ERROR: Could not allocate memory for na2polygon array");
-      state->parser.status = CSV_EUSER;
-      return;
+      return -1;
     }
     /* zero out the newly allocated memory */
-    for (i = state->na_to_polygons_cnt; i < n2p->na_loc_id; i++) {
-      state->na_to_polygons[i] = NULL;
-    }
-
-    state->na_to_polygons_cnt = n2p->na_loc_id + 1;
-  } else if (state->na_to_polygons[n2p->na_loc_id] != NULL) {
+    memset(tmp + state->na_to_polygons_alloc, 0,
+           sizeof(uint32_t *) * (new_alloc - state->na_to_polygons_alloc));
+    state->na_to_polygons = tmp;
+    state->na_to_polygons_alloc = (int)new_alloc;
+  } else if (state->na_to_polygons[loc_id] != NULL) {
     /* About to override an already inserted location */
     ipmeta_log(__func__, "ERROR: Duplicate location ID: %d in polygons file",
-               n2p->na_loc_id);
-    state->parser.status = CSV_EUSER;
-    return;
+               loc_id);
+    return -1;
+  }
+  if (loc_id >= (uint32_t)state->na_to_polygons_cnt) {
+    state->na_to_polygons_cnt = loc_id + 1;
   }
 
   /* now poke it in */
-  state->na_to_polygons[n2p->na_loc_id] = n2p;
+  if ((state->na_to_polygons[loc_id] = intern_polygon_ids(provider)) ==
+      NULL) {
+    ipmeta_log(__func__, "ERROR: Could not allocate memory for polygon ids");
+    return -1;
+  }
 
   /* increment the current line */
   state->current_line++;
-  /* reset the current column */
-  state->current_column = NA_TO_POLYGON_COL_FIRSTCOL;
   /* reset the tmp region info */
   memset(&(state->tmp_na_to_polygon), 0, sizeof(na_to_polygon_t));
+
+  return 0;
 }
 
 /** Read a netacq2polygon mapping file */
@@ -1574,20 +1619,21 @@ static int read_na_to_polygon(ipmeta_provider_t *provider, io_t *file)
   memset(&(state->tmp_na_to_polygon), 0, sizeof(na_to_polygon_t));
 
   return read_netacq_edge_file(provider, file, "netacq2polygon",
-      parse_na_to_polygon_cell, parse_na_to_polygon_row);
+      parse_na_to_polygon_row);
 }
 
 static void na_to_polygon_free(ipmeta_provider_netacq_edge_state_t *state)
 {
-  int i;
-
-  for (i = 0; i < state->na_to_polygons_cnt; i++) {
-    free(state->na_to_polygons[i]);
-    state->na_to_polygons[i] = NULL;
-  }
+  /* the polygon id tuples themselves live in the provider's arena */
   free(state->na_to_polygons);
   state->na_to_polygons = NULL;
   state->na_to_polygons_cnt = 0;
+  state->na_to_polygons_alloc = 0;
+
+  if (state->polygon_ids_set != NULL) {
+    kh_destroy(polyids, state->polygon_ids_set);
+    state->polygon_ids_set = NULL;
+  }
 }
 
 static int load_file(ipmeta_provider_t *provider, const char *filename,
@@ -1612,6 +1658,104 @@ static int load_file(ipmeta_provider_t *provider, const char *filename,
   return rc;
 }
 
+/** Codes of a decode table are indexed directly as long as no code is more
+ * than CODE_INDEX_MIN_LEN and this many times larger than the number of
+ * entries */
+#define CODE_INDEX_MAX_SPARSENESS 16
+#define CODE_INDEX_MIN_LEN 65536
+
+#define ITEM_CODE(item, code_offset)                                           \
+  (*(const uint32_t *)((const char *)(item) + (code_offset)))
+
+/* Build an array of the given items (whose uint32_t code is at code_offset)
+   indexed by code. The index is NULL if the codes are too sparse. */
+static int build_code_index(void **items, int items_cnt, size_t code_offset,
+                            void ***index, uint32_t *index_len)
+{
+  uint32_t max_code = 0;
+  uint32_t code;
+  int i;
+
+  *index = NULL;
+  *index_len = 0;
+
+  for (i = 0; i < items_cnt; i++) {
+    if ((code = ITEM_CODE(items[i], code_offset)) > max_code) {
+      max_code = code;
+    }
+  }
+  if (items_cnt == 0 ||
+      (max_code >= CODE_INDEX_MIN_LEN &&
+       max_code / CODE_INDEX_MAX_SPARSENESS > (uint32_t)items_cnt)) {
+    return 0;
+  }
+
+  if ((*index = calloc((size_t)max_code + 1, sizeof(void *))) == NULL) {
+    return -1;
+  }
+  *index_len = max_code + 1;
+  for (i = 0; i < items_cnt; i++) {
+    code = ITEM_CODE(items[i], code_offset);
+    /* the first entry wins, as it would for a linear search */
+    if ((*index)[code] == NULL) {
+      (*index)[code] = items[i];
+    }
+  }
+  return 0;
+}
+
+/* Find the item with the given code, using the index if there is one */
+static void *find_by_code(void **items, int items_cnt, size_t code_offset,
+                          void **index, uint32_t index_len, uint32_t code)
+{
+  int i;
+
+  if (index != NULL) {
+    return (code < index_len) ? index[code] : NULL;
+  }
+  for (i = 0; i < items_cnt; i++) {
+    if (ITEM_CODE(items[i], code_offset) == code) {
+      return items[i];
+    }
+  }
+  return NULL;
+}
+
+/* Index the region, country and polygon decode tables by code */
+static int build_code_indexes(ipmeta_provider_t *provider)
+{
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  ipmeta_polygon_table_t *table;
+  void **index;
+  int i;
+
+  if (build_code_index((void **)state->regions, state->regions_cnt,
+                       offsetof(ipmeta_provider_netacq_edge_region_t, code),
+                       &index, &state->regions_by_code_len) != 0) {
+    return -1;
+  }
+  state->regions_by_code = (ipmeta_provider_netacq_edge_region_t **)index;
+
+  if (build_code_index((void **)state->countries, state->countries_cnt,
+                       offsetof(ipmeta_provider_netacq_edge_country_t, code),
+                       &index, &state->countries_by_code_len) != 0) {
+    return -1;
+  }
+  state->countries_by_code = (ipmeta_provider_netacq_edge_country_t **)index;
+
+  for (i = 0; i < state->polygon_tables_cnt; i++) {
+    table = state->polygon_tables[i];
+    if (build_code_index((void **)table->polygons, table->polygons_cnt,
+                         offsetof(ipmeta_polygon_t, id), &index,
+                         &table->polygons_by_id_len) != 0) {
+      return -1;
+    }
+    table->polygons_by_id = (ipmeta_polygon_t **)index;
+  }
+
+  return 0;
+}
+
 /* ===== PUBLIC FUNCTIONS BELOW THIS POINT ===== */
 
 ipmeta_provider_t *ipmeta_provider_netacq_edge_alloc(void)
@@ -1660,6 +1804,11 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
         return -1;
     }
 
+    if (build_code_indexes(provider) != 0) {
+      ipmeta_log(__func__, "could not index decode tables");
+      return -1;
+    }
+
     /* if provided, open the netacq2polygon mapping file and populate the
        temporary join table */
     if (state->na_to_polygon_file != NULL) {
@@ -1734,6 +1883,9 @@ void ipmeta_provider_netacq_edge_free(ipmeta_provider_t *provider)
       state->regions = NULL;
       state->regions_cnt = 0;
     }
+    free(state->regions_by_code);
+    state->regions_by_code = NULL;
+    state->regions_by_code_len = 0;
 
     if (state->countries != NULL) {
       for (i = 0; i < state->countries_cnt; i++) {
@@ -1748,6 +1900,9 @@ void ipmeta_provider_netacq_edge_free(ipmeta_provider_t *provider)
       state->countries = NULL;
       state->countries_cnt = 0;
     }
+    free(state->countries_by_code);
+    state->countries_by_code = NULL;
+    state->countries_by_code_len = 0;
 
     if (state->polygon_tables != NULL) {
       /* @todo move to a polygon_table_free function */
@@ -1775,6 +1930,9 @@ void ipmeta_provider_netacq_edge_free(ipmeta_provider_t *provider)
         free(table->polygons);
         table->polygons = NULL;
 
+        free(table->polygons_by_id);
+        table->polygons_by_id = NULL;
+
         free(table);
         state->polygon_tables[i] = NULL;
       }
@@ -1785,7 +1943,6 @@ void ipmeta_provider_netacq_edge_free(ipmeta_provider_t *provider)
 
     /* just in case */
     na_to_polygon_free(state);
-    csv_free(&(state->parser));
 
     ipmeta_provider_free_state(provider);
   }
@@ -1806,6 +1963,37 @@ int ipmeta_provider_netacq_edge_lookup_addr(ipmeta_provider_t *provider,
   return ipmeta_provider_lookup_addr(provider, family, addrp, found);
 }
 
+int ipmeta_provider_netacq_edge_finalize(ipmeta_provider_t *provider)
+{
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  ipmeta_record_t *record;
+  ipmeta_polygon_t *polygon;
+  uint32_t i;
+  int t;
+
+  /* sum the coverage of the records located in each polygon */
+  for (i = 0; i < provider->records_cnt; i++) {
+    record = provider->records[i];
+    if (record->polygon_ids == NULL) {
+      continue;
+    }
+    for (t = 0; t < record->polygon_ids_cnt && t < state->polygon_tables_cnt;
+         t++) {
+      if ((polygon = ipmeta_polygon_table_get_polygon_by_id(
+             state->polygon_tables[t], record->polygon_ids[t])) == NULL) {
+        continue;
+      }
+      polygon->coverage.v4_ip_cnt += record->coverage.v4_ip_cnt;
+      polygon->coverage.v6_ip_cnt =
+        (polygon->coverage.v6_ip_cnt > UINT64_MAX - record->coverage.v6_ip_cnt)
+          ? UINT64_MAX
+          : polygon->coverage.v6_ip_cnt + record->coverage.v6_ip_cnt;
+    }
+  }
+
+  return 0;
+}
+
 int ipmeta_provider_netacq_edge_get_regions(
   ipmeta_provider_t *provider, ipmeta_provider_netacq_edge_region_t ***regions)
 {
@@ -1833,3 +2021,38 @@ int ipmeta_provider_netacq_edge_get_polygon_tables(
   *tables = state->polygon_tables;
   return state->polygon_tables_cnt;
 }
+
+ipmeta_provider_netacq_edge_region_t *
+ipmeta_provider_netacq_edge_get_region_by_code(ipmeta_provider_t *provider,
+                                               uint32_t code)
+{
+  assert(provider != NULL && provider->enabled != 0);
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  return find_by_code((void **)state->regions, state->regions_cnt,
+                      offsetof(ipmeta_provider_netacq_edge_region_t, code),
+                      (void **)state->regions_by_code,
+                      state->regions_by_code_len, code);
+}
+
+ipmeta_provider_netacq_edge_country_t *
+ipmeta_provider_netacq_edge_get_country_by_code(ipmeta_provider_t *provider,
+                                                uint32_t code)
+{
+  assert(provider != NULL && provider->enabled != 0);
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  return find_by_code((void **)state->countries, state->countries_cnt,
+                      offsetof(ipmeta_provider_netacq_edge_country_t, code),
+                      (void **)state->countries_by_code,
+                      state->countries_by_code_len, code);
+}
+
+ipmeta_polygon_t *
+ipmeta_polygon_table_get_polygon_by_id(ipmeta_polygon_table_t *table,
+                                       uint32_t id)
+{
+  assert(table != NULL);
+  return find_by_code((void **)table->polygons, table->polygons_cnt,
+                      offsetof(ipmeta_polygon_t, id),
+                      (void **)table->polygons_by_id,
+                      table->polygons_by_id_len, id);
+}
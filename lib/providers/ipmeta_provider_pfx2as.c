@@ -48,7 +48,6 @@
 
 #include "khash.h"
 #include "utils.h"
-#include "csv.h"
 #include "ipvx_utils.h"
 
 #include "ipmeta_ds.h"
@@ -58,10 +57,52 @@
 
 #define STATE(provname) (IPMETA_PROVIDER_STATE(pfx2as, provname))
 
-#define BUFFER_LEN 1024
+/** Size of the blocks that the pfx2as file is read in */
+#define READ_BUFFER_LEN (1024 * 1024)
 
-/** Initialize the map type (string keys, geo_record values */
-KHASH_MAP_INIT_STR(strrec, ipmeta_record_t *)
+/** A set of ASNs, used as the key for deduplicating ASN records
+ *
+ * The ASNs are always in canonical (sorted, duplicate-free) order so that
+ * e.g. "1_2" and "2_1" map to the same record.
+ */
+typedef struct asn_set {
+  /** Array of ASNs (owned by the record, or by the caller for lookups) */
+  const uint32_t *asn;
+
+  /** Number of ASNs in the array */
+  int asn_cnt;
+} asn_set_t;
+
+/** Hash an ASN set (murmur3-style mixing of each ASN) */
+static inline khint32_t asn_set_hash_func(asn_set_t set)
+{
+  khint32_t h = (khint32_t)set.asn_cnt;
+  khint32_t k;
+  int i;
+
+  for (i = 0; i < set.asn_cnt; i++) {
+    k = set.asn[i] * 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    h ^= k * 0x1b873593;
+    h = (h << 13) | (h >> 19);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+#define asn_set_hash_equal(a, b)                                               \
+  ((a).asn_cnt == (b).asn_cnt &&                                               \
+   memcmp((a).asn, (b).asn, sizeof(uint32_t) * (a).asn_cnt) == 0)
+
+/** Initialize the map type (ASN set keys, record values) */
+KHASH_INIT(asnrec, asn_set_t, ipmeta_record_t *, 1, asn_set_hash_func,
+           asn_set_hash_equal)
 
 /** The basic fields that every instance of this provider have in common */
 static ipmeta_provider_t ipmeta_provider_pfx2as = {
@@ -74,10 +115,16 @@ typedef struct ipmeta_provider_pfx2as_state {
   /** The filename of the CAIDA pfx2as database to use */
   char *pfx2as_file;
 
+  /** Index of ASN set => record (keys point into the records' asn arrays) */
+  khash_t(asnrec) *asn_records;
+
 } ipmeta_provider_pfx2as_state_t;
 
 #define COL_CNT 3
 
+/** Largest ASN set that get_record_by_asns will canonicalize on the stack */
+#define ASN_SET_LOCAL_MAX 32
+
 /** Print usage information to stderr */
 static void usage(ipmeta_provider_t *provider)
 {
@@ -138,13 +185,30 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
   return 0;
 }
 
-/** Parse an underscore-separated list of ASNs */
-static int parse_asn(char *asn_str, uint32_t **asn_arr)
+/** Parse an underscore-separated list of ASNs
+ *
+ * @param asn_str       nul-terminated ASN string (not modified)
+ * @param asn_buf       pointer to a scratch array to parse the ASNs into,
+ *                      grown as needed
+ * @param asn_buf_alloc pointer to the number of elements allocated in asn_buf
+ * @return the number of ASNs parsed, or -1 if the string is invalid (an ASN
+ * that does not fit in 32 bits or an ASDOT half over 65535 is invalid) or the
+ * scratch array could not be grown
+ *
+ * The scratch array is re-used between calls so that parsing a line does not
+ * normally require any heap allocation.
+ */
+static int parse_asn(const char *asn_str, uint32_t **asn_buf,
+                     int *asn_buf_alloc)
 {
-  unsigned asn_cnt = 0;
-  uint32_t *asn = NULL;
-  char *tok = NULL;
-  char *period = NULL;
+  const char *p = asn_str;
+  int asn_cnt = 0;
+  uint32_t *tmp;
+  int new_alloc;
+  uint64_t val;
+  uint64_t hi;
+  int asdot;
+  int digits;
 
   /* WARNING:
 
@@ -153,173 +217,292 @@ static int parse_asn(char *asn_str, uint32_t **asn_arr)
      there are no current uses of MOAS nor AS sets. This may/will need to be
      revisited in the future
   */
-  /* s/,/_/g; */
-  tok = asn_str;
-  while (*tok != '\0') {
-    if (*tok == ',') {
-      *tok = '_';
+  /* i.e. both ',' (AS set) and '_' (MOAS) are treated as separators */
+
+  while (1) {
+    val = 0;
+    hi = 0;
+    asdot = 0;
+    digits = 0;
+    for (; *p != '\0'; p++) {
+      if (*p >= '0' && *p <= '9') {
+        val = (val * 10) + (uint64_t)(*p - '0');
+        digits++;
+        /* each half of an ASDOT number is 16 bits */
+        if (val > (asdot ? UINT16_MAX : UINT32_MAX)) {
+          return -1;
+        }
+      } else if (*p == '.' && asdot == 0 && digits > 0 && val <= UINT16_MAX) {
+        /* ASDOT format: the first 16 bits come before the period */
+        hi = val;
+        val = 0;
+        asdot = 1;
+        digits = 0;
+      } else {
+        break;
+      }
+    }
+    if (digits == 0) {
+      return -1;
+    }
+    if (asdot != 0) {
+      val = (hi << 16) | val;
     }
-    tok++;
-  }
 
-  while ((tok = strsep(&asn_str, "_")) != NULL) {
-    /* realloc the asn array to buy us one more */
-    if ((asn = realloc(asn, sizeof(uint32_t) * (asn_cnt + 1))) == NULL) {
-      if (asn != NULL) {
-        free(asn);
+    /* make room for one more, but only when we run out */
+    if (asn_cnt == *asn_buf_alloc) {
+      new_alloc = (*asn_buf_alloc == 0) ? 8 : (*asn_buf_alloc * 2);
+      if ((tmp = realloc(*asn_buf, sizeof(uint32_t) * new_alloc)) == NULL) {
+        return -1;
       }
-      return -1;
+      *asn_buf = tmp;
+      *asn_buf_alloc = new_alloc;
     }
+    (*asn_buf)[asn_cnt++] = (uint32_t)val;
 
-    /* check if this is in ASDOT format */
-    if ((period = strchr(tok, '.')) != NULL) {
-      /* set this to a nul */
-      *period = '\0';
-      /* get the value of the first 16 bits and the second */
-      asn[asn_cnt] = ((uint32_t)strtoul(tok, NULL, 10) << 16) |
-        (uint32_t)strtoul(period + 1, NULL, 10);
-    } else {
-      /* do a simple strtoul and be done */
-      asn[asn_cnt] = (uint32_t)strtoul(tok, NULL, 10);
+    if (*p == '\0') {
+      break;
     }
-    asn_cnt++;
+    if (*p != '_' && *p != ',') {
+      return -1;
+    }
+    p++;
   }
 
-  /* return the array of asn values and the count */
-  *asn_arr = asn;
-  return (int)asn_cnt;
+  return asn_cnt;
 }
 
-/** Free a string (for use with the map) */
-static inline void str_free(const char *str)
+/** Parse a (1-3 digit) prefix length from a nul-terminated string */
+static int parse_pfxlen(const char *str)
 {
-  free((char *)str);
+  int len = 0;
+  int i;
+
+  for (i = 0; str[i] != '\0'; i++) {
+    if (i == 3 || str[i] < '0' || str[i] > '9') {
+      return -1;
+    }
+    len = (len * 10) + (str[i] - '0');
+  }
+  return (i == 0) ? -1 : len;
+}
+
+/** Sort an array of ASNs in place and remove duplicates
+ *
+ * @return the number of unique ASNs now at the start of the array
+ */
+static int canonicalize_asns(uint32_t *asn, int asn_cnt)
+{
+  uint32_t tmp;
+  int i, j;
+
+  /* these arrays are almost always tiny, so insertion sort is fine */
+  for (i = 1; i < asn_cnt; i++) {
+    tmp = asn[i];
+    for (j = i; j > 0 && asn[j - 1] > tmp; j--) {
+      asn[j] = asn[j - 1];
+    }
+    asn[j] = tmp;
+  }
+
+  for (i = 1, j = 1; i < asn_cnt; i++) {
+    if (asn[i] != asn[j - 1]) {
+      asn[j++] = asn[i];
+    }
+  }
+
+  return (asn_cnt == 0) ? 0 : j;
 }
 
-/** Read the prefix2as file */
+/** Read the prefix2as file
+ *
+ * The file is read in large blocks which are then split into lines and
+ * columns in place (using memchr), rather than being copied out line by line.
+ * The only allocations made per-line are for new ASN records.
+ */
 static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
 {
+  ipmeta_provider_pfx2as_state_t *state = STATE(provider);
   /* we have to normalize the asns on the fly */
   /* so we read the file, reading records into here */
   int khret;
   khiter_t khiter;
-  khash_t(strrec) *asn_table = kh_init(strrec);
-
-  char buffer[BUFFER_LEN];
-  char *rowp;
-  char *tok = NULL;
-  int tokc = 0;
+  asn_set_t asn_set;
+  int rc = -1;
+
+  char *buffer = NULL;
+  size_t buffered = 0; /* unprocessed bytes at the start of buffer */
+  char *bufend;
+  char *linep;
+  char *eol;
+  char *cols[COL_CNT];
+  char *tab;
+  int tokc;
+  int line = 0;
+  int eof = 0;
 
   uint32_t asn_id = 0;
   ipvx_prefix_t addr;
-  uint32_t *asn = NULL;
-  char *asn_str = NULL;
+  int pfxlen;
+  uint32_t *asn_buf = NULL;
+  int asn_buf_alloc = 0;
   int asn_cnt = 0;
 
   ipmeta_record_t *record;
 
   int64_t nread;
-  while ((nread = wandio_fgets(file, &buffer, BUFFER_LEN, 1)) > 0) {
-    rowp = buffer;
-    tokc = 0;
-
-    while ((tok = strsep(&rowp, "\t")) != NULL) {
-      switch (tokc) {
-      case 0:
-        /* network */
-        if (ipvx_pton_addr(tok, &addr) < 0) {
-          ipmeta_log(__func__, "invalid address in pfx2as file");
-          return -1;
-        }
-        break;
 
-      case 1:
-        /* pfxlen */
-        addr.masklen = atoi(tok);
-        break;
+  if ((state->asn_records = kh_init(asnrec)) == NULL) {
+    ipmeta_log(__func__, "could not create ASN set index");
+    goto end;
+  }
 
-      case 2:
-        /* asn */
-        asn_str = strdup(tok);
-        asn_cnt = parse_asn(tok, &asn);
-        break;
+  /* one spare byte so that we can always terminate the last line */
+  if ((buffer = malloc(READ_BUFFER_LEN + 1)) == NULL) {
+    ipmeta_log(__func__, "could not malloc read buffer");
+    goto end;
+  }
 
-      default:
-        ipmeta_log(__func__, "invalid pfx2as file");
-        return -1;
+  while (!eof) {
+    if (buffered == READ_BUFFER_LEN) {
+      ipmeta_log(__func__, "line %d too long in pfx2as file", line + 1);
+      goto end;
+    }
+    if ((nread = wandio_read(file, buffer + buffered,
+                             READ_BUFFER_LEN - buffered)) < 0) {
+      ipmeta_log(__func__, "Error reading pfx2as file");
+      goto end;
+    }
+    bufend = buffer + buffered + nread;
+    if (nread == 0) {
+      eof = 1;
+      if (buffered == 0) {
+        break;
       }
-      tokc++;
+      /* the last line was not newline-terminated */
+      *bufend++ = '\n';
     }
 
-    if (tokc != COL_CNT) {
-      ipmeta_log(__func__, "invalid pfx2as file");
-      return -1;
-    }
+    linep = buffer;
+    while ((eol = memchr(linep, '\n', bufend - linep)) != NULL) {
+      *eol = '\0';
+      line++;
 
-    if (asn_cnt <= 0 || asn_str == NULL) {
-      ipmeta_log(__func__, "could not parse asn string");
-      return -1;
-    }
+      /* ignore empty lines */
+      if (linep == eol) {
+        linep = eol + 1;
+        continue;
+      }
 
-    /* check our hash for this asn */
-    if ((khiter = kh_get(strrec, asn_table, asn_str)) == kh_end(asn_table)) {
-      /* need to create a record for this asn */
-      if ((record = ipmeta_provider_init_record(provider, asn_id)) == NULL) {
-        ipmeta_log(__func__, "could not alloc geo record");
-        return -1;
+      /* split the line into columns in place */
+      tokc = 0;
+      cols[tokc++] = linep;
+      while ((tab = memchr(linep, '\t', eol - linep)) != NULL) {
+        if (tokc == COL_CNT) {
+          tokc++;
+          break;
+        }
+        *tab = '\0';
+        linep = tab + 1;
+        cols[tokc++] = linep;
       }
+      linep = eol + 1;
 
-      /* set the fields */
-      record->asn = asn;
-      record->asn_cnt = asn_cnt;
+      if (tokc != COL_CNT) {
+        ipmeta_log(__func__, "invalid pfx2as file (line %d)", line);
+        goto end;
+      }
 
-      /* put it into our table */
-      khiter = kh_put(strrec, asn_table, asn_str, &khret);
-      kh_value(asn_table, khiter) = record;
+      /* network */
+      if (ipvx_pton_addr(cols[0], &addr) < 0) {
+        ipmeta_log(__func__, "invalid address in pfx2as file (line %d)", line);
+        goto end;
+      }
+
+      /* pfxlen */
+      if ((pfxlen = parse_pfxlen(cols[1])) < 0 ||
+          pfxlen > ipvx_family_size(addr.family)) {
+        ipmeta_log(__func__, "invalid prefix length in pfx2as file (line %d)",
+                   line);
+        goto end;
+      }
+      addr.masklen = pfxlen;
+
+      /* asn */
+      if ((asn_cnt = parse_asn(cols[2], &asn_buf, &asn_buf_alloc)) <= 0) {
+        ipmeta_log(__func__, "could not parse asn string (line %d)", line);
+        goto end;
+      }
+      asn_set.asn = asn_buf;
+      asn_set.asn_cnt = canonicalize_asns(asn_buf, asn_cnt);
+
+      /* check our hash for this asn set */
+      if ((khiter = kh_get(asnrec, state->asn_records, asn_set)) ==
+          kh_end(state->asn_records)) {
+        /* need to create a record for this asn set */
+        if ((record = ipmeta_provider_init_record(provider, asn_id)) == NULL) {
+          ipmeta_log(__func__, "could not alloc geo record");
+          goto end;
+        }
+
+        /* set the fields */
+        if ((record->asn = ipmeta_provider_arena_alloc(provider,
+               sizeof(uint32_t) * asn_set.asn_cnt)) == NULL) {
+          ipmeta_log(__func__, "could not alloc asn array");
+          goto end;
+        }
+        memcpy(record->asn, asn_buf, sizeof(uint32_t) * asn_set.asn_cnt);
+        record->asn_cnt = asn_set.asn_cnt;
+
+        /* put it into our table (keyed on the record's own copy) */
+        asn_set.asn = record->asn;
+        khiter = kh_put(asnrec, state->asn_records, asn_set, &khret);
+        if (khret < 0) {
+          ipmeta_log(__func__, "could not insert into ASN set index");
+          goto end;
+        }
+        kh_value(state->asn_records, khiter) = record;
+
+        /* move on to the next id */
+        asn_id++;
+      } else {
+        /* we've seen this ASN set before, just use that! */
+        record = kh_value(state->asn_records, khiter);
+      }
 
-      /* move on to the next id */
-      asn_id++;
-    } else {
-      /* we've seen this ASN before, just use that! */
-      record = kh_value(asn_table, khiter);
       assert(record != NULL);
-      /* BUT! remember that we strdup'd the asn string */
-      /* and that parse_asn did some malloc'ing */
-      free(asn_str);
-      free(asn);
-      asn = NULL;
-      asn_cnt = 0;
-    }
 
-    assert(record != NULL);
+      /* how many IP addresses does this prefix cover ? */
+      /* we will add this to the record and then use the total count for the
+         asn to find the 'biggest' ASes */
+      if (addr.masklen <= 64) {
+        // For IPv6, we count /64 subnets, not addresses.  Prefixes longer than
+        // /64 don't count.
+        record->asn_ip_cnt += (uint64_t)1 <<
+          ((addr.family == AF_INET ? 32 : 64) - addr.masklen);
+      }
 
-    /* how many IP addresses does this prefix cover ? */
-    /* we will add this to the record and then use the total count for the asn
-       to find the 'biggest' ASes */
-    if (addr.masklen <= 64) {
-      // For IPv6, we count /64 subnets, not addresses.  Prefixes longer than
-      // /64 don't count.
-      record->asn_ip_cnt += (uint64_t)1 <<
-        ((addr.family == AF_INET ? 32 : 64) - addr.masklen);
+      /* by here record is the right asn record, associate it with this pfx */
+      if (ipmeta_provider_associate_record(provider, addr.family, &addr.addr,
+          addr.masklen, record) != 0) {
+        ipmeta_log(__func__, "failed to associate record");
+        goto end;
+      }
     }
 
-    /* by here record is the right asn record, associate it with this pfx */
-    if (ipmeta_provider_associate_record(provider, addr.family, &addr.addr,
-        addr.masklen, record) != 0) {
-      ipmeta_log(__func__, "failed to associate record");
-      return -1;
-    }
-  }
-  if (nread < 0) {
-    ipmeta_log(__func__, "Error reading pfx2as file");
-    return -1;
+    /* move the partial last line to the front of the buffer */
+    buffered = bufend - linep;
+    memmove(buffer, linep, buffered);
   }
 
-  /* free our asn_table hash */
-  kh_free(strrec, asn_table, str_free);
-  kh_destroy(strrec, asn_table);
+  rc = 0;
 
-  return 0;
+end:
+  /* the asn_records index is kept (and free'd along with the state) */
+  free(asn_buf);
+  free(buffer);
+
+  return rc;
 }
 
 /* ===== PUBLIC FUNCTIONS BELOW THIS POINT ===== */
@@ -386,6 +569,12 @@ void ipmeta_provider_pfx2as_free(ipmeta_provider_t *provider)
       state->pfx2as_file = NULL;
     }
 
+    if (state->asn_records != NULL) {
+      /* the keys belong to the records, which are free'd by the framework */
+      kh_destroy(asnrec, state->asn_records);
+      state->asn_records = NULL;
+    }
+
     ipmeta_provider_free_state(provider);
   }
   return;
@@ -404,3 +593,45 @@ int ipmeta_provider_pfx2as_lookup_addr(ipmeta_provider_t *provider, int family,
   /* just call the lookup helper func in provider manager */
   return ipmeta_provider_lookup_addr(provider, family, addrp, found);
 }
+
+int ipmeta_provider_pfx2as_finalize(ipmeta_provider_t *provider)
+{
+  /* nothing to do */
+  return 0;
+}
+
+ipmeta_record_t *
+ipmeta_provider_pfx2as_get_record_by_asns(ipmeta_provider_t *provider,
+                                          const uint32_t *asns, int asn_cnt)
+{
+  assert(provider != NULL && provider->enabled != 0);
+  ipmeta_provider_pfx2as_state_t *state = STATE(provider);
+  uint32_t local_buf[ASN_SET_LOCAL_MAX];
+  uint32_t *buf = local_buf;
+  ipmeta_record_t *record = NULL;
+  asn_set_t asn_set;
+  khiter_t khiter;
+
+  if (asn_cnt <= 0 || state->asn_records == NULL) {
+    return NULL;
+  }
+
+  /* canonicalize a copy of the caller's ASNs */
+  if (asn_cnt > ASN_SET_LOCAL_MAX &&
+      (buf = malloc(sizeof(uint32_t) * asn_cnt)) == NULL) {
+    return NULL;
+  }
+  memcpy(buf, asns, sizeof(uint32_t) * asn_cnt);
+  asn_set.asn = buf;
+  asn_set.asn_cnt = canonicalize_asns(buf, asn_cnt);
+
+  if ((khiter = kh_get(asnrec, state->asn_records, asn_set)) !=
+      kh_end(state->asn_records)) {
+    record = kh_value(state->asn_records, khiter);
+  }
+
+  if (buf != local_buf) {
+    free(buf);
+  }
+  return record;
+}
@@ -0,0 +1,387 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <wandio.h>
+
+#include "libipmeta.h"
+#include "utils.h"
+
+#define DEFAULT_COMPRESS_LEVEL 6
+
+static ipmeta_t *old_ipmeta = NULL;
+static ipmeta_t *new_ipmeta = NULL;
+
+/** Totals for the changes of one provider */
+typedef struct diff_stats {
+  iow_t *outfile;
+  uint64_t ranges_cnt;
+  uint64_t v4_ip_cnt;
+  uint64_t v6_ip_cnt;
+} diff_stats_t;
+
+static int write_change(int family, void *firstp, void *lastp,
+                        uint64_t num_ips, ipmeta_record_t *old_record,
+                        ipmeta_record_t *new_record, void *user)
+{
+  diff_stats_t *stats = (diff_stats_t *)user;
+  char first_str[INET6_ADDRSTRLEN];
+  char last_str[INET6_ADDRSTRLEN];
+  char range_str[INET6_ADDRSTRLEN * 2 + 1];
+
+  inet_ntop(family, firstp, first_str, sizeof(first_str));
+  inet_ntop(family, lastp, last_str, sizeof(last_str));
+  snprintf(range_str, sizeof(range_str), "%s-%s", first_str, last_str);
+
+  /* one row for the old record and one for the new, like a unified diff */
+  if (ipmeta_printf(stats->outfile, "-|") < 0) {
+    return -1;
+  }
+  ipmeta_write_record(stats->outfile, old_record, range_str, num_ips);
+  if (ipmeta_printf(stats->outfile, "+|") < 0) {
+    return -1;
+  }
+  ipmeta_write_record(stats->outfile, new_record, range_str, num_ips);
+
+  stats->ranges_cnt++;
+  if (family == AF_INET) {
+    stats->v4_ip_cnt += num_ips;
+  } else {
+    stats->v6_ip_cnt = (stats->v6_ip_cnt > UINT64_MAX - num_ips) ?
+      UINT64_MAX : stats->v6_ip_cnt + num_ips;
+  }
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  assert(old_ipmeta != NULL);
+  ipmeta_provider_t **providers = NULL;
+  int i;
+
+  // skip directory part of name
+  const char *p;
+  while ((p = strchr(name, '/')))
+    name = p + 1;
+
+  const char **dsnames = ipmeta_ds_get_all();
+  fprintf(stderr,
+      "usage: %s {-p provider}... {-n provider}... [<other options>]\n"
+      "Write the address ranges whose record differs between an old and a\n"
+      "new copy of the given providers' data. Each change is written as a\n"
+      "row starting with \"-\" holding the old record, and a row starting\n"
+      "with \"+\" holding the new one. The ip-prefix column holds the range\n"
+      "of addresses as <first>-<last>.\n"
+      "options:\n"
+      "    -p <provider> enable the given provider with its old data\n"
+      "                  (repeatable).\n"
+      "    -n <provider> enable the given provider with its new data\n"
+      "                  (repeatable).\n"
+      "                  Use \"-p'<provider> -?'\" for help with provider.\n"
+      "                  Available providers:\n",
+      name);
+  /* get the available plugins from ipmeta */
+  providers = ipmeta_get_all_providers(old_ipmeta);
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    assert(providers[i] != NULL);
+    assert(ipmeta_get_provider_name(providers[i]));
+    fprintf(stderr, "                   - %s\n",
+            ipmeta_get_provider_name(providers[i]));
+  }
+  fprintf(stderr,
+      "    -D <struct>   data structure to use for storing prefixes\n"
+      "                  (default: %s)\n"
+      "                  Available datastructures:\n",
+      dsnames[IPMETA_DS_DEFAULT-1]);
+  for (i = 0; i < IPMETA_DS_MAX; i++) {
+    fprintf(stderr, "                   - %s\n", dsnames[i]);
+  }
+  free(dsnames);
+  fprintf(stderr,
+      "    -4            only compare IPv4 prefixes\n"
+      "    -6            only compare IPv6 prefixes\n"
+      "    -h            write out a header row with field names\n"
+      "    -o <outfile>  write results to the given file\n"
+      "    -c <level>    compression level to use for <outfile> "
+      "(default: %d)\n",
+      DEFAULT_COMPRESS_LEVEL);
+}
+
+/* Enable each of the given providers in an ipmeta instance */
+static int enable_providers(ipmeta_t *ipmeta, char **providers,
+                            int providers_cnt, uint32_t *providermask)
+{
+  char *provider_arg_ptr = NULL;
+  ipmeta_provider_t *provider = NULL;
+  int i;
+
+  for (i = 0; i < providers_cnt; i++) {
+    /* the string at providers[i] will contain the name of the plugin,
+       optionally followed by a space and then the arguments to pass
+       to the plugin */
+    if ((provider_arg_ptr = strchr(providers[i], ' ')) != NULL) {
+      *provider_arg_ptr = '\0';
+      provider_arg_ptr++;
+    }
+
+    /* lookup the provider using the name given */
+    if ((provider = ipmeta_get_provider_by_name(ipmeta, providers[i])) ==
+        NULL) {
+      fprintf(stderr, "ERROR: Invalid provider name (%s)\n", providers[i]);
+      return -1;
+    }
+
+    if (ipmeta_enable_provider(ipmeta, provider, provider_arg_ptr) != 0) {
+      fprintf(stderr, "ERROR: Could not enable plugin %s\n", providers[i]);
+      return -1;
+    }
+    *providermask |= IPMETA_PROV_TO_MASK(ipmeta_get_provider_id(provider));
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int rc = 1; // default to error
+  int i;
+  int opt;
+  /* we MUST not use any of the getopt global vars outside of arg parsing */
+  /* this is because the plugins can use get opt to parse their config */
+  int error = 0;
+
+  char *old_providers[IPMETA_PROVIDER_MAX];
+  int old_providers_cnt = 0;
+  char *new_providers[IPMETA_PROVIDER_MAX];
+  int new_providers_cnt = 0;
+  uint32_t providermask = 0;
+  diff_stats_t stats;
+
+  int headers_enabled = 0;
+  int v4_enabled = 1;
+  int v6_enabled = 1;
+
+  int compress_level = DEFAULT_COMPRESS_LEVEL;
+  char *outfile_name = NULL;
+  iow_t *outfile = NULL;
+  ipmeta_ds_id_t dstype = IPMETA_DS_DEFAULT;
+
+  /* initialize the providers arrays to NULL first */
+  memset(old_providers, 0, sizeof(char *) * IPMETA_PROVIDER_MAX);
+  memset(new_providers, 0, sizeof(char *) * IPMETA_PROVIDER_MAX);
+
+  while ((opt = getopt(argc, argv, "46D:c:n:o:p:hv?")) >= 0) {
+    switch (opt) {
+    case '4':
+      v6_enabled = 0;
+      break;
+
+    case '6':
+      v4_enabled = 0;
+      break;
+
+    case 'c':
+      compress_level = atoi(optarg);
+      break;
+
+    case 'D':
+      if ((dstype = ipmeta_ds_name_to_id(optarg)) == IPMETA_DS_NONE) {
+        fprintf(stderr, "unknown data structure type \"%s\"\n", optarg);
+        dstype = IPMETA_DS_DEFAULT;
+        error = 1;
+      }
+      break;
+
+    case 'h':
+      headers_enabled = 1;
+      break;
+
+    case 'n':
+      if (new_providers_cnt == IPMETA_PROVIDER_MAX) {
+        fprintf(stderr, "ERROR: Too many providers given\n");
+        error = 1;
+        break;
+      }
+      new_providers[new_providers_cnt++] = strdup(optarg);
+      break;
+
+    case 'o':
+      outfile_name = strdup(optarg);
+      break;
+
+    case 'p':
+      if (old_providers_cnt == IPMETA_PROVIDER_MAX) {
+        fprintf(stderr, "ERROR: Too many providers given\n");
+        error = 1;
+        break;
+      }
+      old_providers[old_providers_cnt++] = strdup(optarg);
+      break;
+
+    case 'v':
+      fprintf(stderr, "libipmeta package version %s\n", PACKAGE_VERSION);
+      goto quit;
+
+    case '?':
+    default:
+      error = 1;
+      break;
+    }
+  }
+
+  /* this must be called before usage is called */
+  if ((old_ipmeta = ipmeta_init(dstype)) == NULL ||
+      (new_ipmeta = ipmeta_init(dstype)) == NULL) {
+    fprintf(stderr, "could not initialize libipmeta\n");
+    goto quit;
+  }
+
+  if (error || optind < argc || (v4_enabled == 0 && v6_enabled == 0)) {
+    usage(argv[0]);
+    goto quit;
+  }
+
+  /* reset getopt for others */
+  optind = 1;
+
+  /* -- call NO library functions which may use getopt before here -- */
+  /* this ESPECIALLY means ipmeta_enable_provider */
+
+  /* ensure there is at least one provider given */
+  if (old_providers_cnt == 0 && new_providers_cnt == 0) {
+    fprintf(stderr, "ERROR: At least one provider must be selected using -p "
+                    "or -n\n");
+    usage(argv[0]);
+    goto quit;
+  }
+
+  /* if we have been given a file to write to, open this now */
+  if (outfile_name != NULL) {
+    if ((outfile = wandio_wcreate(outfile_name,
+                                  wandio_detect_compression_type(outfile_name),
+                                  compress_level, O_CREAT)) == NULL) {
+      fprintf(stderr, "ERROR: Could not open %s for writing\n", outfile_name);
+      goto quit;
+    }
+  }
+
+  /* a provider that is only given for one side is compared against no data,
+     i.e. all of its ranges were added (or removed) */
+  if (enable_providers(old_ipmeta, old_providers, old_providers_cnt,
+                       &providermask) != 0 ||
+      enable_providers(new_ipmeta, new_providers, new_providers_cnt,
+                       &providermask) != 0) {
+    usage(argv[0]);
+    goto quit;
+  }
+
+  if (headers_enabled) {
+    ipmeta_printf(outfile, "change|");
+    ipmeta_write_record_header(outfile);
+  }
+
+  for (i = 1; i <= IPMETA_PROVIDER_MAX; i++) {
+    if ((providermask & IPMETA_PROV_TO_MASK(i)) == 0) {
+      continue;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.outfile = outfile;
+
+    if (v4_enabled &&
+        ipmeta_diff(old_ipmeta, new_ipmeta, AF_INET, i, write_change,
+                    &stats) != 0) {
+      fprintf(stderr, "ERROR: Could not compare IPv4 prefixes\n");
+      goto quit;
+    }
+    if (v6_enabled &&
+        ipmeta_diff(old_ipmeta, new_ipmeta, AF_INET6, i, write_change,
+                    &stats) != 0) {
+      fprintf(stderr, "ERROR: Could not compare IPv6 prefixes\n");
+      goto quit;
+    }
+
+    ipmeta_log(__func__,
+               "%s: %" PRIu64 " ranges changed (%" PRIu64 " IPv4 addresses, "
+               "%" PRIu64 " IPv6 /64s)",
+               ipmeta_get_provider_name(ipmeta_get_provider_by_id(old_ipmeta,
+                                                                  i)),
+               stats.ranges_cnt, stats.v4_ip_cnt, stats.v6_ip_cnt);
+  }
+
+  ipmeta_log(__func__, "done");
+  rc = 0;
+
+quit:
+  for (i = 0; i < old_providers_cnt; i++) {
+    if (old_providers[i] != NULL) {
+      free(old_providers[i]);
+    }
+  }
+  for (i = 0; i < new_providers_cnt; i++) {
+    if (new_providers[i] != NULL) {
+      free(new_providers[i]);
+    }
+  }
+
+  if (outfile_name != NULL) {
+    free(outfile_name);
+  }
+
+  if (old_ipmeta != NULL) {
+    ipmeta_free(old_ipmeta);
+  }
+  if (new_ipmeta != NULL) {
+    ipmeta_free(new_ipmeta);
+  }
+
+  if (outfile != NULL) {
+    wandio_wdestroy(outfile);
+  }
+
+  return rc;
+}
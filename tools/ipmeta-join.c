@@ -0,0 +1,316 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2013-2020 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <wandio.h>
+
+#include "libipmeta.h"
+#include "utils.h"
+
+#define DEFAULT_COMPRESS_LEVEL 6
+
+static ipmeta_t *ipmeta = NULL;
+static uint32_t providermask = 0;
+static ipmeta_provider_t *enabled_providers[IPMETA_PROVIDER_MAX];
+static int enabled_providers_cnt = 0;
+
+static int write_range(int family, void *firstp, void *lastp, uint64_t num_ips,
+                       ipmeta_record_t **records, void *user)
+{
+  iow_t *outfile = (iow_t *)user;
+  char first_str[INET6_ADDRSTRLEN];
+  char last_str[INET6_ADDRSTRLEN];
+  ipmeta_record_t *rec;
+  int i;
+
+  inet_ntop(family, firstp, first_str, sizeof(first_str));
+  inet_ntop(family, lastp, last_str, sizeof(last_str));
+  if (ipmeta_printf(outfile, "%s|%s|%" PRIu64, first_str, last_str,
+                    num_ips) < 0) {
+    return -1;
+  }
+
+  /* one column per provider, in the order they were enabled */
+  for (i = 0; i < enabled_providers_cnt; i++) {
+    rec = records[ipmeta_get_provider_id(enabled_providers[i]) - 1];
+    if (rec != NULL) {
+      ipmeta_printf(outfile, "|%" PRIu32, rec->id);
+    } else {
+      ipmeta_printf(outfile, "|");
+    }
+  }
+  return (ipmeta_printf(outfile, "\n") < 0) ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+  assert(ipmeta != NULL);
+  ipmeta_provider_t **providers = NULL;
+  int i;
+
+  // skip directory part of name
+  const char *p;
+  while ((p = strchr(name, '/')))
+    name = p + 1;
+
+  const char **dsnames = ipmeta_ds_get_all();
+  fprintf(stderr,
+      "usage: %s {-p provider}... [<other options>]\n"
+      "Write the address ranges over which the records of all the given\n"
+      "providers are constant, with the id of each provider's record.\n"
+      "options:\n"
+      "    -p <provider> enable the given provider (repeatable).\n"
+      "                  Use \"-p'<provider> -?'\" for help with provider.\n"
+      "                  Available providers:\n",
+      name);
+  /* get the available plugins from ipmeta */
+  providers = ipmeta_get_all_providers(ipmeta);
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    assert(providers[i] != NULL);
+    assert(ipmeta_get_provider_name(providers[i]));
+    fprintf(stderr, "                   - %s\n",
+            ipmeta_get_provider_name(providers[i]));
+  }
+  fprintf(stderr,
+      "    -D <struct>   data structure to use for storing prefixes\n"
+      "                  (default: %s)\n"
+      "                  Available datastructures:\n",
+      dsnames[IPMETA_DS_DEFAULT-1]);
+  for (i = 0; i < IPMETA_DS_MAX; i++) {
+    fprintf(stderr, "                   - %s\n", dsnames[i]);
+  }
+  free(dsnames);
+  fprintf(stderr,
+      "    -4            only join IPv4 prefixes\n"
+      "    -6            only join IPv6 prefixes\n"
+      "    -h            write out a header row with field names\n"
+      "    -o <outfile>  write results to the given file\n"
+      "    -c <level>    compression level to use for <outfile> "
+      "(default: %d)\n",
+      DEFAULT_COMPRESS_LEVEL);
+}
+
+int main(int argc, char **argv)
+{
+  int rc = 1; // default to error
+  int i;
+  int opt;
+  /* we MUST not use any of the getopt global vars outside of arg parsing */
+  /* this is because the plugins can use get opt to parse their config */
+  int error = 0;
+
+  char *providers[IPMETA_PROVIDER_MAX];
+  int providers_cnt = 0;
+  char *provider_arg_ptr = NULL;
+  ipmeta_provider_t *provider = NULL;
+
+  int headers_enabled = 0;
+  int v4_enabled = 1;
+  int v6_enabled = 1;
+
+  int compress_level = DEFAULT_COMPRESS_LEVEL;
+  char *outfile_name = NULL;
+  iow_t *outfile = NULL;
+  ipmeta_ds_id_t dstype = IPMETA_DS_DEFAULT;
+
+  /* initialize the providers array to NULL first */
+  memset(providers, 0, sizeof(char *) * IPMETA_PROVIDER_MAX);
+
+  while ((opt = getopt(argc, argv, "46D:c:o:p:hv?")) >= 0) {
+    switch (opt) {
+    case '4':
+      v6_enabled = 0;
+      break;
+
+    case '6':
+      v4_enabled = 0;
+      break;
+
+    case 'c':
+      compress_level = atoi(optarg);
+      break;
+
+    case 'D':
+      if ((dstype = ipmeta_ds_name_to_id(optarg)) == IPMETA_DS_NONE) {
+        fprintf(stderr, "unknown data structure type \"%s\"\n", optarg);
+        dstype = IPMETA_DS_DEFAULT;
+        error = 1;
+      }
+      break;
+
+    case 'h':
+      headers_enabled = 1;
+      break;
+
+    case 'o':
+      outfile_name = strdup(optarg);
+      break;
+
+    case 'p':
+      if (providers_cnt == IPMETA_PROVIDER_MAX) {
+        fprintf(stderr, "ERROR: Too many providers given\n");
+        error = 1;
+        break;
+      }
+      providers[providers_cnt++] = strdup(optarg);
+      break;
+
+    case 'v':
+      fprintf(stderr, "libipmeta package version %s\n", PACKAGE_VERSION);
+      goto quit;
+
+    case '?':
+    default:
+      error = 1;
+      break;
+    }
+  }
+
+  /* this must be called before usage is called */
+  if ((ipmeta = ipmeta_init(dstype)) == NULL) {
+    fprintf(stderr, "could not initialize libipmeta\n");
+    goto quit;
+  }
+
+  if (error || optind < argc || (v4_enabled == 0 && v6_enabled == 0)) {
+    usage(argv[0]);
+    goto quit;
+  }
+
+  /* reset getopt for others */
+  optind = 1;
+
+  /* -- call NO library functions which may use getopt before here -- */
+  /* this ESPECIALLY means ipmeta_enable_provider */
+
+  /* ensure there is at least one provider given */
+  if (providers_cnt == 0) {
+    fprintf(stderr, "ERROR: At least one provider must be selected using -p\n");
+    usage(argv[0]);
+    goto quit;
+  }
+
+  /* if we have been given a file to write to, open this now */
+  if (outfile_name != NULL) {
+    if ((outfile = wandio_wcreate(outfile_name,
+                                  wandio_detect_compression_type(outfile_name),
+                                  compress_level, O_CREAT)) == NULL) {
+      fprintf(stderr, "ERROR: Could not open %s for writing\n", outfile_name);
+      goto quit;
+    }
+  }
+
+  for (i = 0; i < providers_cnt; i++) {
+    /* the string at providers[i] will contain the name of the plugin,
+       optionally followed by a space and then the arguments to pass
+       to the plugin */
+    if ((provider_arg_ptr = strchr(providers[i], ' ')) != NULL) {
+      *provider_arg_ptr = '\0';
+      provider_arg_ptr++;
+    }
+
+    /* lookup the provider using the name given */
+    if ((provider = ipmeta_get_provider_by_name(ipmeta, providers[i])) ==
+        NULL) {
+      fprintf(stderr, "ERROR: Invalid provider name (%s)\n", providers[i]);
+      usage(argv[0]);
+      goto quit;
+    }
+
+    if (ipmeta_enable_provider(ipmeta, provider, provider_arg_ptr) != 0) {
+      fprintf(stderr, "ERROR: Could not enable plugin %s\n", providers[i]);
+      goto quit;
+    }
+    providermask |= IPMETA_PROV_TO_MASK(ipmeta_get_provider_id(provider));
+    enabled_providers[enabled_providers_cnt++] = provider;
+  }
+
+  if (headers_enabled) {
+    ipmeta_printf(outfile, "first-addr|last-addr|num-ips");
+    for (i = 0; i < enabled_providers_cnt; i++) {
+      ipmeta_printf(outfile, "|%s-id",
+                    ipmeta_get_provider_name(enabled_providers[i]));
+    }
+    ipmeta_printf(outfile, "\n");
+  }
+
+  if (v4_enabled &&
+      ipmeta_join(ipmeta, AF_INET, providermask, write_range, outfile) != 0) {
+    fprintf(stderr, "ERROR: Could not join IPv4 prefixes\n");
+    goto quit;
+  }
+  if (v6_enabled &&
+      ipmeta_join(ipmeta, AF_INET6, providermask, write_range, outfile) != 0) {
+    fprintf(stderr, "ERROR: Could not join IPv6 prefixes\n");
+    goto quit;
+  }
+
+  ipmeta_log(__func__, "done");
+  rc = 0;
+
+quit:
+  for (i = 0; i < providers_cnt; i++) {
+    if (providers[i] != NULL) {
+      free(providers[i]);
+    }
+  }
+
+  if (outfile_name != NULL) {
+    free(outfile_name);
+  }
+
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+
+  if (outfile != NULL) {
+    wandio_wdestroy(outfile);
+  }
+
+  return rc;
+}
@@ -53,9 +53,12 @@
 #include "ipmeta_ds.h"
 #include "utils.h"
 
-/** The length of the static line buffer */
+/** The length of the static output prefix buffer */
 #define BUFFER_LEN 1024
 
+/** The size of the blocks read from the input file */
+#define READ_BUFFER_LEN (1024 * 1024)
+
 #define DEFAULT_COMPRESS_LEVEL 6
 
 static ipmeta_t *ipmeta = NULL;
@@ -64,30 +67,123 @@ static ipmeta_provider_t *enabled_providers[IPMETA_PROVIDER_MAX];
 static int enabled_providers_cnt = 0;
 static ipmeta_record_set_t *records;
 
-static int lookup(const char *addr_str, iow_t *outfile)
+static void write_records(const char *addr_str, size_t addr_len,
+                          iow_t *outfile)
 {
   char output_prefix[BUFFER_LEN];
 
-  if (ipmeta_lookup(ipmeta, addr_str, providermask, records) < 0) {
-    fprintf(stderr, "ERROR: invalid address or prefix \"%s\"\n", addr_str);
-    return -1;
-  }
-
-  /* look it up using each provider */
+  /* write out the matches for each provider */
   for (int id = 1; id <= IPMETA_PROVIDER_MAX; id++) {
     if ((providermask & IPMETA_PROV_TO_MASK(id)) == 0) {
       continue;
     }
 
-    snprintf(output_prefix, sizeof(output_prefix), "%s|%s",
+    snprintf(output_prefix, sizeof(output_prefix), "%s|%.*s",
       ipmeta_get_provider_name(ipmeta_get_provider_by_id(ipmeta, id)),
-      addr_str);
+      (int)addr_len, addr_str);
     ipmeta_write_record_set_by_provider(records, outfile, output_prefix, id);
   }
+}
 
+static int lookup(const char *addr_str, iow_t *outfile)
+{
+  if (ipmeta_lookup(ipmeta, addr_str, providermask, records) < 0) {
+    fprintf(stderr, "ERROR: invalid address or prefix \"%s\"\n", addr_str);
+    return -1;
+  }
+
+  write_records(addr_str, strlen(addr_str), outfile);
   return 0;
 }
 
+/** State shared with the ipmeta_lookup_lines callback */
+typedef struct lookup_file_state {
+  iow_t *outfile;
+  int error;
+} lookup_file_state_t;
+
+static int lookup_line(const char *addr_str, size_t addr_len, int found_cnt,
+                       ipmeta_record_set_t *found, void *user)
+{
+  lookup_file_state_t *state = (lookup_file_state_t *)user;
+
+  if (found_cnt < 0) {
+    fprintf(stderr, "ERROR: invalid address or prefix \"%.*s\"\n",
+            (int)addr_len, addr_str);
+    state->error = 1;
+    return 0;
+  }
+
+  write_records(addr_str, addr_len, state->outfile);
+  return 0;
+}
+
+/* Look up every line of the given file, handing complete lines from each
+ * block read to ipmeta_lookup_lines */
+static int lookup_file(io_t *file, iow_t *outfile)
+{
+  lookup_file_state_t state = {outfile, 0};
+  size_t buffer_len = READ_BUFFER_LEN;
+  char *buffer = NULL;
+  char *tmp;
+  size_t pending = 0;
+  size_t done;
+  int64_t read_len;
+
+  if ((buffer = malloc(buffer_len)) == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate read buffer\n");
+    return -1;
+  }
+
+  while ((read_len = wandio_read(file, buffer + pending,
+                                 buffer_len - pending)) > 0) {
+    pending += read_len;
+
+    /* find the end of the last complete line */
+    for (done = pending; done > 0 && buffer[done - 1] != '\n'; done--)
+      ;
+
+    if (done == 0) {
+      /* no complete line yet, make room for a longer one */
+      if (pending == buffer_len) {
+        if ((tmp = realloc(buffer, buffer_len * 2)) == NULL) {
+          fprintf(stderr, "ERROR: Could not grow read buffer\n");
+          goto err;
+        }
+        buffer = tmp;
+        buffer_len *= 2;
+      }
+      continue;
+    }
+
+    if (ipmeta_lookup_lines(ipmeta, buffer, done, providermask, records,
+                            lookup_line, &state) < 0) {
+      goto err;
+    }
+
+    memmove(buffer, buffer + done, pending - done);
+    pending -= done;
+  }
+
+  if (read_len < 0) {
+    fprintf(stderr, "ERROR: Failed to read input file\n");
+    goto err;
+  }
+
+  /* the last line may not have been newline-terminated */
+  if (pending > 0 && ipmeta_lookup_lines(ipmeta, buffer, pending, providermask,
+                                         records, lookup_line, &state) < 0) {
+    goto err;
+  }
+
+  free(buffer);
+  return state.error ? -1 : 0;
+
+err:
+  free(buffer);
+  return -1;
+}
+
 static void usage(const char *name)
 {
   assert(ipmeta != NULL);
@@ -125,6 +221,8 @@ static void usage(const char *name)
   }
   free(dsnames);
   fprintf(stderr,
+      "    -a            report each record matched by a prefix once, with\n"
+      "                  the number of addresses (or /64s) that map to it\n"
       "    -h            write out a header row with field names\n"
       "    -o <outfile>  write results to the given file\n"
       "    -c <level>    compression level to use for <outfile> "
@@ -146,8 +244,6 @@ int main(int argc, char **argv)
 
   char *ip_file = NULL;
   io_t *file = NULL;
-  char *p = NULL;
-  char buffer[BUFFER_LEN];
 
   char *providers[IPMETA_PROVIDER_MAX];
   int providers_cnt = 0;
@@ -167,8 +263,16 @@ int main(int argc, char **argv)
   /* initialize the providers array to NULL first */
   memset(providers, 0, sizeof(char *) * IPMETA_PROVIDER_MAX);
 
-  while ((opt = getopt(argc, argv, "D:c:f:o:p:hv?")) >= 0) {
+  while ((opt = getopt(argc, argv, "D:c:f:o:p:ahv?")) >= 0) {
     switch (opt) {
+    case 'a':
+      if (ipmeta_record_set_set_aggregation(records, IPMETA_AGGR_RECORD,
+                                            IPMETA_ATTR_NONE) != 0) {
+        fprintf(stderr, "ERROR: could not enable aggregation\n");
+        goto quit;
+      }
+      break;
+
     case 'c':
       compress_level = atoi(optarg);
       break;
@@ -299,20 +403,8 @@ int main(int argc, char **argv)
           strerror(errno));
       rc = 1;
     } else {
-      while (wandio_fgets(file, &buffer, BUFFER_LEN, 1) > 0) {
-        /* treat # as comment line, and ignore empty lines */
-        if (buffer[0] == '#' || buffer[0] == '\0') {
-          continue;
-        }
-
-        /* convenience to allow flowtuple files to be fed directly in */
-        if ((p = strchr(buffer, '|')) != NULL) {
-          *p = '\0';
-        }
-
-        if (lookup(buffer, outfile) != 0)
-          rc = 1;
-      }
+      if (lookup_file(file, outfile) != 0)
+        rc = 1;
     }
   }
 